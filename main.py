@@ -64,6 +64,100 @@ def send(stl_ascii):
   s.connect(("172.18.192.1", 4242))
   s.send(stl_ascii.encode())
 
+class Viewer:
+  """One connection to a viewer that any number of framed messages go over,
+  see viewers/giewer/Protocol.h for the layout"""
+  MAGIC = b"GIEW"
+  MESH = 1
+  PATCH = 2
+  TRANSFORM = 5
+  VISIBILITY = 6
+  REMOVE = 7
+  SESSION = 8
+  SWAP = 9
+
+  EDITABLE = 1
+  SHARED_MEMORY = 2
+
+  def __init__(self, host="172.18.192.1", port=4242, path=None):
+    """Connects over TCP, or to the viewer's Unix-domain socket at path
+    (GIEWER_SOCKET on the viewer side) when it runs on the same machine"""
+    import socket
+    if path:
+      self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+      self._sock.connect(path)
+    else:
+      self._sock = socket.create_connection((host, port))
+
+  def message(self, type, object_id, payload, flags=0):
+    import struct
+    header = struct.pack("<4sHHQQ", self.MAGIC, type, flags, object_id, len(payload))
+    self._sock.sendall(header)
+    self._sock.sendall(payload)
+
+  def mesh(self, object_id, mesh, editable=False):
+    """editable meshes keep their triangles in order so patch() can edit them"""
+    flags = self.EDITABLE if editable else 0
+    self.message(self.MESH, object_id, mesh.stl().encode(), flags)
+
+  def mesh_shared(self, object_id, data, editable=False):
+    """Sends model file bytes as a sealed memfd, which the viewer maps
+    instead of reading. Linux and the Unix-domain socket only."""
+    import os
+    import fcntl
+    import socket
+    import struct
+    fd = os.memfd_create("giewer-mesh", os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+    try:
+      view = memoryview(data)
+      while view:
+        view = view[os.write(fd, view):]
+      fcntl.fcntl(fd, fcntl.F_ADD_SEALS,
+        fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW | fcntl.F_SEAL_WRITE | fcntl.F_SEAL_SEAL)
+      flags = self.SHARED_MEMORY | (self.EDITABLE if editable else 0)
+      header = struct.pack("<4sHHQQ", self.MAGIC, self.MESH, flags, object_id, 0)
+      socket.send_fds(self._sock, [header], [fd])
+    finally:
+      os.close(fd)
+
+  def patch(self, object_id, first, replace, triangles):
+    """Replaces triangles [first, first + replace) of an editable mesh with
+    triangles, an (n, 3, 3) array of positions"""
+    import struct
+    import numpy
+    triangles = numpy.ascontiguousarray(triangles, dtype="<f4").reshape(-1, 3, 3)
+    payload = struct.pack("<IIII", first, replace, len(triangles), 0) + triangles.tobytes()
+    self.message(self.PATCH, object_id, payload)
+
+  def transform(self, object_id, matrix):
+    """Places a mesh with a 4x4 row-major matrix, without resending it"""
+    import numpy
+    matrix = numpy.asarray(matrix, dtype="<f4").reshape(4, 4)
+    # glm reads the floats column by column
+    self.message(self.TRANSFORM, object_id, numpy.ascontiguousarray(matrix.T).tobytes())
+
+  def show(self, object_id, visible=True):
+    import struct
+    self.message(self.VISIBILITY, object_id, struct.pack("<I", 1 if visible else 0))
+
+  def remove(self, object_id):
+    """Takes a mesh out of the scene, object_id can then be sent again.
+    0 clears the whole session."""
+    self.message(self.REMOVE, object_id, b"")
+
+  def session(self, session_id=0):
+    """Works in the shared session session_id from now on, or with 0 in a
+    session of this connection's own that goes when it's closed"""
+    self.message(self.SESSION, session_id, b"")
+
+  def swap(self, session_id):
+    """Trades this session's meshes with those of shared session
+    session_id in one step"""
+    self.message(self.SWAP, session_id, b"")
+
+  def close(self):
+    self._sock.close()
+
 m = Mesh()
 m.load("viewers/test_files/teapot.stl")
 #box = Mesh(trimesh.creation.box((1, 1, 1)))
@@ -0,0 +1,445 @@
+// Ingest benchmark for the loaders and mesh processing shared by the
+// viewers. Needs neither Vulkan nor Qt; results are printed as JSON so runs
+// can be diffed against each other.
+//
+//   loaderbench [--file teapot.stl] [--scales 1,16,64] [--repeat 3]
+
+#include "../giewer/Loader.h"
+#include "../giewer/Welder.h"
+#include "../giewer/CompactMesh.h"
+#include "../qiewer/src/Dedupe.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <functional>
+#include <algorithm>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// High-water mark of the process, so it only ever grows from one case to
+// the next. Scales run smallest first to keep it meaningful.
+static double peakRssMB()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    return 0.0;
+  }
+  return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0.0;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// Best of repeat runs, setup() is called before each one and isn't timed
+static double timeBest(unsigned repeat, const std::function<void()> &setup, const std::function<void()> &run)
+{
+  double best = 0.0;
+  for (unsigned i = 0; i < repeat; i++)
+  {
+    setup();
+    auto start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    if (i == 0 || secs.count() < best) {
+      best = secs.count();
+    }
+  }
+  return best;
+}
+
+class Report
+{
+private:
+  std::ostringstream _out;
+  bool _first = true;
+
+public:
+  void add(const char *name, unsigned scale, unsigned threads, size_t bytes, size_t triangles, double secs)
+  {
+    char line[512];
+    snprintf(line, sizeof(line),
+      "%s    {\"name\": \"%s\", \"scale\": %u, \"threads\": %u, \"bytes\": %zu, \"triangles\": %zu, "
+      "\"seconds\": %.6f, \"mb_per_s\": %.1f, \"tris_per_s\": %.0f, \"peak_rss_mb\": %.1f}",
+      _first ? "" : ",\n", name, scale, threads, bytes, triangles,
+      secs, bytes / (1024.0 * 1024.0) / secs, triangles / secs, peakRssMB());
+    _out << line;
+    _first = false;
+  }
+
+  std::string str() const { return _out.str(); }
+};
+
+class ArraySink : public TriangleSink
+{
+public:
+  std::vector<glm::vec3> _verts;
+
+  virtual void reserve(size_t triangles) { _verts.resize(triangles * 3); }
+  virtual void triangle(size_t index, const glm::vec3 *v) { std::copy(v, v + 3, _verts.data() + index * 3); }
+  virtual void finish() {}
+};
+
+// Counts what the streaming parser delivers without keeping it
+class CountingSink : public TriangleSink
+{
+public:
+  size_t _triangles = 0;
+
+  virtual void reserve(size_t) {}
+  virtual void triangle(size_t, const glm::vec3 *) { _triangles++; }
+  virtual void finish() {}
+};
+
+// Exposes the parallel ASCII reader, which load_stl only picks for files
+// larger than a scaled teapot
+class BenchLoader : public Loader
+{
+public:
+  using Loader::Loader;
+  using Loader::read_stl_ascii_parallel;
+};
+
+// The straightforward dedupe: sort the positions, drop the repeats and look
+// every corner up. Gives the same vertex order and indices as
+// mesh_from_verts, just slower.
+static Mesh *naiveMesh(const std::vector<Vertex> &verts)
+{
+  std::vector<Vertex> unique(verts);
+  std::sort(unique.begin(), unique.end());
+  unique.erase(std::unique(unique.begin(), unique.end(),
+    [](const Vertex &a, const Vertex &b) { return !(a != b); }), unique.end());
+
+  std::vector<float> positions;
+  positions.reserve(unique.size() * 3);
+  for (auto &v : unique) {
+    positions.insert(positions.end(), { v.x, v.y, v.z });
+  }
+
+  std::vector<unsigned int> indices;
+  indices.reserve(verts.size());
+  for (auto &v : verts) {
+    indices.push_back((unsigned int)(std::lower_bound(unique.begin(), unique.end(), v) - unique.begin()));
+  }
+
+  return new Mesh(std::move(positions), std::move(indices));
+}
+
+// Copies of the model laid side by side along x so that nothing welds or
+// dedupes across copies, as in an assembly of many separate parts.
+static std::vector<glm::vec3> scaleModel(const std::vector<glm::vec3> &verts, unsigned scale)
+{
+  float minX = verts[0].x, maxX = verts[0].x;
+  for (auto &v : verts)
+  {
+    minX = std::min(minX, v.x);
+    maxX = std::max(maxX, v.x);
+  }
+  float step = (maxX - minX) * 1.25f + 1.0f;
+
+  std::vector<glm::vec3> out;
+  out.reserve(verts.size() * scale);
+  for (unsigned i = 0; i < scale; i++)
+  {
+    for (auto &v : verts) {
+      out.push_back(glm::vec3(v.x + step * i, v.y, v.z));
+    }
+  }
+  return out;
+}
+
+static std::string toAscii(const std::vector<glm::vec3> &verts)
+{
+  std::string out = "solid bench\n";
+  char facet[512];
+  for (size_t i = 0; i + 2 < verts.size(); i += 3)
+  {
+    const glm::vec3 *v = &verts[i];
+    int n = snprintf(facet, sizeof(facet),
+      "  facet normal 0 0 0\n    outer loop\n"
+      "      vertex %e %e %e\n      vertex %e %e %e\n      vertex %e %e %e\n"
+      "    endloop\n  endfacet\n",
+      v[0].x, v[0].y, v[0].z, v[1].x, v[1].y, v[1].z, v[2].x, v[2].y, v[2].z);
+    out.append(facet, n);
+  }
+  out += "endsolid bench\n";
+  return out;
+}
+
+static std::string toBinary(const std::vector<glm::vec3> &verts)
+{
+  uint32_t count = (uint32_t)(verts.size() / 3);
+  std::string out(80, '\0');
+  out.append((const char *)&count, sizeof(count));
+
+  char facet[50] = {};
+  for (size_t i = 0; i + 2 < verts.size(); i += 3)
+  {
+    memcpy(facet + 12, &verts[i], 36);
+    out.append(facet, sizeof(facet));
+  }
+  return out;
+}
+
+// Indexed formats are written from the welded mesh, as a mesh tool would
+static std::string toObj(const Welder &welder)
+{
+  std::string out = "# bench\n";
+  char line[128];
+  for (auto &v : welder.vertices())
+  {
+    int n = snprintf(line, sizeof(line), "v %.9g %.9g %.9g\n", v._vertex.x, v._vertex.y, v._vertex.z);
+    out.append(line, n);
+  }
+  const std::vector<uint32_t> &idx = welder.indices();
+  for (size_t i = 0; i + 2 < idx.size(); i += 3)
+  {
+    int n = snprintf(line, sizeof(line), "f %u %u %u\n", idx[i] + 1, idx[i + 1] + 1, idx[i + 2] + 1);
+    out.append(line, n);
+  }
+  return out;
+}
+
+static std::string toPly(const Welder &welder)
+{
+  const std::vector<uint32_t> &idx = welder.indices();
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+    "ply\nformat binary_little_endian 1.0\nelement vertex %zu\n"
+    "property float x\nproperty float y\nproperty float z\n"
+    "element face %zu\nproperty list uchar int vertex_indices\nend_header\n",
+    welder.vertices().size(), idx.size() / 3);
+
+  std::string out(header, n);
+  for (auto &v : welder.vertices()) {
+    out.append((const char *)&v._vertex, sizeof(v._vertex));
+  }
+  for (size_t i = 0; i + 2 < idx.size(); i += 3)
+  {
+    out.push_back(3);
+    out.append((const char *)&idx[i], 3 * sizeof(uint32_t));
+  }
+  return out;
+}
+
+static std::vector<unsigned> threadCounts()
+{
+  unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<unsigned> counts;
+  for (unsigned t = 1; t < hw; t *= 2) {
+    counts.push_back(t);
+  }
+  counts.push_back(hw);
+  return counts;
+}
+
+static void benchScale(Report &report, const std::vector<glm::vec3> &model, unsigned scale, unsigned repeat)
+{
+  std::vector<glm::vec3> verts = scaleModel(model, scale);
+  size_t tris = verts.size() / 3;
+
+  std::string ascii = toAscii(verts);
+  std::string binary = toBinary(verts);
+  std::vector<glm::vec3> result;
+
+  // Checked once before timing, the timed runs only check counts. ASCII
+  // rounds the positions, so the parallel reader is held to the serial one.
+  std::vector<glm::vec3> serial = Loader(1).load_stl(ascii.data(), ascii.size());
+  if (serial.size() != verts.size()) {
+    throw std::runtime_error("ascii load returned the wrong vertex count");
+  }
+  for (unsigned threads : threadCounts())
+  {
+    ArraySink sink;
+    if (!BenchLoader(threads).read_stl_ascii_parallel(ascii.data(), ascii.size(), threads, sink) || sink._verts != serial) {
+      throw std::runtime_error("parallel ascii load did not match the serial one");
+    }
+  }
+
+  for (unsigned threads : threadCounts())
+  {
+    Loader loader(threads);
+    double secs = timeBest(repeat, [&]() { result.clear(); }, [&]() {
+      result = loader.load_stl(ascii.data(), ascii.size());
+    });
+    if (result.size() != verts.size()) {
+      throw std::runtime_error("ascii load returned the wrong vertex count");
+    }
+    report.add("load_stl_ascii", scale, threads, ascii.size(), tris, secs);
+  }
+
+  {
+    Loader loader(1);
+    double secs = timeBest(repeat, [&]() { result.clear(); }, [&]() {
+      result = loader.load_stl(binary.data(), binary.size());
+    });
+    if (result != verts) {
+      throw std::runtime_error("binary load did not return the original triangles");
+    }
+    report.add("load_stl_binary", scale, 1, binary.size(), tris, secs);
+  }
+
+  // The socket path: 64KB reads pushed through StlParser
+  const char *names[] = { "stream_stl_ascii", "stream_stl_binary" };
+  const std::string *inputs[] = { &ascii, &binary };
+  for (int i = 0; i < 2; i++)
+  {
+    const std::string &input = *inputs[i];
+    CountingSink sink;
+    double secs = timeBest(repeat, [&]() { sink._triangles = 0; }, [&]() {
+      StlParser parser(sink);
+      for (size_t off = 0; off < input.size(); off += 64 * 1024) {
+        parser.feed(input.data() + off, std::min<size_t>(64 * 1024, input.size() - off));
+      }
+      parser.finish();
+    });
+    if (sink._triangles != tris) {
+      throw std::runtime_error("streamed load returned the wrong triangle count");
+    }
+    report.add(names[i], scale, 1, input.size(), tris, secs);
+  }
+
+  // What LitMesh::finish() does before uploading
+  {
+    Welder welder;
+    double secs = timeBest(repeat, []() {}, [&]() {
+      welder.weld(verts.data(), tris);
+    });
+    report.add("lit_mesh_weld", scale, 1, verts.size() * sizeof(glm::vec3), tris, secs);
+
+    const char *names[] = { "load_ply_binary", "load_obj" };
+    std::string inputs[] = { toPly(welder), toObj(welder) };
+    for (int i = 0; i < 2; i++)
+    {
+      const std::string &input = inputs[i];
+      Loader loader(1);
+      ArraySink sink;
+      double secs = timeBest(repeat, [&]() { sink._verts.clear(); }, [&]() {
+        loader.load(input.data(), input.size(), sink);
+      });
+      if (sink._verts != verts) {
+        throw std::runtime_error(std::string(names[i]) + " did not return the original triangles");
+      }
+      report.add(names[i], scale, 1, input.size(), tris, secs);
+    }
+
+    // The viewer's native path: decode into LitVertex layout and indices
+    static_assert(sizeof(CompactMesh::Vertex) == sizeof(Welder::Vertex), "CompactMesh::Vertex must match Welder::Vertex");
+    std::string compact = CompactMesh::encode(
+      (const CompactMesh::Vertex *)welder.vertices().data(), (uint32_t)welder.vertices().size(),
+      welder.indices().data(), (uint32_t)welder.indices().size()
+    );
+    std::vector<CompactMesh::Vertex> decoded(welder.vertices().size());
+    std::vector<uint32_t> indices(welder.indices().size());
+    secs = timeBest(repeat, []() {}, [&]() {
+      CompactMesh mesh(compact.data(), compact.size());
+      mesh.decodeIndices(indices.data());
+      mesh.decodeVertices(decoded.data());
+    });
+    if (indices != welder.indices()) {
+      throw std::runtime_error("decode_compact did not return the original indices");
+    }
+    report.add("decode_compact", scale, 1, compact.size(), tris, secs);
+  }
+
+  std::vector<Vertex> qverts(verts.size());
+  for (size_t i = 0; i < verts.size(); i++) {
+    qverts[i] = Vertex(verts[i].x, verts[i].y, verts[i].z);
+  }
+
+  std::unique_ptr<Mesh> expected(naiveMesh(qverts));
+
+  for (unsigned threads : threadCounts())
+  {
+    std::vector<Vertex> scratch = qverts;
+    std::unique_ptr<Mesh> checked(mesh_from_verts((unsigned int)tris, scratch, threads));
+    if (checked->vertices != expected->vertices || checked->indices != expected->indices) {
+      throw std::runtime_error("mesh_from_verts did not match the naive dedupe");
+    }
+
+    Mesh *mesh = nullptr;
+    double secs = timeBest(repeat, [&]() { scratch = qverts; delete mesh; mesh = nullptr; }, [&]() {
+      mesh = mesh_from_verts((unsigned int)tris, scratch, threads);
+    });
+    delete mesh;
+    report.add("mesh_from_verts", scale, threads, qverts.size() * 3 * sizeof(float), tris, secs);
+  }
+}
+
+static std::vector<unsigned> parseScales(const std::string &arg)
+{
+  std::vector<unsigned> scales;
+  std::istringstream in(arg);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    scales.push_back((unsigned)std::max(1, std::stoi(item)));
+  }
+  std::sort(scales.begin(), scales.end());
+  return scales;
+}
+
+int main(int argc, char **argv)
+{
+  std::string file = "../test_files/teapot.stl";
+  std::vector<unsigned> scales = { 1, 16, 64 };
+  unsigned repeat = 3;
+
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--file") == 0) {
+      file = argv[i + 1];
+    } else if (strcmp(argv[i], "--scales") == 0) {
+      scales = parseScales(argv[i + 1]);
+    } else if (strcmp(argv[i], "--repeat") == 0) {
+      repeat = (unsigned)std::max(1, atoi(argv[i + 1]));
+    } else {
+      std::cerr << "unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  try
+  {
+    std::vector<glm::vec3> model = Loader().load_stl(file);
+    if (model.empty()) {
+      throw std::runtime_error("no triangles in " + file);
+    }
+
+    Report report;
+    for (unsigned scale : scales) {
+      benchScale(report, model, scale, repeat);
+    }
+
+    std::cout << "{\n  \"file\": \"" << file << "\",\n"
+              << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+              << "  \"repeat\": " << repeat << ",\n"
+              << "  \"results\": [\n" << report.str() << "\n  ]\n}" << std::endl;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,374 @@
+#include "CompactMesh.h"
+
+#include <cmath>
+#include <vector>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+static const char COMPACT_MAGIC[4] = { 'G', 'C', 'M', '1' };
+
+static_assert(sizeof(CompactMesh::Header) == 40, "CompactMesh::Header must match the wire layout");
+
+const uint32_t CompactMesh::INDEX_BLOCK;
+
+static const size_t POSITION_LEN = 3 * sizeof(uint16_t);
+static const size_t NORMAL_LEN = 2 * sizeof(int16_t);
+
+// Below this many vertices (or index blocks) a mesh is decoded on the
+// calling thread, starting workers would cost more than it saves.
+static const uint32_t PARALLEL_MIN_VERTICES = 256 * 1024;
+static const uint32_t PARALLEL_MIN_BLOCKS = 4;
+
+// Runs fn(first, count) over [0, total) in up to threads contiguous pieces,
+// the calling thread taking the first. Exceptions reach the caller.
+template <typename Fn>
+static void parallelFor(uint32_t total, unsigned threads, Fn fn)
+{
+  threads = std::max(1u, std::min<unsigned>(threads, total));
+  uint32_t step = (uint32_t)(((uint64_t)total + threads - 1) / threads);
+
+  std::vector<std::future<void>> futures;
+  for (uint32_t first = step; first < total; first += step) {
+    futures.push_back(std::async(std::launch::async, fn, first, std::min(step, total - first)));
+  }
+  fn(0, std::min(step, total));
+  for (auto &future : futures) {
+    future.get();
+  }
+}
+
+static unsigned threadCount(unsigned threads)
+{
+  return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+static uint32_t blockCountFor(uint32_t indexCount)
+{
+  return (uint32_t)(((uint64_t)indexCount + CompactMesh::INDEX_BLOCK - 1) / CompactMesh::INDEX_BLOCK);
+}
+
+static inline uint32_t readU32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Unit vector onto the octahedron, unfolded into the [-1, 1] square
+static void octEncode(glm::vec3 n, int16_t out[2])
+{
+  float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  if (!(l1 > 0.0f)) {
+    n = glm::vec3(0.0f, 0.0f, 1.0f);
+    l1 = 1.0f;
+  }
+
+  float x = n.x / l1, y = n.y / l1;
+  if (n.z < 0.0f)
+  {
+    float fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = fx;
+    y = fy;
+  }
+
+  out[0] = (int16_t)std::lround(std::clamp(x, -1.0f, 1.0f) * 32767.0f);
+  out[1] = (int16_t)std::lround(std::clamp(y, -1.0f, 1.0f) * 32767.0f);
+}
+
+static inline glm::vec3 octDecode(int16_t qx, int16_t qy)
+{
+  const float snorm = 1.0f / 32767.0f;
+  float x = std::max(qx * snorm, -1.0f);
+  float y = std::max(qy * snorm, -1.0f);
+  float z = 1.0f - std::abs(x) - std::abs(y);
+
+  // Folds the lower hemisphere back, copysign keeps this branch-free
+  float t = std::max(-z, 0.0f);
+  x -= std::copysign(t, x);
+  y -= std::copysign(t, y);
+
+  float inv = 1.0f / std::sqrt(x * x + y * y + z * z);
+  return glm::vec3(x * inv, y * inv, z * inv);
+}
+
+bool CompactMesh::sniff(const char *data, size_t size)
+{
+  return size >= sizeof(Header) && memcmp(data, COMPACT_MAGIC, sizeof(COMPACT_MAGIC)) == 0;
+}
+
+CompactMesh::CompactMesh(const char *data, size_t size)
+{
+  if (!sniff(data, size)) {
+    throw std::runtime_error("bad compact mesh: no header");
+  }
+  memcpy(&_header, data, sizeof(_header));
+
+  if (_header.indexCount % 3) {
+    throw std::runtime_error("bad compact mesh: index count isn't whole triangles");
+  }
+
+  uint64_t expected = sizeof(Header) +
+    (uint64_t)_header.vertexCount * (POSITION_LEN + NORMAL_LEN) + _header.indexBytes;
+  if (expected != size) {
+    throw std::runtime_error("bad compact mesh: size doesn't match its header");
+  }
+
+  _positions = data + sizeof(Header);
+  _normals = _positions + (size_t)_header.vertexCount * POSITION_LEN;
+  _blocks = (const uint8_t *)(_normals + (size_t)_header.vertexCount * NORMAL_LEN);
+
+  _blockCount = blockCountFor(_header.indexCount);
+  size_t tableLen = (size_t)_blockCount * sizeof(uint32_t);
+  if (tableLen > _header.indexBytes) {
+    throw std::runtime_error("bad compact mesh: index block table truncated");
+  }
+  _indices = _blocks + tableLen;
+
+  // Checked once here so that a block's byte range is always in bounds
+  uint32_t streamLen = _header.indexBytes - (uint32_t)tableLen;
+  uint32_t previous = 0;
+  for (uint32_t b = 0; b < _blockCount; b++)
+  {
+    uint32_t offset = readU32(_blocks + b * sizeof(uint32_t));
+    if ((b == 0 && offset != 0) || offset < previous || offset > streamLen) {
+      throw std::runtime_error("bad compact mesh: corrupt index block table");
+    }
+    previous = offset;
+  }
+}
+
+void CompactMesh::decodeVertices(Vertex *out, unsigned threads) const
+{
+  if (_header.vertexCount < PARALLEL_MIN_VERTICES) {
+    threads = 1;
+  }
+  parallelFor(_header.vertexCount, threadCount(threads), [this, out](uint32_t first, uint32_t count) {
+    decodeVertexRange(out, first, count);
+  });
+}
+
+void CompactMesh::decodeVertexRange(Vertex *out, uint32_t first, uint32_t count) const
+{
+  const glm::vec3 origin(_header.origin[0], _header.origin[1], _header.origin[2]);
+  const glm::vec3 scale(_header.scale[0], _header.scale[1], _header.scale[2]);
+
+  // The sections are only byte aligned, so everything goes through memcpy,
+  // which compiles to plain loads. Each vertex is built whole and stored in
+  // one go in case out is write-combined memory.
+  for (uint32_t i = first; i < first + count; i++)
+  {
+    uint16_t q[3];
+    int16_t n[2];
+    memcpy(q, _positions + (size_t)i * POSITION_LEN, sizeof(q));
+    memcpy(n, _normals + (size_t)i * NORMAL_LEN, sizeof(n));
+
+    Vertex v;
+    v._vertex = origin + glm::vec3(q[0], q[1], q[2]) * scale;
+    v._normal = octDecode(n[0], n[1]);
+    memcpy(out + i, &v, sizeof(v));
+  }
+}
+
+void CompactMesh::decodeIndices(uint32_t *out, unsigned threads) const
+{
+  if (_blockCount < PARALLEL_MIN_BLOCKS) {
+    threads = 1;
+  }
+  parallelFor(_blockCount, threadCount(threads), [this, out](uint32_t first, uint32_t count) {
+    for (uint32_t b = first; b < first + count; b++) {
+      decodeIndexBlock(out, b);
+    }
+  });
+}
+
+void CompactMesh::decodeIndexBlock(uint32_t *out, uint32_t block) const
+{
+  uint32_t first = block * INDEX_BLOCK;
+  uint32_t count = std::min(INDEX_BLOCK, _header.indexCount - first);
+  uint32_t streamLen = _header.indexBytes - _blockCount * (uint32_t)sizeof(uint32_t);
+
+  const uint8_t *p = _indices + readU32(_blocks + block * sizeof(uint32_t));
+  const uint8_t *end = _indices + (block + 1 < _blockCount ? readU32(_blocks + (block + 1) * sizeof(uint32_t)) : streamLen);
+  out += first;
+
+  // A varint is at most 5 bytes, so while that many remain the loop needs
+  // no bounds checks. Out of range indices are caught once at the end
+  // through the largest seen, the unsigned sum wraps on a bad delta.
+  uint32_t last = 0;
+  uint32_t highest = 0;
+  uint32_t i = 0;
+  for (; i < count && end - p >= 5; i++)
+  {
+    uint32_t b = *p++;
+    uint32_t zigzag = b & 0x7f;
+    if (b & 0x80)
+    {
+      b = *p++;
+      zigzag |= (b & 0x7f) << 7;
+      if (b & 0x80)
+      {
+        b = *p++;
+        zigzag |= (b & 0x7f) << 14;
+        if (b & 0x80)
+        {
+          b = *p++;
+          zigzag |= (b & 0x7f) << 21;
+          if (b & 0x80)
+          {
+            b = *p++;
+            if (b > 0x0f) {
+              throw std::runtime_error("bad compact mesh: corrupt index stream");
+            }
+            zigzag |= b << 28;
+          }
+        }
+      }
+    }
+
+    last += (zigzag >> 1) ^ (0u - (zigzag & 1));
+    highest = std::max(highest, last);
+    out[i] = last;
+  }
+
+  for (; i < count; i++)
+  {
+    uint32_t zigzag = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+      if (p == end || shift > 28) {
+        throw std::runtime_error("bad compact mesh: corrupt index stream");
+      }
+      uint8_t b = *p++;
+      zigzag |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+
+    last += (zigzag >> 1) ^ (0u - (zigzag & 1));
+    highest = std::max(highest, last);
+    out[i] = last;
+  }
+
+  if (count && highest >= _header.vertexCount) {
+    throw std::runtime_error("bad compact mesh: index out of range");
+  }
+  if (p != end) {
+    throw std::runtime_error("bad compact mesh: index block length mismatch");
+  }
+}
+
+void CompactMesh::read(TriangleSink &sink) const
+{
+  std::vector<uint32_t> indices(_header.indexCount);
+  decodeIndices(indices.data());
+
+  const glm::vec3 origin(_header.origin[0], _header.origin[1], _header.origin[2]);
+  const glm::vec3 scale(_header.scale[0], _header.scale[1], _header.scale[2]);
+
+  std::vector<glm::vec3> positions(_header.vertexCount);
+  for (uint32_t i = 0; i < _header.vertexCount; i++)
+  {
+    uint16_t q[3];
+    memcpy(q, _positions + i * POSITION_LEN, sizeof(q));
+    positions[i] = origin + glm::vec3(q[0], q[1], q[2]) * scale;
+  }
+
+  size_t triangles = indices.size() / 3;
+  sink.reserve(triangles);
+  for (size_t t = 0; t < triangles; t++)
+  {
+    glm::vec3 tri[3] = {
+      positions[indices[t * 3]], positions[indices[t * 3 + 1]], positions[indices[t * 3 + 2]]
+    };
+    sink.triangle(t, tri);
+  }
+  sink.finish();
+}
+
+std::string CompactMesh::encode(const Vertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount)
+{
+  if (indexCount % 3) {
+    throw std::runtime_error("compact mesh: index count isn't whole triangles");
+  }
+
+  Header header;
+  memcpy(header.magic, COMPACT_MAGIC, sizeof(header.magic));
+  header.vertexCount = vertexCount;
+  header.indexCount = indexCount;
+
+  glm::vec3 lo(0.0f), hi(0.0f);
+  if (vertexCount)
+  {
+    lo = hi = vertices[0]._vertex;
+    for (uint32_t i = 1; i < vertexCount; i++)
+    {
+      lo = glm::min(lo, vertices[i]._vertex);
+      hi = glm::max(hi, vertices[i]._vertex);
+    }
+  }
+  glm::vec3 scale = (hi - lo) / 65535.0f;
+  for (int a = 0; a < 3; a++)
+  {
+    header.origin[a] = lo[a];
+    header.scale[a] = scale[a];
+  }
+
+  uint32_t blockCount = blockCountFor(indexCount);
+  std::vector<uint32_t> blocks(blockCount);
+
+  std::string indexBytes;
+  indexBytes.reserve(indexCount * 2);
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < indexCount; i++)
+  {
+    if (i % INDEX_BLOCK == 0)
+    {
+      blocks[i / INDEX_BLOCK] = (uint32_t)indexBytes.size();
+      last = 0;
+    }
+    if (indices[i] >= vertexCount) {
+      throw std::runtime_error("compact mesh: index out of range");
+    }
+    int32_t delta = (int32_t)(indices[i] - last);
+    uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+    last = indices[i];
+
+    while (zigzag >= 0x80)
+    {
+      indexBytes.push_back((char)(zigzag | 0x80));
+      zigzag >>= 7;
+    }
+    indexBytes.push_back((char)zigzag);
+  }
+  header.indexBytes = (uint32_t)(blockCount * sizeof(uint32_t) + indexBytes.size());
+
+  std::string out;
+  out.resize(sizeof(Header) + (size_t)vertexCount * (POSITION_LEN + NORMAL_LEN));
+  memcpy(&out[0], &header, sizeof(header));
+
+  char *positions = &out[sizeof(Header)];
+  char *normals = positions + (size_t)vertexCount * POSITION_LEN;
+  for (uint32_t i = 0; i < vertexCount; i++)
+  {
+    uint16_t q[3];
+    for (int a = 0; a < 3; a++)
+    {
+      float v = scale[a] > 0.0f ? (vertices[i]._vertex[a] - lo[a]) / scale[a] : 0.0f;
+      q[a] = (uint16_t)std::lround(std::clamp(v, 0.0f, 65535.0f));
+    }
+    memcpy(positions + i * POSITION_LEN, q, sizeof(q));
+
+    int16_t n[2];
+    octEncode(vertices[i]._normal, n);
+    memcpy(normals + i * NORMAL_LEN, n, sizeof(n));
+  }
+
+  out.append((const char *)blocks.data(), blocks.size() * sizeof(uint32_t));
+  out += indexBytes;
+  return out;
+}
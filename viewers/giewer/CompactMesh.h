@@ -0,0 +1,84 @@
+#ifndef __COMPACT_MESH_H
+#define __COMPACT_MESH_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "TriangleSink.h"
+
+// Compact indexed mesh encoding, about 10 bytes per vertex and 1-2 per
+// index against 50 per triangle for binary STL. Little endian:
+//
+//   Header
+//   uint16  positions[vertexCount][3]  quantized over the bounding box
+//   int16   normals[vertexCount][2]    octahedral, snorm
+//   uint32  blocks[ceil(indexCount / INDEX_BLOCK)]
+//   uint8   indices[]                  zigzag varint delta from the last
+//
+// indexBytes covers the block table and the varints. Each block of
+// INDEX_BLOCK indices starts its deltas from 0 at the byte offset given in
+// the table, so blocks decode independently. Producers encode with
+// encode(); the viewer decodes straight into its vertex layout.
+class CompactMesh
+{
+public:
+  // Same layout as LitVertex
+  struct Vertex
+  {
+    glm::vec3 _vertex;
+    glm::vec3 _normal;
+  };
+
+  struct Header
+  {
+    char magic[4];
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexBytes;
+
+    // A position is origin + q * scale
+    float origin[3];
+    float scale[3];
+  };
+
+  static const uint32_t INDEX_BLOCK = 64 * 1024;
+
+  static bool sniff(const char *data, size_t size);
+
+  // Checks the header and section sizes, throws if they are inconsistent.
+  // The data is borrowed and must outlive this object.
+  CompactMesh(const char *data, size_t size);
+
+  uint32_t vertexCount() const { return _header.vertexCount; }
+  uint32_t indexCount() const { return _header.indexCount; }
+
+  // Writes vertexCount() vertices, out may be mapped GPU memory. threads
+  // caps how many workers a large mesh is split across, 0 uses every
+  // hardware thread.
+  void decodeVertices(Vertex *out, unsigned threads = 0) const;
+
+  // Writes indexCount() indices, split by block as above. Throws on a
+  // corrupt stream or an index past the last vertex.
+  void decodeIndices(uint32_t *out, unsigned threads = 0) const;
+
+  // Unindexed triangles for a TriangleSink, normals are left to the sink
+  void read(TriangleSink &sink) const;
+
+  // indexCount must be a multiple of 3. Normals needn't be unit length.
+  static std::string encode(const Vertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount);
+
+private:
+  Header _header;
+  uint32_t _blockCount;
+  const char *_positions;
+  const char *_normals;
+  const uint8_t *_blocks;
+  const uint8_t *_indices;
+
+  void decodeVertexRange(Vertex *out, uint32_t first, uint32_t count) const;
+  void decodeIndexBlock(uint32_t *out, uint32_t block) const;
+};
+
+#endif
@@ -10,7 +10,8 @@ DescriptorPool::DescriptorPool(VkDescriptorType type, uint32_t maxSets)
 {
   VkDescriptorPoolSize poolSize{};
   poolSize.type = type;
-  poolSize.descriptorCount = 1;
+  // One descriptor of the type per set
+  poolSize.descriptorCount = maxSets;
 
   VkDescriptorPoolCreateInfo poolInfo{};
   poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -45,4 +46,4 @@ std::vector<DescriptorSet> DescriptorPool::createDescriptorSets(const std::vecto
   }
 
   return descriptorSets;
-}
\ No newline at end of file
+}
\ No newline at end of file
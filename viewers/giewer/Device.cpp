@@ -41,11 +41,22 @@ Device::Device()
     // We only need a single combined queue
     _graphicsFamily = _presentationFamily = queueFamilies[0];
   }
-  queueFamilies = { _graphicsFamily, _presentationFamily };
+
+  _transferFamily = _graphicsFamily;
+  auto &families = _physicalDevice->queueFamilyProperties();
+  for (uint32_t i = 0; i < families.size(); i++) {
+    VkQueueFlags flags = families[i].queueFlags;
+    if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+      _transferFamily = i;
+      break;
+    }
+  }
+  queueFamilies = { _graphicsFamily, _presentationFamily, _transferFamily };
 
   createLogicalDevice(queueFamilies);
   vkGetDeviceQueue(_device, _graphicsFamily, 0, &_graphicsQueue);
   vkGetDeviceQueue(_device, _presentationFamily, 0, &_presentationQueue);
+  vkGetDeviceQueue(_device, _transferFamily, 0, &_transferQueue);
 }
 
 Device::~Device()
@@ -60,6 +71,9 @@ VkQueue Device::graphicsQueue() const { return _graphicsQueue; }
 uint32_t Device::graphicsFamily() const { return _graphicsFamily; }
 VkQueue Device::presentationQueue() const { return _presentationQueue; }
 uint32_t Device::presentationFamily() const { return _presentationFamily; }
+VkQueue Device::transferQueue() const { return _transferQueue; }
+uint32_t Device::transferFamily() const { return _transferFamily; }
+uint32_t Device::maxDrawIndirectCount() const { return _maxDrawIndirectCount; }
 
 const PhysicalDevice::SwapChainProperties &Device::swapChainProperties() const
 {
@@ -112,6 +126,20 @@ void Device::createLogicalDevice(const std::vector<uint32_t> &queueFamilies)
   VkDeviceCreateInfo createInfo{};
   VkPhysicalDeviceFeatures deviceFeatures{};
   deviceFeatures.geometryShader = true;
+
+  // Lets a frame draw every mesh of a batch with one indirect call, each
+  // draw's instance index picking its per-draw data
+  VkPhysicalDeviceFeatures supported;
+  vkGetPhysicalDeviceFeatures(*_physicalDevice, &supported);
+  if (supported.multiDrawIndirect && supported.drawIndirectFirstInstance)
+  {
+    deviceFeatures.multiDrawIndirect = true;
+    deviceFeatures.drawIndirectFirstInstance = true;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(*_physicalDevice, &properties);
+    _maxDrawIndirectCount = properties.limits.maxDrawIndirectCount;
+  }
   std::vector<const char *> deviceExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
 
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
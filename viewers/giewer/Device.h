@@ -18,6 +18,15 @@ private:
   uint32_t _presentationFamily = -1;
   VkQueue _presentationQueue = nullptr;
 
+  // A family with transfers only, usually the GPU's copy engine, else the
+  // graphics family, in which case the queue is the graphics queue
+  uint32_t _transferFamily = -1;
+  VkQueue _transferQueue = nullptr;
+
+  // 0 without multi-draw indirect, or without firstInstance in indirect
+  // draws
+  uint32_t _maxDrawIndirectCount = 0;
+
   PhysicalDevice *selectPhysicalDevice(const std::vector<const char *> &extensions);
   bool isSuitableDevice(PhysicalDevice &, const std::vector<const char *> &extensions);
   void createLogicalDevice(const std::vector<uint32_t> &queueFamilies);
@@ -34,11 +43,15 @@ public:
 
   uint32_t graphicsFamily() const; 
   uint32_t presentationFamily() const;
+  uint32_t transferFamily() const;
 
   VkQueue graphicsQueue() const;
   VkQueue presentationQueue() const;
+  VkQueue transferQueue() const;
 
   const PhysicalDevice::SwapChainProperties &swapChainProperties() const;
+
+  uint32_t maxDrawIndirectCount() const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include "GeometryPool.h"
+#include "ResourceBuffer.h"
+#include "Metrics.h"
+
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+
+GeometryRange::GeometryRange(GeometryPool *pool, bool indices, uint32_t arena, VkBuffer buffer, VkDeviceSize offset, size_t size)
+: _pool(pool), _indices(indices), _arena(arena), _buffer(buffer), _offset(offset), _size(size)
+{
+}
+
+GeometryRange::~GeometryRange()
+{
+  _pool->free(*this);
+}
+
+GeometryPool::GeometryPool(VkDeviceSize vertexStride, VkDeviceSize vertexArenaSize, VkDeviceSize indexArenaSize)
+{
+  _vertices.unit = vertexStride;
+  _vertices.arenaSize = vertexArenaSize / vertexStride * vertexStride;
+  _vertices.indices = false;
+
+  _indices.unit = sizeof(uint32_t);
+  _indices.arenaSize = indexArenaSize / sizeof(uint32_t) * sizeof(uint32_t);
+  _indices.indices = true;
+
+  _metricSource = addMetricSource([this](std::map<std::string, int> &metrics) { report(metrics); });
+}
+
+GeometryPool::~GeometryPool()
+{
+  removeMetricSource(_metricSource);
+
+  for (Kind *kind : { &_vertices, &_indices }) {
+    for (auto &arena : kind->arenas) {
+      delete arena.buffer;
+    }
+  }
+}
+
+GeometryRange *GeometryPool::allocateVertices(size_t bytes)
+{
+  return allocate(_vertices, bytes);
+}
+
+GeometryRange *GeometryPool::allocateIndices(size_t bytes)
+{
+  return allocate(_indices, bytes);
+}
+
+GeometryRange *GeometryPool::allocate(Kind &kind, size_t bytes)
+{
+  VkDeviceSize units = (std::max<VkDeviceSize>(bytes, 1) + kind.unit - 1) / kind.unit;
+
+  std::lock_guard<std::mutex> guard(_lock);
+
+  for (uint32_t a = 0; a < kind.arenas.size(); a++)
+  {
+    Arena &arena = kind.arenas[a];
+    for (auto it = arena.free.begin(); it != arena.free.end(); ++it)
+    {
+      if (it->second < units) {
+        continue;
+      }
+
+      VkDeviceSize offset = it->first;
+      VkDeviceSize left = it->second - units;
+      arena.free.erase(it);
+      if (left) {
+        arena.free[offset + units] = left;
+      }
+      arena.used += units;
+      return new GeometryRange(this, kind.indices, a, *arena.buffer, offset * kind.unit, (size_t)(units * kind.unit));
+    }
+  }
+
+  // Nothing has room, so a new arena goes into the first unused slot
+  uint32_t a = 0;
+  while (a < kind.arenas.size() && kind.arenas[a].buffer) {
+    a++;
+  }
+  if (a == kind.arenas.size()) {
+    kind.arenas.emplace_back();
+  }
+
+  VkDeviceSize size = std::max(kind.arenaSize, units * kind.unit);
+  Arena &arena = kind.arenas[a];
+  if (kind.indices) {
+    arena.buffer = new IndexBuffer(size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  } else {
+    arena.buffer = new VertexBuffer(size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  }
+  arena.units = size / kind.unit;
+  arena.used = units;
+  if (arena.units > units) {
+    arena.free[units] = arena.units - units;
+  }
+  return new GeometryRange(this, kind.indices, a, *arena.buffer, 0, (size_t)(units * kind.unit));
+}
+
+void GeometryPool::free(GeometryRange &range)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  Kind &kind = range._indices ? _indices : _vertices;
+  Arena &arena = kind.arenas[range._arena];
+
+  VkDeviceSize offset = range._offset / kind.unit;
+  VkDeviceSize units = range._size / kind.unit;
+  arena.used -= units;
+
+  // Merge with the free runs either side
+  auto next = arena.free.lower_bound(offset);
+  if (next != arena.free.end() && offset + units == next->first)
+  {
+    units += next->second;
+    next = arena.free.erase(next);
+  }
+  if (next != arena.free.begin())
+  {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset)
+    {
+      offset = prev->first;
+      units += prev->second;
+      arena.free.erase(prev);
+    }
+  }
+  arena.free[offset] = units;
+
+  // The first arena stays, others are only worth keeping while in use
+  if (!arena.used && range._arena)
+  {
+    delete arena.buffer;
+    arena = Arena();
+  }
+}
+
+void GeometryPool::report(std::map<std::string, int> &metrics)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  int arenas = 0;
+  VkDeviceSize reserved = 0, used = 0;
+  for (Kind *kind : { &_vertices, &_indices })
+  {
+    for (auto &arena : kind->arenas)
+    {
+      if (arena.buffer)
+      {
+        arenas++;
+        reserved += arena.units * kind->unit;
+        used += arena.used * kind->unit;
+      }
+    }
+  }
+
+  metrics["geometry_arenas"] = arenas;
+  metrics["geometry_reserved_kb"] = (int)(reserved / 1024);
+  metrics["geometry_used_kb"] = (int)(used / 1024);
+}
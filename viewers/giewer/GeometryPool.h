@@ -0,0 +1,85 @@
+#ifndef __GEOMETRY_POOL_H
+#define __GEOMETRY_POOL_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+class GeometryPool;
+class ResourceBuffer;
+
+// A piece of one of GeometryPool's shared vertex or index buffers, given
+// back to the pool when deleted. Offsets and sizes are in bytes.
+class GeometryRange
+{
+public:
+  ~GeometryRange();
+
+  operator VkBuffer() const { return _buffer; }
+  uint32_t arena() const { return _arena; }
+  VkDeviceSize offset() const { return _offset; }
+  size_t size() const { return _size; }
+
+private:
+  friend class GeometryPool;
+  GeometryRange(GeometryPool *pool, bool indices, uint32_t arena, VkBuffer buffer, VkDeviceSize offset, size_t size);
+
+  GeometryPool *_pool;
+  bool _indices;
+  uint32_t _arena;
+  VkBuffer _buffer;
+  VkDeviceSize _offset;
+  size_t _size;
+};
+
+// Mesh geometry packed into a few large DEVICE_LOCAL buffers, arenas, so a
+// frame can bind one vertex and one index buffer and draw many meshes from
+// them with a single indirect draw. Each arena hands out ranges first fit
+// from a free list, merging neighbours as they are given back. Vertex
+// ranges start on a whole vertex, so a draw can address them by vertex
+// offset, and index ranges on four bytes, which suits either index type.
+class GeometryPool
+{
+public:
+  // A range larger than an arena gets an arena of its own, which goes once
+  // it is empty again
+  GeometryPool(VkDeviceSize vertexStride, VkDeviceSize vertexArenaSize, VkDeviceSize indexArenaSize);
+  ~GeometryPool();
+
+  GeometryRange *allocateVertices(size_t bytes);
+  GeometryRange *allocateIndices(size_t bytes);
+
+private:
+  friend class GeometryRange;
+
+  struct Arena
+  {
+    ResourceBuffer *buffer = nullptr;
+    VkDeviceSize units = 0;
+    VkDeviceSize used = 0;
+    // Free runs of units, by where they start
+    std::map<VkDeviceSize, VkDeviceSize> free;
+  };
+
+  struct Kind
+  {
+    VkDeviceSize unit;
+    VkDeviceSize arenaSize;
+    bool indices;
+    std::vector<Arena> arenas;
+  };
+
+  std::mutex _lock;
+  Kind _vertices;
+  Kind _indices;
+
+  int _metricSource;
+
+  GeometryRange *allocate(Kind &kind, size_t bytes);
+  void free(GeometryRange &range);
+  void report(std::map<std::string, int> &metrics);
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "Hash.h"
+
+#include <cstring>
+#include <algorithm>
+
+static const uint64_t PRIME1 = 11400714785074694791ull;
+static const uint64_t PRIME2 = 14029467366897019727ull;
+static const uint64_t PRIME3 = 1609587929392839161ull;
+static const uint64_t PRIME4 = 9650029242287828579ull;
+static const uint64_t PRIME5 = 2870177450012600261ull;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME2;
+  acc = rotl(acc, 31);
+  return acc * PRIME1;
+}
+
+static inline uint64_t merge(uint64_t acc, uint64_t v)
+{
+  acc ^= round(0, v);
+  return acc * PRIME1 + PRIME4;
+}
+
+static inline void initLanes(uint64_t v[4], uint64_t seed)
+{
+  v[0] = seed + PRIME1 + PRIME2;
+  v[1] = seed + PRIME2;
+  v[2] = seed;
+  v[3] = seed - PRIME1;
+}
+
+static inline void stripe(uint64_t v[4], const uint8_t *p)
+{
+  v[0] = round(v[0], read64(p));
+  v[1] = round(v[1], read64(p + 8));
+  v[2] = round(v[2], read64(p + 16));
+  v[3] = round(v[3], read64(p + 24));
+}
+
+static inline uint64_t mergeLanes(const uint64_t v[4])
+{
+  uint64_t h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+  h = merge(h, v[0]);
+  h = merge(h, v[1]);
+  h = merge(h, v[2]);
+  h = merge(h, v[3]);
+  return h;
+}
+
+// Folds in the last, less than 32, bytes [p, end) and mixes the result
+static uint64_t finish(uint64_t h, const uint8_t *p, const uint8_t *end)
+{
+  for (; p + 8 <= end; p += 8)
+  {
+    h ^= round(0, read64(p));
+    h = rotl(h, 27) * PRIME1 + PRIME4;
+  }
+
+  if (p + 4 <= end)
+  {
+    h ^= (uint64_t)read32(p) * PRIME1;
+    h = rotl(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+
+  for (; p < end; p++)
+  {
+    h ^= (*p) * PRIME5;
+    h = rotl(h, 11) * PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t hash64(const void *data, size_t size, uint64_t seed)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const uint8_t *end = p + size;
+  uint64_t h;
+
+  if (size >= 32)
+  {
+    // Four independent lanes over 32 byte stripes
+    uint64_t v[4];
+    initLanes(v, seed);
+
+    const uint8_t *limit = end - 32;
+    do {
+      stripe(v, p);
+      p += 32;
+    } while (p <= limit);
+
+    h = mergeLanes(v);
+  }
+  else
+  {
+    h = seed + PRIME5;
+  }
+
+  return finish(h + (uint64_t)size, p, end);
+}
+
+Hash64::Hash64(uint64_t seed) : _seed(seed)
+{
+  initLanes(_v, seed);
+}
+
+void Hash64::update(const void *data, size_t size)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const uint8_t *end = p + size;
+  _total += size;
+
+  if (_buffered)
+  {
+    size_t take = std::min(size, sizeof(_stripe) - _buffered);
+    memcpy(_stripe + _buffered, p, take);
+    _buffered += take;
+    p += take;
+    if (_buffered < sizeof(_stripe)) {
+      return;
+    }
+    stripe(_v, _stripe);
+    _buffered = 0;
+  }
+
+  for (; end - p >= 32; p += 32) {
+    stripe(_v, p);
+  }
+
+  memcpy(_stripe, p, end - p);
+  _buffered = end - p;
+}
+
+uint64_t Hash64::digest() const
+{
+  uint64_t h = _total >= 32 ? mergeLanes(_v) : _seed + PRIME5;
+  return finish(h + _total, _stripe, _stripe + _buffered);
+}
@@ -0,0 +1,30 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit xxHash (XXH64) of size bytes. Runs at memory speed, so hashing a
+// whole upload costs far less than parsing it; it is not cryptographic.
+uint64_t hash64(const void *data, size_t size, uint64_t seed = 0);
+
+// The same hash over data that arrives in pieces, e.g. off a socket;
+// digest() equals hash64() of everything passed to update()
+class Hash64
+{
+public:
+  Hash64(uint64_t seed = 0);
+
+  void update(const void *data, size_t size);
+  uint64_t digest() const;
+
+private:
+  uint64_t _seed;
+  uint64_t _v[4];
+  uint64_t _total = 0;
+  // The part of a 32 byte stripe not processed yet
+  uint8_t _stripe[32];
+  size_t _buffered = 0;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "IngestQueue.h"
+
+#include <vector>
+#include <cstdlib>
+
+#include "Metrics.h"
+
+using Clock = std::chrono::steady_clock;
+
+IngestQueue::IngestQueue(uint64_t maxBytes) : _maxBytes(maxBytes)
+{
+  _metricSource = addMetricSource([this](std::map<std::string, int> &metrics) { report(metrics); });
+}
+
+IngestQueue::~IngestQueue()
+{
+  removeMetricSource(_metricSource);
+}
+
+uint64_t IngestQueue::budgetFromEnvironment()
+{
+  uint64_t megabytes = 256;
+  if (const char *mb = getenv("GIEWER_INGEST_MB")) {
+    megabytes = strtoull(mb, nullptr, 10);
+  }
+  return megabytes * 1024 * 1024;
+}
+
+bool IngestQueue::fits(uint64_t bytes) const
+{
+  return _usedBytes == 0 || _usedBytes + bytes <= _maxBytes;
+}
+
+void IngestQueue::reserve(uint64_t bytes, std::function<void()> ready, uint64_t held)
+{
+  std::vector<std::function<void()>> granted;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_waiters.empty() || !fits(bytes))
+    {
+      _waiters.push_back({ bytes, held, std::move(ready), Clock::now() });
+      grant(granted);
+    }
+    else
+    {
+      _usedBytes += bytes;
+      _reserved++;
+      granted.push_back(std::move(ready));
+    }
+  }
+
+  for (auto &ready : granted) {
+    ready();
+  }
+}
+
+void IngestQueue::release(uint64_t bytes)
+{
+  std::vector<std::function<void()>> granted;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _usedBytes -= bytes;
+    _reserved--;
+    grant(granted);
+  }
+
+  for (auto &ready : granted) {
+    ready();
+  }
+}
+
+// Called with _lock held
+void IngestQueue::grant(std::vector<std::function<void()>> &granted)
+{
+  auto now = Clock::now();
+  while (!_waiters.empty())
+  {
+    auto next = _waiters.begin();
+    if (!fits(next->bytes))
+    {
+      uint64_t held = 0;
+      for (auto it = _waiters.begin(); it != _waiters.end(); ++it)
+      {
+        held += it->held;
+        if (it->held > next->held) {
+          next = it;
+        }
+      }
+      if (held < _usedBytes) {
+        break;
+      }
+    }
+
+    _usedBytes += next->bytes;
+    _reserved++;
+    waited(*next, now);
+    granted.push_back(std::move(next->ready));
+    _waiters.erase(next);
+  }
+}
+
+void IngestQueue::clear()
+{
+  std::deque<Waiter> dropped;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    dropped.swap(_waiters);
+  }
+}
+
+void IngestQueue::waited(const Waiter &waiter, Clock::time_point now)
+{
+  uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(now - waiter.since).count();
+  _waits++;
+  _waitMicros += micros;
+  if (micros > _maxWaitMicros) {
+    _maxWaitMicros = micros;
+  }
+}
+
+void IngestQueue::report(std::map<std::string, int> &metrics)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  metrics["ingest_queued"] = (int)_reserved;
+  metrics["ingest_queued_kb"] = (int)(_usedBytes / 1024);
+  metrics["ingest_waiting"] = (int)_waiters.size();
+  metrics["ingest_waits"] = (int)_waits;
+  metrics["ingest_wait_avg_ms"] = _waits ? (int)(_waitMicros / _waits / 1000) : 0;
+  metrics["ingest_wait_max_ms"] = (int)(_maxWaitMicros / 1000);
+
+  _waits = 0;
+  _waitMicros = 0;
+  _maxWaitMicros = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef __INGEST_QUEUE_H
+#define __INGEST_QUEUE_H
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+// Caps the bytes that have been read off the network but not yet turned
+// into meshes. A connection reserves room before reading a payload and
+// gives it back once the payload has been processed; while the budget is
+// used up its reads simply wait, so TCP flow control slows the sender down.
+class IngestQueue
+{
+public:
+  IngestQueue(uint64_t maxBytes);
+  ~IngestQueue();
+
+  // Budget in megabytes from GIEWER_INGEST_MB (default 256)
+  static uint64_t budgetFromEnvironment();
+
+  // Calls ready once the bytes fit, straight away if they do now. Requests
+  // are granted in order, and one larger than the whole budget is let
+  // through when nothing else is queued. ready may run on whichever thread
+  // releases the room, so it should only schedule work.
+  // held is how much the caller already has reserved and can't give back
+  // until this is granted, e.g. an upload that keeps what it has read. If
+  // everything in use is held by waiting callers nothing would ever be
+  // released, so the one holding most goes ahead to finish and let go.
+  void reserve(uint64_t bytes, std::function<void()> ready, uint64_t held = 0);
+  void release(uint64_t bytes);
+
+  // Drops waiting requests without calling them
+  void clear();
+
+private:
+  struct Waiter
+  {
+    uint64_t bytes;
+    uint64_t held;
+    std::function<void()> ready;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  std::mutex _lock;
+  uint64_t _maxBytes;
+  uint64_t _usedBytes = 0;
+  uint64_t _reserved = 0;
+  std::deque<Waiter> _waiters;
+
+  // Time spent waiting for room, since the last time metrics were dumped
+  uint64_t _waits = 0;
+  uint64_t _waitMicros = 0;
+  uint64_t _maxWaitMicros = 0;
+
+  int _metricSource;
+
+  bool fits(uint64_t bytes) const;
+  void grant(std::vector<std::function<void()>> &granted);
+  void waited(const Waiter &waiter, std::chrono::steady_clock::time_point now);
+  void report(std::map<std::string, int> &metrics);
+};
+
+#endif
@@ -1,12 +1,28 @@
 #include "Loader.h"
+#include "ObjReader.h"
+#include "CompactMesh.h"
+#include "PlyReader.h"
+#include "StlAscii.h"
 #include "glm/vec3.hpp"
 
-#include <fstream>
-#include <sstream>
+#include <future>
+#include <memory>
+#include <thread>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <string_view>
 #include <iostream>
+#include <stdexcept>
 
-Loader::Loader()
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+Loader::Loader(unsigned threads) : _threads(threads)
 {
+  if (_threads == 0) {
+    _threads = std::max(1u, std::thread::hardware_concurrency());
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -39,180 +55,529 @@ Loader::Loader()
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Binary STL layout: 80 byte header, uint32 triangle count, then one
+// 50 byte record per facet (normal, three vertices, uint16 attribute).
+static const size_t STL_HEADER_LEN = 80;
+static const size_t STL_PREAMBLE_LEN = STL_HEADER_LEN + sizeof(uint32_t);
+static const size_t STL_FACET_LEN = 12 * sizeof(float) + sizeof(uint16_t);
+
+// Below this an ASCII file is parsed on the calling thread, thread start-up
+// would cost more than it saves.
+static const size_t STL_ASCII_PARALLEL_MIN = 4 * 1024 * 1024;
+
+// Collects triangles into a plain vertex array for the vector-returning
+// overloads.
+class VectorSink : public TriangleSink
+{
+public:
+  std::vector<glm::vec3> _verts;
+
+  void reserve(size_t triangles) { _verts.resize(triangles * 3); }
+  void triangle(size_t index, const glm::vec3 *v) { std::copy(v, v + 3, _verts.data() + index * 3); }
+  void finish() {}
+};
+
+// Number of facets in [pos, last) of text, found by their "endfacet"
+static size_t count_facets(std::string_view text, size_t pos, size_t last)
+{
+  size_t n = 0;
+  while ((pos = text.find("endfacet", pos)) != std::string_view::npos && pos < last) {
+    n++;
+    pos += 8;
+  }
+  return n;
+}
+
+// Parses every facet in [p, end) into sink slots [first, last)
+static bool read_facets(const char *p, const char *end, size_t first, size_t last, TriangleSink &sink)
+{
+  glm::vec3 facet[3];
+  for (size_t i = first;; ++i)
+  {
+    stl_ascii::Result r = stl_ascii::read_facet(p, end, facet);
+    if (r == stl_ascii::END) {
+      return i == last;
+    }
+    if (r == stl_ascii::BAD || i == last) {
+      return false;
+    }
+    sink.triangle(i, facet);
+  }
+}
+
 std::vector<glm::vec3> Loader::load_stl(const std::string &filename)
 {
-  std::ifstream file(filename, std::ifstream::in);
-  if (file.fail()) {
-    throw std::runtime_error("missing/bad file: ");
+  VectorSink sink;
+  if (!load_stl(filename, sink)) {
+    return {};
+  }
+  return std::move(sink._verts);
+}
+
+// Maps filename read-only, the region has to outlive any use of its bytes
+static std::unique_ptr<boost::interprocess::mapped_region> map_file(const std::string &filename)
+{
+  using namespace boost::interprocess;
+
+  try {
+    file_mapping file(filename.c_str(), read_only);
+    return std::unique_ptr<mapped_region>(new mapped_region(file, read_only));
   }
+  catch (const interprocess_exception &) {
+    throw std::runtime_error("missing/bad file: " + filename);
+  }
+}
 
-  return load_stl(file);
+bool Loader::load_stl(const std::string &filename, TriangleSink &sink)
+{
+  auto region = map_file(filename);
+  return load_stl((const char *)region->get_address(), region->get_size(), sink);
 }
 
 std::vector<glm::vec3> Loader::load_stl(std::istream &input)
 {
-  const int HEADER_LEN(5);
-  char header[HEADER_LEN + 1];
+  std::string data(std::istreambuf_iterator<char>(input), {});
+  return load_stl(data.data(), data.size());
+}
+
+std::vector<glm::vec3> Loader::load_stl(const char *data, size_t size)
+{
+  VectorSink sink;
+  if (!load_stl(data, size, sink)) {
+    return {};
+  }
+  return std::move(sink._verts);
+}
+
+bool Loader::load_stl(const char *data, size_t size, TriangleSink &sink)
+{
+  if (is_stl_ascii(data, size)) {
+    return read_stl_ascii(data, size, sink);
+  }
 
-  input.seekg(0);
-  input.read(header, HEADER_LEN + 1);
+  read_stl_binary(data, size, sink);
+  return true;
+}
 
-  if (std::string(header, HEADER_LEN) == "solid")
+const std::vector<Loader::Format> &Loader::formats()
+{
+  static const std::vector<Format> registry = {
+    { "gcm", &CompactMesh::sniff, &Loader::read_compact },
+    { "ply", &PlyReader::sniff, &Loader::read_ply },
+    { "obj", &ObjReader::sniff, &Loader::read_obj },
+    { "stl", [](const char *, size_t) { return true; }, &Loader::load_stl },
+  };
+  return registry;
+}
+
+const char *Loader::sniff(const char *data, size_t size)
+{
+  for (auto &format : formats())
   {
-    std::string line;
-    
-    // Skip over rest of header line
-    input >> std::skipws >> line;
-    input >> std::skipws >> line;
-    
-    if (line.find("facet") == 0 ||
-        line.find ("endsolid") == 0)
-    {
-        input.seekg(0);
-        return read_stl_ascii(input);
+    if (format.sniff(data, size)) {
+      return format.name;
     }
-      // confusing_stl = true;
   }
-  else
+  return "stl";
+}
+
+std::vector<glm::vec3> Loader::load(const std::string &filename)
+{
+  VectorSink sink;
+  if (!load(filename, sink)) {
+    return {};
+  }
+  return std::move(sink._verts);
+}
+
+bool Loader::load(const std::string &filename, TriangleSink &sink)
+{
+  auto region = map_file(filename);
+  return load((const char *)region->get_address(), region->get_size(), sink);
+}
+
+bool Loader::load(const char *data, size_t size, TriangleSink &sink)
+{
+  for (auto &format : formats())
   {
-      // confusing_stl = false;
+    if (format.sniff(data, size)) {
+      return (this->*format.read)(data, size, sink);
+    }
   }
+  return false;
+}
 
-  input.seekg(0);
-  return read_stl_binary(input);
+bool Loader::read_ply(const char *data, size_t size, TriangleSink &sink)
+{
+  PlyReader::read(data, size, sink);
+  return true;
 }
 
-std::vector<glm::vec3> Loader::read_stl_binary(std::istream &input)
+bool Loader::read_obj(const char *data, size_t size, TriangleSink &sink)
 {
-  return {};
-    /*QDataStream data(&file);
-    data.setByteOrder(QDataStream::LittleEndian);
-    data.setFloatingPointPrecision(QDataStream::SinglePrecision);
+  return ObjReader::read(data, size, sink);
+}
 
-    // Load the triangle count from the .stl file
-    file.seek(80);
-    uint32_t tri_count;
-    data >> tri_count;
+bool Loader::read_compact(const char *data, size_t size, TriangleSink &sink)
+{
+  CompactMesh(data, size).read(sink);
+  return true;
+}
 
-    // Verify that the file is the right size
-    if (file.size() != 84 + tri_count*50)
-    {
-        //emit error_bad_stl();
-        return NULL;
+bool Loader::is_stl_ascii(const char *data, size_t size)
+{
+  // Plenty of binary exporters start their header with "solid" too, so a
+  // size that matches the triangle count exactly wins over the keyword.
+  if (size >= STL_PREAMBLE_LEN)
+  {
+    uint32_t tri_count;
+    memcpy(&tri_count, data + STL_HEADER_LEN, sizeof(tri_count));
+    if (size == STL_PREAMBLE_LEN + tri_count * (uint64_t)STL_FACET_LEN) {
+      return false;
     }
+  }
 
-    // Extract vertices into an array of xyz, unsigned pairs
-    QVector<Vertex> verts(tri_count*3);
+  const char *end = data + size;
+  if (size < 5 || strncmp(data, "solid", 5) != 0) {
+    return false;
+  }
 
-    // Dummy array, because readRawData is faster than skipRawData
-    std::unique_ptr<uint8_t> buffer(new uint8_t[tri_count * 50]);
-    data.readRawData((char*)buffer.get(), tri_count * 50);
+  // Skip over rest of header line, the next token decides it
+  const char *p = (const char *)memchr(data, '\n', size);
+  if (!p) {
+    return false;
+  }
 
-    // Store vertices in the array, processing one triangle at a time.
-    auto b = buffer.get() + 3 * sizeof(float);
-    for (auto v=verts.begin(); v != verts.end(); v += 3)
-    {
-        // Load vertex data from .stl file into vertices
-        for (unsigned i=0; i < 3; ++i)
-        {
-            memcpy(&v[i], b, 3*sizeof(float));
-            b += 3 * sizeof(float);
-        }
+  while (p < end && isspace((unsigned char)*p)) {
+    p++;
+  }
+
+  auto startsWith = [p, end](const char *f) -> bool {
+    size_t n = strlen(f);
+    return (size_t)(end - p) >= n && strncmp(p, f, n) == 0;
+  };
+
+  return startsWith("facet") || startsWith("endsolid");
+}
+
+void Loader::read_stl_binary(const char *data, size_t size, TriangleSink &sink)
+{
+  if (size < STL_PREAMBLE_LEN) {
+    throw std::runtime_error("bad binary stl: truncated header");
+  }
+
+  // Load the triangle count from the header
+  uint32_t tri_count;
+  memcpy(&tri_count, data + STL_HEADER_LEN, sizeof(tri_count));
+
+  // Verify that the data is big enough for the triangle count
+  if (size - STL_PREAMBLE_LEN < tri_count * (uint64_t)STL_FACET_LEN) {
+    throw std::runtime_error("bad binary stl: size does not match triangle count");
+  }
+
+  sink.reserve(tri_count);
+
+  // Each record holds the three vertices back to back after the facet
+  // normal. Records are only 2-byte aligned, so copy them out first.
+  static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "glm::vec3 must be tightly packed");
+  const char *b = data + STL_PREAMBLE_LEN + 3 * sizeof(float);
+  glm::vec3 facet[3];
+  for (uint32_t i = 0; i < tri_count; ++i)
+  {
+    memcpy(facet, b, sizeof(facet));
+    sink.triangle(i, facet);
+    b += STL_FACET_LEN;
+  }
+
+  sink.finish();
+}
+
+bool Loader::read_stl_ascii(const char *data, size_t size, TriangleSink &sink)
+{
+  if (_threads > 1 && size >= STL_ASCII_PARALLEL_MIN) {
+    return read_stl_ascii_parallel(data, size, _threads, sink);
+  }
+
+  const char *end = data + size;
+  const char *body = stl_ascii::skip_line(data, end);
+
+  // Counting first is a cheap scan next to parsing the numbers, and lets
+  // the sink size its storage exactly.
+  std::string_view text(body, end - body);
+  size_t tri_count = count_facets(text, 0, text.size());
+  sink.reserve(tri_count);
 
-        // Skip face attribute and next face's normal vector
-        b += 3 * sizeof(float) + sizeof(uint16_t);
+  if (!read_facets(body, end, 0, tri_count, sink))
+  {
+    //emit error_bad_stl();
+    return false;
+  }
+
+  sink.finish();
+  return true;
+}
+
+bool Loader::read_stl_ascii_parallel(const char *data, size_t size, unsigned threads, TriangleSink &sink)
+{
+  const char *end = data + size;
+  const char *body = stl_ascii::skip_line(data, end);
+  std::string_view text(body, end - body);
+
+  // Split the body into roughly equal chunks, each ending just after an
+  // "endfacet" so that every facet lies entirely inside one chunk.
+  std::vector<const char *> bounds = { body };
+  for (unsigned i = 1; i < threads; ++i)
+  {
+    size_t pos = std::max((size_t)(bounds.back() - body), text.size() * i / threads);
+    pos = text.find("endfacet", pos);
+    if (pos == std::string_view::npos) {
+      break;
     }
+    bounds.push_back(body + pos + 8);
+  }
+  bounds.push_back(end);
 
-    if (confusing_stl)
-    {
-        emit warning_confusing_stl();
+  const size_t chunks = bounds.size() - 1;
+
+  // First pass counts facets per chunk so that the second pass can parse
+  // each chunk straight into its final place in the output.
+  std::vector<std::future<size_t>> counts;
+  for (size_t c = 0; c < chunks; ++c)
+  {
+    counts.push_back(std::async(std::launch::async, [&text, &bounds, body, c]() {
+      return count_facets(text, bounds[c] - body, bounds[c + 1] - body);
+    }));
+  }
+
+  std::vector<size_t> offsets(chunks + 1, 0);
+  for (size_t c = 0; c < chunks; ++c) {
+    offsets[c + 1] = offsets[c] + counts[c].get();
+  }
+
+  sink.reserve(offsets[chunks]);
+
+  std::vector<std::future<bool>> parsed;
+  for (size_t c = 0; c < chunks; ++c)
+  {
+    parsed.push_back(std::async(std::launch::async, [&sink, &bounds, &offsets, c]() {
+      return read_facets(bounds[c], bounds[c + 1], offsets[c], offsets[c + 1], sink);
+    }));
+  }
+
+  bool okay = true;
+  for (auto &f : parsed) {
+    okay = f.get() && okay;
+  }
+
+  if (!okay)
+  {
+    //emit error_bad_stl();
+    return false;
+  }
+
+  sink.finish();
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// How much of an ASCII-looking header we wait for before deciding that a
+// "solid..." prefix is really the start of a binary header.
+static const size_t STL_SNIFF_MAX = 1024;
+
+// The most triangles a streamed binary header is trusted with before any
+// facet has arrived, a mesh buffer of about 70 MB. Any count will fit in
+// the 4 bytes, so larger ones are only reserved once finish() has seen
+// that many facets.
+static const size_t STL_STREAM_RESERVE_MAX = 1024 * 1024;
+
+StlParser::StlParser(TriangleSink &sink, size_t size) : _sink(sink), _size(size)
+{
+}
+
+bool StlParser::feed(const char *data, size_t size)
+{
+  if (_bad) {
+    return false;
+  }
+
+  // Parse straight out of the caller's buffer when nothing is carried
+  // over, only the unconsumed tail gets copied.
+  if (_pending.empty())
+  {
+    size_t used = consume(data, size, false);
+    _pending.assign(data + used, size - used);
+  }
+  else
+  {
+    _pending.append(data, size);
+    size_t used = consume(_pending.data(), _pending.size(), false);
+    _pending.erase(0, used);
+  }
+
+  return !_bad;
+}
+
+void StlParser::finish()
+{
+  if (!_bad)
+  {
+    size_t used = consume(_pending.data(), _pending.size(), true);
+    _pending.erase(0, used);
+  }
+
+  if (_bad || !_pending.empty()) {
+    throw std::runtime_error("bad stl: malformed or truncated data");
+  }
+
+  if (_format == BINARY && _triangles != _tri_count) {
+    throw std::runtime_error("bad binary stl: size does not match triangle count");
+  }
+
+  // ASCII gives no count up front and a large binary one isn't trusted,
+  // so those facets are only handed over now
+  if (!_reserved)
+  {
+    _sink.reserve(_triangles);
+    for (size_t i = 0; i < _triangles; ++i) {
+      _sink.triangle(i, _verts.data() + i * 3);
     }
+    std::vector<glm::vec3>().swap(_verts);
+  }
 
-    return mesh_from_verts(tri_count, verts);*/
+  _sink.finish();
 }
 
-std::vector<glm::vec3> Loader::read_stl_ascii(std::istream &input)
+bool StlParser::detect(const char *data, size_t size, bool final)
 {
-  auto nextLine = [&input]() -> std::string {
-    std::string line;
+  const char *end = data + size;
 
-    while (input.peek() == ' ')
-      input.get();
+  if (size < 5 && !final) {
+    return false;
+  }
 
-    do {
-      std::getline(input, line);
+  if (size < 5 || strncmp(data, "solid", 5) != 0)
+  {
+    _format = BINARY;
+    return true;
+  }
+
+  // Same rule as Loader::is_stl_ascii, minus the size check that needs the
+  // whole file: the token after the header line must start a facet.
+  const char *nl = (const char *)memchr(data, '\n', size);
+  if (!nl)
+  {
+    if (size < STL_SNIFF_MAX && !final) {
+      return false;
     }
-    while (line.size() == 0 && !input.eof());
-    return line;
-  };
+    _format = BINARY;
+    return true;
+  }
 
-  auto startsWith = [](std::string &s, std::string f) -> bool {
-    return s.find(f) == 0;
+  const char *p = stl_ascii::skip_space(nl, end);
+  if (end - p < 8 && !final) {
+    return false;
+  }
+
+  auto startsWith = [p, end](const char *f) -> bool {
+    size_t n = strlen(f);
+    return (size_t)(end - p) >= n && strncmp(p, f, n) == 0;
   };
 
-  uint32_t tri_count = 0;
-  std::vector<glm::vec3> verts(tri_count*3);
+  _format = (startsWith("facet") || startsWith("endsolid")) ? ASCII : BINARY;
+  return true;
+}
 
-  nextLine();
-  bool okay = true;
-  while (!input.eof() && okay)
+size_t StlParser::consume(const char *data, size_t size, bool final)
+{
+  const char *p = data, *end = data + size;
+
+  if (_format == UNKNOWN)
   {
-    std::string line = nextLine();
-    if (startsWith(line, "endsolid")) {
-      break;
+    if (!detect(data, size, final)) {
+      return 0;
     }
-    
-    if (!startsWith(line, "facet normal") ||
-        !startsWith(nextLine(), "outer loop"))
-    {
-      okay = false;
-      break;
+    if (_format == ASCII) {
+      p = stl_ascii::skip_line(p, end);
     }
+  }
 
-    for (int i=0; i < 3; ++i)
+  if (_format == BINARY)
+  {
+    if (!_preamble)
     {
-      std::string tok;
-      std::istringstream l(nextLine());
-      
-      l >> tok;
-      if (tok != "vertex")
+      if (size < STL_PREAMBLE_LEN)
       {
-        okay = false;
-        break;
+        _bad = final;
+        return 0;
       }
+      memcpy(&_tri_count, data + STL_HEADER_LEN, sizeof(_tri_count));
+      _preamble = true;
+      p += STL_PREAMBLE_LEN;
 
-      try {
-        l >> tok; 
-        const float x = std::stof(tok);
-        l >> tok;
-        const float y = std::stof(tok);
-        l >> tok;
-        const float z = std::stof(tok);
-        verts.push_back(glm::vec3(x, y, z));
+      if (_size && _size < STL_PREAMBLE_LEN + _tri_count * (uint64_t)STL_FACET_LEN)
+      {
+        _bad = true;
+        return 0;
       }
-      catch (std::invalid_argument) {
-        okay = false;
+      if (_size || _tri_count <= STL_STREAM_RESERVE_MAX)
+      {
+        _sink.reserve(_tri_count);
+        _reserved = true;
       }
     }
 
-    if (!startsWith(nextLine(), "endloop") ||
-        !startsWith(nextLine(), "endfacet"))
+    size_t facets = std::min<size_t>((end - p) / STL_FACET_LEN, _tri_count - _triangles);
+
+    glm::vec3 facet[3];
+    for (size_t i = 0; i < facets; ++i)
     {
-      okay = false;
-      break;
+      memcpy(facet, p + 3 * sizeof(float), sizeof(facet));
+      if (_reserved) {
+        _sink.triangle(_triangles, facet);
+      } else {
+        _verts.insert(_verts.end(), facet, facet + 3);
+      }
+      _triangles++;
+      p += STL_FACET_LEN;
+    }
+
+    // Anything after the last facet is padding, drop it
+    if (_triangles == _tri_count) {
+      p = end;
     }
 
-    tri_count++;
+    return p - data;
   }
 
-  if (okay)
+  // Facets are only parsed up to the last complete "endfacet", otherwise a
+  // number split across two reads would be taken for a shorter one.
+  const char *safe = end;
+  if (!final)
   {
-      return verts;
+    size_t last = std::string_view(p, end - p).rfind("endfacet");
+    if (last == std::string_view::npos) {
+      return p - data;
+    }
+    safe = p + last + 8;
   }
-  else
+
+  glm::vec3 facet[3];
+  for (;;)
   {
-      //emit error_bad_stl();
-      return {};
+    stl_ascii::Result r = stl_ascii::read_facet(p, safe, facet);
+    if (r == stl_ascii::END) {
+      break;
+    }
+    if (r == stl_ascii::BAD)
+    {
+      _bad = true;
+      break;
+    }
+    _verts.insert(_verts.end(), facet, facet + 3);
+    _triangles++;
   }
-}
 
+  // Once endsolid is seen the rest of the input is ignored
+  return final ? size : p - data;
+}
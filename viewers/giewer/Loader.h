@@ -5,21 +5,102 @@
 #include <string>
 #include <glm/vec3.hpp>
 
+#include "TriangleSink.h"
+
 class Loader
 {
 public:
-    Loader();
+    // threads caps how many workers large ASCII files are split across,
+    // 0 uses every hardware thread.
+    Loader(unsigned threads = 0);
 
     std::vector<glm::vec3> load_stl(std::istream &);
     std::vector<glm::vec3> load_stl(const std::string &);
 
+    // Parses a borrowed, contiguous STL image (a mapped file or a socket
+    // payload). The bytes are not copied and must outlive the call.
+    std::vector<glm::vec3> load_stl(const char *data, size_t size);
+
+    // Deliver the triangles to sink instead of building an array. Return
+    // false for malformed ASCII, throw for a bad file or binary size.
+    bool load_stl(const std::string &, TriangleSink &sink);
+    bool load_stl(const char *data, size_t size, TriangleSink &sink);
+
+    // Any registered format (STL, binary PLY, OBJ, CompactMesh), picked by
+    // sniffing the leading bytes rather than by file name. Errors as for
+    // load_stl.
+    std::vector<glm::vec3> load(const std::string &);
+    bool load(const std::string &, TriangleSink &sink);
+    bool load(const char *data, size_t size, TriangleSink &sink);
+
+    // Name of the registered format data looks like. STL has no magic of
+    // its own, so anything unrecognised is "stl".
+    static const char *sniff(const char *data, size_t size);
+
 protected:
 
-    std::vector<glm::vec3> read_stl_ascii(std::istream &);
-    std::vector<glm::vec3> read_stl_binary(std::istream &);
+    // The registry, tried in order. A new format is a reader with these
+    // two functions and a row in formats().
+    struct Format
+    {
+        const char *name;
+        bool (*sniff)(const char *data, size_t size);
+        bool (Loader::*read)(const char *data, size_t size, TriangleSink &sink);
+    };
+
+    static const std::vector<Format> &formats();
+
+    bool read_ply(const char *data, size_t size, TriangleSink &sink);
+    bool read_obj(const char *data, size_t size, TriangleSink &sink);
+    bool read_compact(const char *data, size_t size, TriangleSink &sink);
+
+    static bool is_stl_ascii(const char *data, size_t size);
+
+    bool read_stl_ascii(const char *data, size_t size, TriangleSink &sink);
+    bool read_stl_ascii_parallel(const char *data, size_t size, unsigned threads, TriangleSink &sink);
+    void read_stl_binary(const char *data, size_t size, TriangleSink &sink);
 
 private:
+    unsigned _threads;
     const std::string _filename;
 };
 
+// Push-style STL parser for data that arrives in pieces, e.g. off a socket.
+// The format is detected from the first bytes without seeking and facets
+// are parsed as soon as they are complete, so only a partial facet is ever
+// held back between calls to feed(). Binary facets go to the sink as they
+// arrive; ASCII carries no count, so those are held until finish(), as are
+// binary ones whose header claims more than is worth reserving unseen.
+class StlParser
+{
+public:
+    // size is the total the data will come to, if known, so that a binary
+    // header claiming more triangles than fit is rejected straight away
+    StlParser(TriangleSink &sink, size_t size = 0);
+
+    // Returns false once the input is known to be malformed
+    bool feed(const char *data, size_t size);
+
+    // Flushes whatever is left to the sink. Throws if the data was
+    // malformed or ended part way through a facet.
+    void finish();
+
+private:
+    enum Format { UNKNOWN, ASCII, BINARY };
+
+    TriangleSink &_sink;
+    Format _format = UNKNOWN;
+    bool _bad = false;
+    bool _preamble = false;
+    bool _reserved = false;
+    size_t _size;
+    uint32_t _tri_count = 0;
+    size_t _triangles = 0;
+    std::string _pending;
+    std::vector<glm::vec3> _verts;
+
+    bool detect(const char *data, size_t size, bool final);
+    size_t consume(const char *data, size_t size, bool final);
+};
+
 #endif // LOADER_H
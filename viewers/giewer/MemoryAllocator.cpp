@@ -0,0 +1,275 @@
+#include "MemoryAllocator.h"
+#include "Vulkan.h"
+#include "Metrics.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+// The smallest piece handed out, 256 bytes, which also covers the
+// alignment buffers usually ask for
+static const uint32_t MIN_ORDER = 8;
+
+struct MemoryAllocator::Block
+{
+  VkDeviceMemory memory;
+  uint32_t type;
+  char *mapped;
+  VkDeviceSize used = 0;
+  uint32_t allocations = 0;
+  // Offsets of the free pieces of each order, from MIN_ORDER up
+  std::vector<std::set<VkDeviceSize>> free;
+};
+
+static uint32_t orderOf(VkDeviceSize size)
+{
+  uint32_t order = MIN_ORDER;
+  while (((VkDeviceSize)1 << order) < size) {
+    order++;
+  }
+  return order;
+}
+
+MemoryAllocator::MemoryAllocator(VkDeviceSize blockSize)
+: _blockSize(blockSize), _blockOrder(orderOf(blockSize))
+{
+  if (((VkDeviceSize)1 << _blockOrder) != blockSize) {
+    throw std::runtime_error("memory block size must be a power of two!");
+  }
+
+  vkGetPhysicalDeviceMemoryProperties(Vulkan::ctx().physicalDevice(), &_properties);
+  _blocks.resize(_properties.memoryTypeCount);
+
+  _metricSource = addMetricSource([this](std::map<std::string, int> &metrics) { report(metrics); });
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+  removeMetricSource(_metricSource);
+
+  for (auto &blocks : _blocks) {
+    for (Block *block : blocks) {
+      destroyBlock(block);
+    }
+  }
+}
+
+uint32_t MemoryAllocator::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags memFlags) const
+{
+  for (uint32_t i = 0; i < _properties.memoryTypeCount; i++) {
+    if ((typeFilter & (1 << i)) && (_properties.memoryTypes[i].propertyFlags & memFlags) == memFlags) {
+      return i;
+    }
+  }
+
+  throw std::runtime_error("failed to find suitable memory type!");
+}
+
+VkDeviceMemory MemoryAllocator::allocateMemory(uint32_t type, VkDeviceSize size, char **mapped)
+{
+  VkMemoryAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = size;
+  allocInfo.memoryTypeIndex = type;
+
+  VkDeviceMemory memory;
+  if (vkAllocateMemory(Vulkan::ctx().device(), &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+    throw std::runtime_error("failed to allocate buffer memory!");
+  }
+
+  *mapped = nullptr;
+  if (_properties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+  {
+    void *data;
+    if (vkMapMemory(Vulkan::ctx().device(), memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS)
+    {
+      vkFreeMemory(Vulkan::ctx().device(), memory, nullptr);
+      throw std::runtime_error("failed to map buffer memory!");
+    }
+    *mapped = (char *)data;
+  }
+
+  return memory;
+}
+
+// Called with _lock held
+MemoryAllocator::Block *MemoryAllocator::createBlock(uint32_t type)
+{
+  Block *block = new Block();
+  try {
+    block->memory = allocateMemory(type, _blockSize, &block->mapped);
+  } catch (...) {
+    delete block;
+    throw;
+  }
+  block->type = type;
+  block->free.resize(_blockOrder - MIN_ORDER + 1);
+  block->free.back().insert(0);
+
+  _blocks[type].push_back(block);
+  return block;
+}
+
+void MemoryAllocator::destroyBlock(Block *block)
+{
+  // Freeing memory unmaps it too
+  vkFreeMemory(Vulkan::ctx().device(), block->memory, nullptr);
+  delete block;
+}
+
+// Called with _lock held. Takes the first free piece of at least order,
+// splitting it in halves until it is the right size; the upper halves are
+// left free.
+bool MemoryAllocator::carve(Block *block, uint32_t order, Allocation &allocation)
+{
+  for (uint32_t k = order; k <= _blockOrder; k++)
+  {
+    auto &free = block->free[k - MIN_ORDER];
+    if (free.empty()) {
+      continue;
+    }
+
+    VkDeviceSize offset = *free.begin();
+    free.erase(free.begin());
+    while (k > order)
+    {
+      k--;
+      block->free[k - MIN_ORDER].insert(offset + ((VkDeviceSize)1 << k));
+    }
+
+    VkDeviceSize size = (VkDeviceSize)1 << order;
+    block->used += size;
+    block->allocations++;
+
+    allocation.memory = block->memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.mapped = block->mapped ? block->mapped + offset : nullptr;
+    allocation.block = block;
+    allocation.order = order;
+    return true;
+  }
+  return false;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags memFlags)
+{
+  uint32_t type = findMemoryType(requirements.memoryTypeBits, memFlags);
+  VkDeviceSize size = std::max(requirements.size, requirements.alignment);
+
+  Allocation allocation;
+
+  if (size > _blockSize / 4)
+  {
+    allocation.memory = allocateMemory(type, requirements.size, &allocation.mapped);
+    allocation.size = requirements.size;
+
+    std::lock_guard<std::mutex> guard(_lock);
+    _dedicated++;
+    _dedicatedBytes += allocation.size;
+    return allocation;
+  }
+
+  // Pieces are aligned to their own size, which covers the alignment
+  uint32_t order = orderOf(size);
+
+  std::lock_guard<std::mutex> guard(_lock);
+  for (Block *block : _blocks[type]) {
+    if (carve(block, order, allocation)) {
+      return allocation;
+    }
+  }
+  carve(createBlock(type), order, allocation);
+  return allocation;
+}
+
+void MemoryAllocator::free(const Allocation &allocation)
+{
+  if (!allocation.memory) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(_lock);
+
+  Block *block = allocation.block;
+  if (!block)
+  {
+    vkFreeMemory(Vulkan::ctx().device(), allocation.memory, nullptr);
+    _dedicated--;
+    _dedicatedBytes -= allocation.size;
+    return;
+  }
+
+  block->used -= allocation.size;
+  block->allocations--;
+
+  // Merge with the buddy for as long as it is free as a whole
+  VkDeviceSize offset = allocation.offset;
+  uint32_t order = allocation.order;
+  while (order < _blockOrder)
+  {
+    auto &free = block->free[order - MIN_ORDER];
+    auto buddy = free.find(offset ^ ((VkDeviceSize)1 << order));
+    if (buddy == free.end()) {
+      break;
+    }
+    offset = std::min(offset, *buddy);
+    free.erase(buddy);
+    order++;
+  }
+  block->free[order - MIN_ORDER].insert(offset);
+
+  // An empty block is kept only while it is the last of its type, so
+  // loading and unloading a part doesn't allocate a block each time
+  auto &blocks = _blocks[block->type];
+  if (!block->allocations && blocks.size() > 1)
+  {
+    blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+    destroyBlock(block);
+  }
+}
+
+MemoryAllocator::Stats MemoryAllocator::stats()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  Stats stats;
+  stats.dedicated = _dedicated;
+  stats.reserved = _dedicatedBytes;
+  stats.used = _dedicatedBytes;
+
+  for (auto &blocks : _blocks)
+  {
+    for (Block *block : blocks)
+    {
+      stats.blocks++;
+      stats.allocations += block->allocations;
+      stats.reserved += _blockSize;
+      stats.used += block->used;
+      stats.free += _blockSize - block->used;
+
+      for (uint32_t k = _blockOrder; k >= MIN_ORDER; k--)
+      {
+        if (!block->free[k - MIN_ORDER].empty())
+        {
+          stats.largestFree = std::max(stats.largestFree, (VkDeviceSize)1 << k);
+          break;
+        }
+      }
+    }
+  }
+  stats.allocations += _dedicated;
+  return stats;
+}
+
+void MemoryAllocator::report(std::map<std::string, int> &metrics)
+{
+  Stats s = stats();
+  metrics["memory_blocks"] = (int)s.blocks;
+  metrics["memory_dedicated"] = (int)s.dedicated;
+  metrics["memory_allocations"] = (int)s.allocations;
+  metrics["memory_reserved_kb"] = (int)(s.reserved / 1024);
+  metrics["memory_used_kb"] = (int)(s.used / 1024);
+  // How much of the free space in blocks is in pieces too small for the
+  // largest allocation that would still fit, 0 when it is all in one piece
+  metrics["memory_fragmentation_pct"] = s.free ? (int)(100 - s.largestFree * 100 / s.free) : 0;
+}
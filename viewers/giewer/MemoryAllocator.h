@@ -0,0 +1,76 @@
+#ifndef __MEMORY_ALLOCATOR_H
+#define __MEMORY_ALLOCATOR_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Hands out buffer memory from large per-memory-type blocks instead of one
+// vkAllocateMemory per buffer, which runs into maxMemoryAllocationCount
+// long before the heap is full. Blocks are split buddy style, so a piece
+// is a power of two sized and aligned, and freed pieces merge back with
+// their buddy. Host visible blocks stay mapped for as long as they live.
+class MemoryAllocator
+{
+public:
+  struct Block;
+
+  // What a buffer binds to. block is null for memory of its own.
+  struct Allocation
+  {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    char *mapped = nullptr;
+    Block *block = nullptr;
+    uint32_t order = 0;
+  };
+
+  struct Stats
+  {
+    uint32_t blocks = 0;
+    uint32_t dedicated = 0;
+    uint32_t allocations = 0;
+    VkDeviceSize reserved = 0;
+    VkDeviceSize used = 0;
+    // Free space in blocks, and the largest piece of it one allocation
+    // can get; the further apart they are the more fragmented blocks are
+    VkDeviceSize free = 0;
+    VkDeviceSize largestFree = 0;
+  };
+
+  // blockSize must be a power of two. Anything larger than a quarter of it
+  // gets memory of its own.
+  MemoryAllocator(VkDeviceSize blockSize);
+  ~MemoryAllocator();
+
+  Allocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags memFlags);
+  void free(const Allocation &allocation);
+
+  Stats stats();
+
+private:
+  VkPhysicalDeviceMemoryProperties _properties;
+  VkDeviceSize _blockSize;
+  uint32_t _blockOrder;
+
+  std::mutex _lock;
+  // Per memory type
+  std::vector<std::vector<Block *>> _blocks;
+  uint32_t _dedicated = 0;
+  VkDeviceSize _dedicatedBytes = 0;
+
+  int _metricSource;
+
+  uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags memFlags) const;
+  VkDeviceMemory allocateMemory(uint32_t type, VkDeviceSize size, char **mapped);
+  Block *createBlock(uint32_t type);
+  void destroyBlock(Block *block);
+  bool carve(Block *block, uint32_t order, Allocation &allocation);
+  void report(std::map<std::string, int> &metrics);
+};
+
+#endif
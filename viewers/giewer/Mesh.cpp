@@ -1,9 +1,86 @@
 #include "Mesh.h"
 #include "Vulkan.h"
 
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <algorithm>
 #include <stdexcept>
+#include "Hash.h"
+#include "Welder.h"
+#include "Metrics.h"
+#include "MeshCache.h"
+#include "CompactMesh.h"
+#include "Uploader.h"
+#include "GeometryPool.h"
 #include "ResourceBuffer.h"
 
+const size_t LitMesh::PAGE_SIZE;
+
+static std::atomic<int> pagesHashed { 0 };
+static std::atomic<int> pagesCopied { 0 };
+
+static void countPages(size_t hashed, size_t copied)
+{
+  static int source = addMetricSource([](std::map<std::string, int> &metrics) {
+    metrics["update_pages"] = pagesHashed;
+    metrics["update_pages_copied"] = pagesCopied;
+  });
+  (void)source;
+
+  pagesHashed += (int)hashed;
+  pagesCopied += (int)copied;
+}
+
+// One hash per LitMesh::PAGE_SIZE bytes, the last page may be short
+static std::vector<uint64_t> hashPages(const void *data, size_t size)
+{
+  std::vector<uint64_t> pages((size + LitMesh::PAGE_SIZE - 1) / LitMesh::PAGE_SIZE);
+  for (size_t p = 0; p < pages.size(); p++)
+  {
+    size_t offset = p * LitMesh::PAGE_SIZE;
+    pages[p] = hash64((const char *)data + offset, std::min(LitMesh::PAGE_SIZE, size - offset));
+  }
+  return pages;
+}
+
+static size_t indexSize(VkIndexType type)
+{
+  return type == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+static void packIndices(const uint32_t *indices, uint32_t count, VkIndexType type, void *out)
+{
+  if (type == VK_INDEX_TYPE_UINT16) {
+    uint16_t *packed = (uint16_t *)out;
+    for (uint32_t i = 0; i < count; i++) {
+      packed[i] = (uint16_t)indices[i];
+    }
+  } else {
+    memcpy(out, indices, count * sizeof(uint32_t));
+  }
+}
+
+static GeometryRange *filledVertexBuffer(const LitVertex *vertices, uint32_t vertexCount, size_t bufSize)
+{
+  std::unique_ptr<GeometryRange> range(Vulkan::ctx().geometry().allocateVertices(bufSize));
+  Vulkan::ctx().uploader().upload(*range, range->offset(), vertices, vertexCount * sizeof(LitVertex));
+  return range.release();
+}
+
+// An unwelded triangle, each corner carrying the facet normal
+static void flatTriangle(const glm::vec3 *v, LitVertex *out)
+{
+  glm::vec3 k = v[1] - v[0];
+  glm::vec3 l = v[2] - v[0];
+  glm::vec3 n = glm::normalize(glm::cross(k, l));
+
+  for (int i = 0; i < 3; i++) {
+    out[i]._vertex = v[i];
+    out[i]._normal = n;
+  }
+}
+
 std::vector<VkVertexInputBindingDescription> &SimpleVertex::getVertexBindingDescriptions()
 {
   static std::vector<VkVertexInputBindingDescription> bindingDescriptions { 
@@ -43,9 +120,45 @@ Mesh::Mesh() : _transform(1.0f)
 {
 }
 
-VkBuffer Mesh::vkBuffer() const
+Mesh::~Mesh()
 {
-  return *_vertexBuffer;
+  // Only still set when loading failed part way, and an upload may still
+  // be writing to them
+  retireBuffers();
+}
+
+void Mesh::retireBuffers()
+{
+  if (_vertexBuffer) {
+    Vulkan::ctx().retire(_vertexBuffer);
+  }
+  if (_indexBuffer) {
+    Vulkan::ctx().retire(_indexBuffer);
+  }
+  _vertexBuffer = nullptr;
+  _indexBuffer = nullptr;
+}
+
+VkIndexType Mesh::indexTypeFor(uint32_t vertexCount)
+{
+  // Most parts fit in 16-bit indices, which halves the index buffer
+  return vertexCount <= UINT16_MAX ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+}
+
+void Mesh::createIndexBuffer(const uint32_t *indices, uint32_t indexCount, uint32_t vertexCount)
+{
+  _indexType = indexTypeFor(vertexCount);
+  _indexCount = indexCount;
+  _indexBuffer = fillIndexBuffer(indices, indexCount, _indexType, indexSize(_indexType) * std::max<size_t>(indexCount, 1));
+}
+
+GeometryRange *Mesh::fillIndexBuffer(const uint32_t *indices, uint32_t indexCount, VkIndexType type, size_t bufSize)
+{
+  std::unique_ptr<GeometryRange> range(Vulkan::ctx().geometry().allocateIndices(bufSize));
+  Vulkan::ctx().uploader().upload(*range, range->offset(), indexCount * indexSize(type), [&](void *data) {
+    packIndices(indices, indexCount, type, data);
+  });
+  return range.release();
 }
 
 SimpleMesh::SimpleMesh(const std::vector<glm::vec3> &vertices) : _vertices(vertices)
@@ -56,52 +169,485 @@ SimpleMesh::SimpleMesh(const std::vector<glm::vec3> &vertices) : _vertices(verti
   }*/
 }
 
+// Drawn from the shared vertex buffers like every other mesh, so it takes
+// their LitVertex stride, with flat normals
 void SimpleMesh::createVertexBuffer()
 {
-  size_t bufSize = sizeof(SimpleVertex) * _vertices.size();
+  size_t bufSize = sizeof(LitVertex) * std::max<size_t>(count(), 1);
 
-  _vertexBuffer = new VertexBuffer(
-    bufSize,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-  );
+  _vertexBuffer = Vulkan::ctx().geometry().allocateVertices(bufSize);
+  Vulkan::ctx().uploader().upload(*_vertexBuffer, _vertexBuffer->offset(), count() * sizeof(LitVertex), [&](void *data) {
+    for (uint32_t i = 0; i < count(); i += 3) {
+      flatTriangle(&_vertices[i], (LitVertex *)data + i);
+    }
+  });
+}
 
-  void* data;
-  if (vkMapMemory(Vulkan::ctx().device(), *_vertexBuffer, 0, bufSize, 0, &data) != VK_SUCCESS) {
-    throw std::runtime_error("failed to map vertex buffer!");
-  }
-  memcpy(data, _vertices.data(), bufSize);
-  vkUnmapMemory(Vulkan::ctx().device(), *_vertexBuffer);
+LitMesh::LitMesh(bool weld) : _weld(weld)
+{
 }
 
-LitMesh::LitMesh(const std::vector<glm::vec3> &vertices)
+LitMesh::~LitMesh()
 {
-  _vertices.resize(vertices.size());
-  for (int i = 0; i < vertices.size(); i++) {
-    _vertices[i]._vertex = vertices[i];
+  // Only left when loading an unwelded mesh failed part way
+  delete _staging;
+}
+
+LitMesh::LitMesh(const std::vector<glm::vec3> &vertices, bool weld) : _weld(weld)
+{
+  reserve(vertices.size() / 3);
+  for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+    triangle(i / 3, &vertices[i]);
   }
+  finish();
+}
 
-  for (int i = 0; i < vertices.size(); i += 3) {
-    glm::vec3 k = vertices[i + 1] - vertices[i];
-    glm::vec3 l = vertices[i + 2] - vertices[i];
-    glm::vec3 n = glm::normalize(glm::cross(k, l));
-    _vertices[i]._normal = _vertices[i + 1]._normal = _vertices[i + 2]._normal = n;
+LitMesh::LitMesh(const LitVertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount, bool trackPages)
+: _weld(true), _trackPages(trackPages)
+{
+  upload(vertices, vertexCount, indices, indexCount);
+}
+
+LitMesh::LitMesh(const CompactMesh &compact, bool trackPages) : _weld(true), _trackPages(trackPages)
+{
+  static_assert(sizeof(CompactMesh::Vertex) == sizeof(LitVertex), "CompactMesh::Vertex must match LitVertex");
+
+  // Indices first, so a corrupt stream throws before anything is allocated
+  std::vector<uint32_t> indices(compact.indexCount());
+  compact.decodeIndices(indices.data());
+
+  // Hashing reads the vertices back, which mustn't come from the mapped,
+  // write-combined buffer
+  if (_trackPages)
+  {
+    std::vector<LitVertex> vertices(compact.vertexCount());
+    compact.decodeVertices((CompactMesh::Vertex *)vertices.data());
+    upload(vertices.data(), compact.vertexCount(), indices.data(), (uint32_t)indices.size());
+    return;
   }
+
+  size_t bufSize = sizeof(LitVertex) * std::max<size_t>(compact.vertexCount(), 1);
+
+  _vertexBuffer = Vulkan::ctx().geometry().allocateVertices(bufSize);
+  Vulkan::ctx().uploader().upload(*_vertexBuffer, _vertexBuffer->offset(), compact.vertexCount() * sizeof(LitVertex), [&](void *data) {
+    compact.decodeVertices((CompactMesh::Vertex *)data);
+  });
+
+  _count = compact.vertexCount();
+  createIndexBuffer(indices.data(), (uint32_t)indices.size(), _count);
+}
+
+void LitMesh::cacheAs(MeshCache *cache, uint64_t key, uint64_t sourceSize)
+{
+  _cache = cache;
+  _cacheKey = key;
+  _cacheSourceSize = sourceSize;
 }
 
 void LitMesh::createVertexBuffer()
 {
-  size_t bufSize = sizeof(LitVertex) * _vertices.size();
+  // Already created and filled while the mesh was being loaded
+}
 
-  _vertexBuffer = new VertexBuffer(
-    bufSize,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-  );
+void LitMesh::reserve(size_t triangles)
+{
+  // Welding needs every position before it can start, so those are held
+  // until finish()
+  if (_weld)
+  {
+    _positions.resize(triangles * 3);
+    return;
+  }
+
+  // Never create an empty buffer, an empty mesh just draws nothing
+  size_t bufSize = sizeof(LitVertex) * 3 * std::max<size_t>(triangles, 1);
+
+  // Triangles are written to staging memory as they are parsed, and the
+  // whole lot copied over in finish()
+  _vertexBuffer = Vulkan::ctx().geometry().allocateVertices(bufSize);
+  _staging = new StagingBuffer(bufSize);
+  _mapped = (LitVertex *)_staging->mapped();
+  _count = (uint32_t)(triangles * 3);
+  _capacity = (uint32_t)(bufSize / sizeof(LitVertex));
+}
+
+void LitMesh::triangle(size_t index, const glm::vec3 *v)
+{
+  if (_weld)
+  {
+    std::copy(v, v + 3, _positions.data() + index * 3);
+    return;
+  }
+
+  // Built on the stack and written in one go, the mapped memory is
+  // write-combined and should never be read back.
+  LitVertex out[3];
+  flatTriangle(v, out);
+  memcpy(_mapped + index * 3, out, sizeof(out));
+}
+
+void LitMesh::finish()
+{
+  if (!_weld)
+  {
+    _mapped = nullptr;
+
+    StagingBuffer *staging = _staging;
+    _staging = nullptr;
+    Vulkan::ctx().uploader().upload(*_vertexBuffer, _vertexBuffer->offset(), staging, _count * sizeof(LitVertex));
+    return;
+  }
+
+  static_assert(sizeof(Welder::Vertex) == sizeof(LitVertex), "Welder::Vertex must match LitVertex");
+
+  Welder welder;
+  welder.weld(_positions.data(), _positions.size() / 3);
+  std::vector<glm::vec3>().swap(_positions);
+
+  const LitVertex *vertices = (const LitVertex *)welder.vertices().data();
+  uint32_t vertexCount = (uint32_t)welder.vertices().size();
+  const std::vector<uint32_t> &indices = welder.indices();
+
+  if (_cache) {
+    _cache->store(_cacheKey, _cacheSourceSize, vertices, vertexCount, indices.data(), (uint32_t)indices.size());
+  }
+
+  upload(vertices, vertexCount, indices.data(), (uint32_t)indices.size());
+}
 
-  void* data;
-  if (vkMapMemory(Vulkan::ctx().device(), *_vertexBuffer, 0, bufSize, 0, &data) != VK_SUCCESS) {
-    throw std::runtime_error("failed to map vertex buffer!");
+void LitMesh::upload(const LitVertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount)
+{
+  size_t bufSize = sizeof(LitVertex) * std::max<size_t>(vertexCount, 1);
+  _vertexBuffer = filledVertexBuffer(vertices, vertexCount, bufSize);
+
+  _count = vertexCount;
+  createIndexBuffer(indices, indexCount, _count);
+
+  if (_trackPages)
+  {
+    _vertexPages = hashPages(vertices, vertexCount * sizeof(LitVertex));
+    _indexPages = hashPages(indices, indexCount * sizeof(uint32_t));
+    countPages(_vertexPages.size() + _indexPages.size(), 0);
+  }
+}
+
+void LitMesh::patch(uint32_t first, uint32_t replace, const glm::vec3 *positions, uint32_t count)
+{
+  if (_weld || !_vertexBuffer) {
+    throw std::runtime_error("only unwelded meshes can be patched");
+  }
+
+  std::lock_guard<std::mutex> guard(_patchLock);
+
+  uint64_t triangles = _count / 3;
+  if (first > triangles || replace > triangles - first) {
+    throw std::runtime_error("patch range is outside the mesh");
+  }
+
+  uint64_t newTriangles = triangles - replace + count;
+  if (newTriangles * 3 > UINT32_MAX) {
+    throw std::runtime_error("patched mesh is too large");
+  }
+
+  const VkDeviceSize stride = 3 * sizeof(LitVertex);
+  VkDeviceSize tailFrom = (first + replace) * stride;
+  VkDeviceSize tailTo = (first + (uint64_t)count) * stride;
+  VkDeviceSize tailBytes = (triangles - first - replace) * stride;
+  VkDeviceSize patchBytes = count * stride;
+
+  std::unique_ptr<StagingBuffer> staging;
+  if (patchBytes)
+  {
+    staging.reset(new StagingBuffer(patchBytes));
+
+    LitVertex *out = (LitVertex *)staging->mapped();
+    for (uint32_t i = 0; i < count; i++)
+    {
+      LitVertex tri[3];
+      flatTriangle(positions + i * 3, tri);
+      memcpy(out + i * 3, tri, sizeof(tri));
+    }
+  }
+
+  std::unique_ptr<GeometryRange> grown;
+  std::unique_ptr<StagingBuffer> tail;
+
+  if (newTriangles * 3 > _capacity)
+  {
+    // Grow by half again so a run of inserts doesn't reallocate every time
+    uint64_t capacity = std::max<uint64_t>(newTriangles * 3, (uint64_t)_capacity * 3 / 2);
+    capacity = std::min<uint64_t>(capacity, UINT32_MAX - UINT32_MAX % 3);
+    grown.reset(Vulkan::ctx().geometry().allocateVertices(capacity * sizeof(LitVertex)));
+
+    Vulkan::ctx().transfer([&](VkCommandBuffer cmd) {
+      VkBuffer from = *_vertexBuffer, to = *grown;
+      VkDeviceSize fromBase = _vertexBuffer->offset(), toBase = grown->offset();
+      if (first) {
+        VkBufferCopy head = { fromBase, toBase, first * stride };
+        vkCmdCopyBuffer(cmd, from, to, 1, &head);
+      }
+      if (tailBytes) {
+        VkBufferCopy rest = { fromBase + tailFrom, toBase + tailTo, tailBytes };
+        vkCmdCopyBuffer(cmd, from, to, 1, &rest);
+      }
+      if (staging) {
+        VkBufferCopy region = { 0, toBase + first * stride, patchBytes };
+        vkCmdCopyBuffer(cmd, *staging, to, 1, &region);
+      }
+    });
+  }
+  else
+  {
+    // A copy may not overlap itself, so a tail that moves goes through a
+    // scratch buffer first
+    bool shift = tailBytes && tailFrom != tailTo;
+    if (shift) {
+      tail.reset(new StagingBuffer(tailBytes));
+    }
+
+    Vulkan::ctx().transfer([&](VkCommandBuffer cmd) {
+      VkBuffer vb = *_vertexBuffer;
+      VkDeviceSize base = _vertexBuffer->offset();
+      if (shift)
+      {
+        VkBufferCopy out = { base + tailFrom, 0, tailBytes };
+        vkCmdCopyBuffer(cmd, vb, *tail, 1, &out);
+
+        VkMemoryBarrier copied{};
+        copied.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        copied.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+        copied.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(
+          cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          0, 1, &copied, 0, nullptr, 0, nullptr
+        );
+
+        VkBufferCopy back = { 0, base + tailTo, tailBytes };
+        vkCmdCopyBuffer(cmd, *tail, vb, 1, &back);
+      }
+      if (staging) {
+        VkBufferCopy region = { 0, base + first * stride, patchBytes };
+        vkCmdCopyBuffer(cmd, *staging, vb, 1, &region);
+      }
+    });
+  }
+
+  // Everything from the first patched triangle on has moved or changed
+  _vertexPages.resize(std::min<size_t>(_vertexPages.size(), first * stride / PAGE_SIZE));
+
+  // transfer() waited for the copies, the scratch buffers go with this scope
+  GeometryRange *old = nullptr;
+  State &state = Vulkan::ctx().state();
+  state.lock();
+  if (grown)
+  {
+    old = _vertexBuffer;
+    _vertexBuffer = grown.release();
+    _capacity = (uint32_t)(_vertexBuffer->size() / sizeof(LitVertex));
+  }
+  _count = (uint32_t)(newTriangles * 3);
+  state.unlock();
+
+  if (old) {
+    Vulkan::ctx().retire(old);
+  }
+}
+
+void LitMesh::update(const CompactMesh &compact)
+{
+  if (!_weld)
+  {
+    LitMeshUpdate flat(*this);
+    compact.read(flat);
+    return;
+  }
+
+  std::vector<uint32_t> indices(compact.indexCount());
+  compact.decodeIndices(indices.data());
+  std::vector<LitVertex> vertices(compact.vertexCount());
+  compact.decodeVertices((CompactMesh::Vertex *)vertices.data());
+
+  update(vertices.data(), compact.vertexCount(), indices.data(), compact.indexCount());
+}
+
+void LitMesh::update(const LitVertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount)
+{
+  if (!_weld && indexCount) {
+    throw std::runtime_error("an unwelded mesh has no indices to update");
+  }
+
+  std::lock_guard<std::mutex> guard(_patchLock);
+
+  size_t vertexBytes = vertexCount * sizeof(LitVertex);
+  VkIndexType indexType = indexTypeFor(vertexCount);
+  size_t indexBytes = indexCount * indexSize(indexType);
+
+  std::vector<uint64_t> vertexPages = hashPages(vertices, vertexBytes);
+  std::vector<uint64_t> indexPages = hashPages(indices, indexCount * sizeof(uint32_t));
+
+  // Each buffer the new version fits in is kept and only gets its changed
+  // pages; one it has outgrown is replaced whole. Pages are copied into the
+  // buffers frames are drawing from, so new indices only go in place when
+  // the vertices they refer to do too.
+  bool vertexFits = _vertexBuffer && vertexBytes <= _vertexBuffer->size();
+  bool indexFits = !_weld || (vertexFits && _indexBuffer && indexType == _indexType && indexBytes <= _indexBuffer->size());
+
+  // Re-sent meshes tend to grow a little at a time, so as in patch() leave
+  // room rather than reallocating on every version
+  auto grown = [](size_t need, size_t minimum, GeometryRange *old) {
+    size_t size = std::max(need, minimum);
+    return old ? std::max(size, old->size() * 3 / 2) : size;
+  };
+
+  std::unique_ptr<GeometryRange> vertexBuffer;
+  std::unique_ptr<GeometryRange> indexBuffer;
+  if (!vertexFits) {
+    vertexBuffer.reset(filledVertexBuffer(vertices, vertexCount, grown(vertexBytes, sizeof(LitVertex), _vertexBuffer)));
+  }
+  if (!indexFits) {
+    indexBuffer.reset(fillIndexBuffer(indices, indexCount, indexType, grown(indexBytes, indexSize(indexType), _indexBuffer)));
+  }
+
+  // Changed pages are packed one after another into a staging buffer, with
+  // runs of neighbouring pages merged into one copy
+  std::vector<VkBufferCopy> vertexRegions, indexRegions;
+  VkDeviceSize stagingBytes = 0;
+  size_t copied = (vertexFits ? 0 : vertexPages.size()) + (indexFits ? 0 : indexPages.size());
+
+  auto collect = [&](const std::vector<uint64_t> &pages, const std::vector<uint64_t> &old,
+                     size_t pageUnits, size_t units, size_t unitSize, std::vector<VkBufferCopy> &regions) {
+    for (size_t p = 0; p < pages.size(); p++)
+    {
+      if (p < old.size() && old[p] == pages[p]) {
+        continue;
+      }
+      copied++;
+
+      VkDeviceSize offset = p * pageUnits * unitSize;
+      VkDeviceSize size = std::min(pageUnits, units - p * pageUnits) * unitSize;
+      if (!regions.empty() && regions.back().dstOffset + regions.back().size == offset) {
+        regions.back().size += size;
+      } else {
+        regions.push_back({ stagingBytes, offset, size });
+      }
+      stagingBytes += size;
+    }
+  };
+  if (vertexFits) {
+    collect(vertexPages, _vertexPages, PAGE_SIZE, vertexBytes, 1, vertexRegions);
+  }
+  if (indexFits) {
+    collect(indexPages, _indexPages, PAGE_SIZE / sizeof(uint32_t), indexCount, indexSize(indexType), indexRegions);
+  }
+
+  std::unique_ptr<StagingBuffer> staging;
+  if (stagingBytes)
+  {
+    staging.reset(new StagingBuffer(stagingBytes));
+
+    char *data = (char *)staging->mapped();
+    for (auto &region : vertexRegions) {
+      memcpy(data + region.srcOffset, (const char *)vertices + region.dstOffset, region.size);
+    }
+    for (auto &region : indexRegions)
+    {
+      size_t first = region.dstOffset / indexSize(indexType);
+      size_t count = region.size / indexSize(indexType);
+      packIndices(indices + first, (uint32_t)count, indexType, data + region.srcOffset);
+    }
+  }
+
+  // Regions so far are within the mesh, the copies go to where its ranges
+  // are in the shared buffers
+  for (auto &region : vertexRegions) {
+    region.dstOffset += _vertexBuffer->offset();
+  }
+  for (auto &region : indexRegions) {
+    region.dstOffset += _indexBuffer->offset();
+  }
+
+  // Frames recorded until the swap below may draw a mix of old and new
+  // pages, but never past the ranges they were recorded with
+  if (staging)
+  {
+    Vulkan::ctx().transfer([&](VkCommandBuffer cmd) {
+      if (!vertexRegions.empty()) {
+        vkCmdCopyBuffer(cmd, *staging, *_vertexBuffer, (uint32_t)vertexRegions.size(), vertexRegions.data());
+      }
+      if (!indexRegions.empty()) {
+        vkCmdCopyBuffer(cmd, *staging, *_indexBuffer, (uint32_t)indexRegions.size(), indexRegions.data());
+      }
+    });
+  }
+
+  GeometryRange *oldVertices = nullptr;
+  GeometryRange *oldIndices = nullptr;
+
+  // Only the swap holds up the render thread, transfer() waited above
+  {
+    std::lock_guard<State> guard(Vulkan::ctx().state());
+
+    if (vertexBuffer)
+    {
+      oldVertices = _vertexBuffer;
+      _vertexBuffer = vertexBuffer.release();
+      _capacity = (uint32_t)(_vertexBuffer->size() / sizeof(LitVertex));
+    }
+    if (indexBuffer)
+    {
+      oldIndices = _indexBuffer;
+      _indexBuffer = indexBuffer.release();
+      _indexType = indexType;
+    }
+    _count = vertexCount;
+    _indexCount = indexCount;
+  }
+
+  if (oldVertices) {
+    Vulkan::ctx().retire(oldVertices);
+  }
+  if (oldIndices) {
+    Vulkan::ctx().retire(oldIndices);
+  }
+
+  _trackPages = true;
+  _vertexPages = std::move(vertexPages);
+  _indexPages = std::move(indexPages);
+  countPages(_vertexPages.size() + _indexPages.size(), copied);
+}
+
+void LitMeshUpdate::reserve(size_t triangles)
+{
+  if (_mesh.welded()) {
+    _positions.resize(triangles * 3);
+  } else {
+    _vertices.resize(triangles * 3);
   }
-  memcpy(data, _vertices.data(), bufSize);
-  vkUnmapMemory(Vulkan::ctx().device(), *_vertexBuffer);
 }
 
+void LitMeshUpdate::triangle(size_t index, const glm::vec3 *v)
+{
+  if (_mesh.welded()) {
+    std::copy(v, v + 3, _positions.data() + index * 3);
+  } else {
+    flatTriangle(v, _vertices.data() + index * 3);
+  }
+}
+
+void LitMeshUpdate::finish()
+{
+  if (!_mesh.welded())
+  {
+    _mesh.update(_vertices.data(), (uint32_t)_vertices.size(), nullptr, 0);
+    return;
+  }
+
+  Welder welder;
+  welder.weld(_positions.data(), _positions.size() / 3);
+  std::vector<glm::vec3>().swap(_positions);
+
+  _mesh.update(
+    (const LitVertex *)welder.vertices().data(), (uint32_t)welder.vertices().size(),
+    welder.indices().data(), (uint32_t)welder.indices().size()
+  );
+}
@@ -1,11 +1,17 @@
 #ifndef __MESH_H
 #define __MESH_H
 
+#include <mutex>
 #include <vector>
 #include <glm/glm.hpp>
 #include "vulkan/vulkan.h"
 
-class VertexBuffer;
+#include "TriangleSink.h"
+
+class MeshCache;
+class CompactMesh;
+class GeometryRange;
+class StagingBuffer;
 
 class SimpleVertex
 {
@@ -28,16 +34,43 @@ class Mesh
 protected:
   Mesh();
   glm::mat4 _transform;
-  VertexBuffer *_vertexBuffer = nullptr;
+  bool _visible = true;
+  GeometryRange *_vertexBuffer = nullptr;
+
+  GeometryRange *_indexBuffer = nullptr;
+  VkIndexType _indexType = VK_INDEX_TYPE_UINT32;
+  uint32_t _indexCount = 0;
+
+  void createIndexBuffer(const uint32_t *indices, uint32_t indexCount, uint32_t vertexCount);
+
+  // 16-bit where the vertex count allows it
+  static VkIndexType indexTypeFor(uint32_t vertexCount);
+  static GeometryRange *fillIndexBuffer(const uint32_t *indices, uint32_t indexCount, VkIndexType type, size_t bufSize);
 
 public:
+  virtual ~Mesh();
+
   void transform(glm::mat4 &t) { _transform = t; }
   const glm::mat4 &transform() const { return _transform; }
-  
+
+  // Hidden meshes keep their buffers but aren't drawn
+  void visible(bool v) { _visible = v; }
+  bool visible() const { return _visible; }
+
   virtual uint32_t count() = 0;
   virtual void createVertexBuffer() = 0;
 
-  VkBuffer vkBuffer() const;
+  // Hands the buffers to Vulkan::retire rather than deleting them with the
+  // mesh, for a mesh taken out of the scene while frames may still read it
+  void retireBuffers();
+
+  // Where the vertices and indices are in the shared geometry buffers
+  const GeometryRange &vertexRange() const { return *_vertexBuffer; }
+  const GeometryRange &indexRange() const { return *_indexBuffer; }
+
+  // Meshes with an index buffer are drawn indexed, others as a plain list
+  uint32_t indexCount() const { return _indexCount; }
+  VkIndexType indexType() const { return _indexType; }
 };
 
 class SimpleMesh : public Mesh
@@ -47,19 +80,100 @@ private:
 
 public:
   SimpleMesh(const std::vector<glm::vec3> &vertices);
-  virtual uint32_t count() { return (uint32_t)_vertices.size(); }
+  virtual uint32_t count() { return (uint32_t)(_vertices.size() / 3 * 3); }
   virtual void createVertexBuffer();
 };
 
-class LitMesh : public Mesh
+// LitMesh is filled as a TriangleSink. By default the soup is welded into
+// unique vertices and an index buffer once loading finishes; unwelded,
+// vertices and their facet normals are written straight into staging
+// memory as they are parsed. Either way the geometry goes into ranges of
+// the shared DEVICE_LOCAL buffers of Vulkan::geometry(), filled through
+// Vulkan::uploader(), and no CPU-side copy is kept.
+// An unwelded mesh keeps triangle i at vertices 3i..3i+2, which is what
+// lets patch() edit it in place.
+class LitMesh : public Mesh, public TriangleSink
 {
 private:
-  std::vector<LitVertex> _vertices;
+  bool _weld;
+  uint32_t _count = 0;
+  uint32_t _capacity = 0;
+  LitVertex *_mapped = nullptr;
+  StagingBuffer *_staging = nullptr;
+  std::mutex _patchLock;
+  std::vector<glm::vec3> _positions;
+
+  // Hashes of each PAGE_SIZE page of the vertices and the uint32 indices
+  // last uploaded, so update() can tell which pages changed. Only kept
+  // when asked for with trackPages().
+  bool _trackPages = false;
+  std::vector<uint64_t> _vertexPages;
+  std::vector<uint64_t> _indexPages;
+
+  MeshCache *_cache = nullptr;
+  uint64_t _cacheKey = 0;
+  uint64_t _cacheSourceSize = 0;
+
+  void upload(const LitVertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount);
 
 public:
-  LitMesh(const std::vector<glm::vec3> &vertices);
-  virtual uint32_t count() { return (uint32_t)_vertices.size(); }
+  LitMesh(bool weld = true);
+  LitMesh(const std::vector<glm::vec3> &vertices, bool weld = true);
+  ~LitMesh();
+
+  // Already welded, e.g. out of a MeshCache entry
+  LitMesh(const LitVertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount, bool trackPages = false);
+
+  // Decoded straight into staging memory, unless the pages are tracked
+  LitMesh(const CompactMesh &compact, bool trackPages = false);
+
+  static const size_t PAGE_SIZE = 64 * 1024;
+
+  // Hash pages from the first upload on, for a mesh that may be sent again.
+  // Must be called before the mesh is filled.
+  void trackPages() { _trackPages = true; }
+
+  bool welded() const { return _weld; }
+
+  // Have finish() store the welded result in cache under key
+  void cacheAs(MeshCache *cache, uint64_t key, uint64_t sourceSize);
+
+  virtual uint32_t count() { return _count; }
   virtual void createVertexBuffer();
+
+  virtual void reserve(size_t triangles);
+  virtual void triangle(size_t index, const glm::vec3 *v);
+  virtual void finish();
+
+  // Replaces triangles [first, first + replace) of an unwelded mesh with
+  // count new ones, given as three positions each, by copying them into
+  // the vertex buffer on the GPU. The buffer only gets reallocated when
+  // the mesh outgrows it.
+  void patch(uint32_t first, uint32_t replace, const glm::vec3 *positions, uint32_t count);
+
+  // Replaces the whole mesh with a new version processed the same way,
+  // welded or not (unwelded has no indices). Only pages whose hash differs
+  // from the last version are copied into the existing buffers; new
+  // buffers are only made when the new version doesn't fit.
+  void update(const LitVertex *vertices, uint32_t vertexCount, const uint32_t *indices, uint32_t indexCount);
+  void update(const CompactMesh &compact);
+};
+
+// Collects a new version of a LitMesh from a loader and passes it to
+// LitMesh::update() on finish(), welded or not to match the mesh
+class LitMeshUpdate : public TriangleSink
+{
+private:
+  LitMesh &_mesh;
+  std::vector<glm::vec3> _positions;
+  std::vector<LitVertex> _vertices;
+
+public:
+  LitMeshUpdate(LitMesh &mesh) : _mesh(mesh) {}
+
+  virtual void reserve(size_t triangles);
+  virtual void triangle(size_t index, const glm::vec3 *v);
+  virtual void finish();
 };
 
 #endif
\ No newline at end of file
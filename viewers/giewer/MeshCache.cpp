@@ -0,0 +1,278 @@
+#include "MeshCache.h"
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// Cache files are this header, then vertexCount LitVertex, then indexCount
+// uint32 indices, all in host byte order.
+struct CacheHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceSize;
+  uint32_t vertexCount;
+  uint32_t indexCount;
+};
+
+static const char CACHE_MAGIC[4] = { 'G', 'W', 'M', 'C' };
+
+// Bump whenever LitVertex or the welding changes, old entries then miss
+static const uint32_t CACHE_VERSION = 1;
+
+static const char *CACHE_EXT = ".mesh";
+
+MeshCache::MeshCache(const std::string &directory, uint64_t maxBytes)
+: _directory(directory), _maxBytes(maxBytes)
+{
+  if (!enabled()) {
+    return;
+  }
+
+  std::error_code ec;
+  fs::create_directories(_directory, ec);
+  if (ec)
+  {
+    std::cerr << "mesh cache disabled, can't create " << _directory << ": " << ec.message() << std::endl;
+    _maxBytes = 0;
+    return;
+  }
+
+  scan();
+  evict();
+}
+
+std::unique_ptr<MeshCache> MeshCache::fromEnvironment()
+{
+  std::string directory;
+  if (const char *dir = getenv("GIEWER_CACHE_DIR")) {
+    directory = dir;
+  } else {
+    std::error_code ec;
+    directory = (fs::temp_directory_path(ec) / "giewer-cache").string();
+  }
+
+  // Off unless asked for, it writes every welded upload to disk
+  uint64_t megabytes = 0;
+  if (const char *mb = getenv("GIEWER_CACHE_MB")) {
+    megabytes = strtoull(mb, nullptr, 10);
+  }
+
+  return std::unique_ptr<MeshCache>(new MeshCache(directory, megabytes * 1024 * 1024));
+}
+
+std::string MeshCache::path(uint64_t key) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)key, CACHE_EXT);
+  return (fs::path(_directory) / name).string();
+}
+
+void MeshCache::scan()
+{
+  // Rebuild the LRU order from the files' modification times, which are
+  // bumped on every hit so the order survives restarts.
+  std::vector<std::pair<fs::file_time_type, uint64_t>> order;
+
+  std::error_code ec;
+  for (auto &entry : fs::directory_iterator(_directory, ec))
+  {
+    const fs::path &p = entry.path();
+    if (p.extension() == ".tmp")
+    {
+      // Left behind by a store that never finished
+      fs::remove(p, ec);
+      continue;
+    }
+
+    std::string stem = p.stem().string();
+    if (p.extension() != CACHE_EXT || stem.size() != 16 ||
+        stem.find_first_not_of("0123456789abcdef") != std::string::npos)
+    {
+      continue;
+    }
+
+    uint64_t key = strtoull(stem.c_str(), nullptr, 16);
+    uint64_t bytes = entry.file_size(ec);
+    if (ec) {
+      continue;
+    }
+
+    _items[key] = { bytes, 0 };
+    _totalBytes += bytes;
+    order.push_back({ entry.last_write_time(ec), key });
+  }
+
+  std::sort(order.begin(), order.end());
+  for (auto &o : order) {
+    touch(_items.find(o.second));
+  }
+}
+
+void MeshCache::evict()
+{
+  while (_totalBytes > _maxBytes && !_byUse.empty()) {
+    drop(_items.find(_byUse.begin()->second));
+  }
+}
+
+// Makes item the most recently used
+void MeshCache::touch(std::map<uint64_t, Item>::iterator item)
+{
+  _byUse.erase(item->second.lastUse);
+  item->second.lastUse = ++_clock;
+  _byUse[item->second.lastUse] = item->first;
+}
+
+// Forgets item and removes its file
+void MeshCache::drop(std::map<uint64_t, Item>::iterator item)
+{
+  std::error_code ec;
+  fs::remove(path(item->first), ec);
+  _totalBytes -= item->second.bytes;
+  _byUse.erase(item->second.lastUse);
+  _items.erase(item);
+}
+
+std::unique_ptr<MeshCache::Entry> MeshCache::load(uint64_t key, uint64_t sourceSize)
+{
+  using namespace boost::interprocess;
+
+  if (!enabled()) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> guard(_lock);
+
+  auto item = _items.find(key);
+  if (item == _items.end()) {
+    return nullptr;
+  }
+
+  std::string file = path(key);
+  std::unique_ptr<Entry> entry(new Entry());
+  try {
+    entry->_file = file_mapping(file.c_str(), read_only);
+    entry->_region = mapped_region(entry->_file, read_only);
+  }
+  catch (const interprocess_exception &e) {
+    std::cerr << "mesh cache: can't map " << file << ": " << e.what() << std::endl;
+    drop(item);
+    return nullptr;
+  }
+
+  const char *data = (const char *)entry->_region.get_address();
+  size_t size = entry->_region.get_size();
+
+  CacheHeader header{};
+  if (size >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+  }
+
+  size_t expected = sizeof(header) +
+    (size_t)header.vertexCount * sizeof(LitVertex) +
+    (size_t)header.indexCount * sizeof(uint32_t);
+
+  // Truncated, from an older version or from another upload with the same
+  // hash; either way it would only ever miss again, so it goes. Unmapped
+  // first, as a mapped file can't be removed everywhere.
+  if (size < sizeof(header) ||
+      memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+      header.version != CACHE_VERSION ||
+      header.sourceSize != sourceSize ||
+      size != expected)
+  {
+    entry.reset();
+    drop(item);
+    return nullptr;
+  }
+
+  entry->vertices = (const LitVertex *)(data + sizeof(header));
+  entry->vertexCount = header.vertexCount;
+  entry->indices = (const uint32_t *)(entry->vertices + header.vertexCount);
+  entry->indexCount = header.indexCount;
+
+  touch(item);
+  std::error_code ec;
+  fs::last_write_time(file, fs::file_time_type::clock::now(), ec);
+
+  return entry;
+}
+
+void MeshCache::store(uint64_t key, uint64_t sourceSize,
+                      const LitVertex *vertices, uint32_t vertexCount,
+                      const uint32_t *indices, uint32_t indexCount)
+{
+  if (!enabled()) {
+    return;
+  }
+
+  CacheHeader header;
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.sourceSize = sourceSize;
+  header.vertexCount = vertexCount;
+  header.indexCount = indexCount;
+
+  uint64_t bytes = sizeof(header) +
+    (uint64_t)vertexCount * sizeof(LitVertex) +
+    (uint64_t)indexCount * sizeof(uint32_t);
+
+  if (bytes > _maxBytes) {
+    return;
+  }
+
+  std::string file = path(key);
+  std::string tmp;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    tmp = file + "." + std::to_string(++_clock) + ".tmp";
+  }
+
+  // Written under a temporary name and renamed into place, so a reader
+  // never maps a half-written file
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)vertices, (std::streamsize)vertexCount * sizeof(LitVertex));
+    out.write((const char *)indices, (std::streamsize)indexCount * sizeof(uint32_t));
+    if (!out)
+    {
+      std::cerr << "mesh cache: can't write " << tmp << std::endl;
+      out.close();
+      std::error_code ec;
+      fs::remove(tmp, ec);
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(_lock);
+
+  std::error_code ec;
+  fs::rename(tmp, file, ec);
+  if (ec)
+  {
+    std::cerr << "mesh cache: can't store " << file << ": " << ec.message() << std::endl;
+    fs::remove(tmp, ec);
+    return;
+  }
+
+  auto item = _items.find(key);
+  if (item != _items.end()) {
+    _totalBytes -= item->second.bytes;
+  } else {
+    item = _items.insert({ key, Item{ 0, 0 } }).first;
+  }
+  item->second.bytes = bytes;
+  _totalBytes += bytes;
+  touch(item);
+
+  evict();
+}
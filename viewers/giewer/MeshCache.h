@@ -0,0 +1,77 @@
+#ifndef __MESH_CACHE_H
+#define __MESH_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "Mesh.h"
+
+// On-disk cache of welded meshes, keyed on a hash of the STL bytes they were
+// built from. Each entry is one file holding the LitVertex and index arrays
+// ready to be copied into GPU buffers, so a repeat upload skips parsing and
+// welding. The least recently used entries are evicted to stay under the
+// size cap. Failures are logged and treated as misses, never thrown.
+class MeshCache
+{
+public:
+  // A mapped cache file, the arrays point into the mapping
+  class Entry
+  {
+  public:
+    const LitVertex *vertices = nullptr;
+    uint32_t vertexCount = 0;
+    const uint32_t *indices = nullptr;
+    uint32_t indexCount = 0;
+
+  private:
+    friend class MeshCache;
+    boost::interprocess::file_mapping _file;
+    boost::interprocess::mapped_region _region;
+  };
+
+  // maxBytes of 0 disables the cache
+  MeshCache(const std::string &directory, uint64_t maxBytes);
+
+  // Directory from GIEWER_CACHE_DIR (default <tmp>/giewer-cache), cap in
+  // megabytes from GIEWER_CACHE_MB (default 0, off)
+  static std::unique_ptr<MeshCache> fromEnvironment();
+
+  bool enabled() const { return _maxBytes > 0; }
+
+  // sourceSize guards against two uploads that happen to hash the same
+  std::unique_ptr<Entry> load(uint64_t key, uint64_t sourceSize);
+
+  void store(uint64_t key, uint64_t sourceSize,
+             const LitVertex *vertices, uint32_t vertexCount,
+             const uint32_t *indices, uint32_t indexCount);
+
+private:
+  struct Item
+  {
+    uint64_t bytes;
+    uint64_t lastUse;
+  };
+
+  std::mutex _lock;
+  std::string _directory;
+  uint64_t _maxBytes;
+  uint64_t _totalBytes = 0;
+  uint64_t _clock = 0;
+  std::map<uint64_t, Item> _items;
+  // Key of each item by lastUse, least recently used first
+  std::map<uint64_t, uint64_t> _byUse;
+
+  std::string path(uint64_t key) const;
+  void scan();
+  void evict();
+  void touch(std::map<uint64_t, Item>::iterator item);
+  void drop(std::map<uint64_t, Item>::iterator item);
+};
+
+#endif
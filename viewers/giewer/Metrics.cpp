@@ -1,10 +1,15 @@
 #include "Metrics.h"
 
+#include <mutex>
 #include <chrono>
 #include <iostream>
 
 static std::map<std::string, int> _metrics;
 
+static std::mutex _sourcesLock;
+static std::map<int, std::function<void(std::map<std::string, int> &)>> _sources;
+static int _nextSource = 0;
+
 std::map<std::string, int> &metrics()
 {
   return _metrics;
@@ -18,6 +23,13 @@ void dumpMetrics()
   auto msecs = std::chrono::duration_cast<std::chrono::milliseconds>(now - start);
   std::cout << "fps:" << metrics()["frames"] / (float)(msecs.count() / (float)1000) << std::endl;
 
+  {
+    std::lock_guard<std::mutex> guard(_sourcesLock);
+    for (auto &source : _sources) {
+      source.second(_metrics);
+    }
+  }
+
   for (auto kv : _metrics) {
     std::cout << kv.first  << " " << kv.second << std::endl;
   }
@@ -26,3 +38,15 @@ void dumpMetrics()
   start = now;
 }
 
+int addMetricSource(std::function<void(std::map<std::string, int> &)> source)
+{
+  std::lock_guard<std::mutex> guard(_sourcesLock);
+  _sources[_nextSource] = std::move(source);
+  return _nextSource++;
+}
+
+void removeMetricSource(int id)
+{
+  std::lock_guard<std::mutex> guard(_sourcesLock);
+  _sources.erase(id);
+}
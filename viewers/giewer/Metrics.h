@@ -3,8 +3,14 @@
 
 #include <map>
 #include <string>
+#include <functional>
 
 void dumpMetrics();
 std::map<std::string, int> &metrics();
 
-#endif
\ No newline at end of file
+// Sources fill in their values each time the metrics are dumped, which
+// suits state owned by other threads. The id returned removes the source.
+int addMetricSource(std::function<void(std::map<std::string, int> &)> source);
+void removeMetricSource(int id);
+
+#endif
@@ -0,0 +1,166 @@
+#include "ObjReader.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <glm/vec3.hpp>
+
+// How far into the data sniff() looks past comments for a statement
+static const size_t OBJ_SNIFF_MAX = 4096;
+
+static inline bool isBlank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skipBlank(const char *p, const char *end)
+{
+  while (p < end && isBlank(*p)) {
+    p++;
+  }
+  return p;
+}
+
+static inline const char *nextLine(const char *p, const char *end)
+{
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+// True if the line at p starts with the statement kw followed by a blank
+static inline bool statement(const char *p, const char *end, const char *kw)
+{
+  size_t n = strlen(kw);
+  return (size_t)(end - p) > n && memcmp(p, kw, n) == 0 && isBlank(p[n]);
+}
+
+bool ObjReader::sniff(const char *data, size_t size)
+{
+  const char *end = data + std::min(size, OBJ_SNIFF_MAX);
+  const char *p = data;
+  while (p < end)
+  {
+    p = skipBlank(p, end);
+    if (p < end && (*p == '#' || *p == '\n'))
+    {
+      p = nextLine(p, end);
+      continue;
+    }
+
+    static const char *statements[] = { "v", "vt", "vn", "f", "o", "g", "s", "mtllib", "usemtl" };
+    for (const char *kw : statements)
+    {
+      if (statement(p, end, kw)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Nothing but comments so far, and STL never starts with one
+  return size > 0 && data[0] == '#';
+}
+
+bool ObjReader::read(const char *data, size_t size, TriangleSink &sink)
+{
+  const char *p = data, *end = data + size;
+
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> corners;
+  positions.reserve(size / 64);
+  corners.reserve(size / 16);
+
+  std::vector<int64_t> face;
+  while (p < end)
+  {
+    p = skipBlank(p, end);
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (!eol) {
+      eol = end;
+    }
+
+    if (statement(p, eol, "v"))
+    {
+      glm::vec3 v;
+      p += 1;
+      for (int i = 0; i < 3; i++)
+      {
+        p = skipBlank(p, eol);
+        if (p < eol && *p == '+') {
+          p++;
+        }
+        auto r = std::from_chars(p, eol, v[i]);
+        if (r.ec != std::errc()) {
+          return false;
+        }
+        p = r.ptr;
+      }
+      positions.push_back(v);
+    }
+    else if (statement(p, eol, "f"))
+    {
+      // Corners are "v", "v/vt", "v//vn" or "v/vt/vn", negative indices
+      // count back from the latest vertex
+      face.clear();
+      p += 1;
+      for (;;)
+      {
+        p = skipBlank(p, eol);
+        if (p == eol || *p == '#') {
+          break;
+        }
+        int64_t index;
+        auto r = std::from_chars(p, eol, index);
+        if (r.ec != std::errc() || index == 0) {
+          return false;
+        }
+        face.push_back(index < 0 ? (int64_t)positions.size() + index : index - 1);
+        p = r.ptr;
+        while (p < eol && !isBlank(*p)) {
+          p++;
+        }
+      }
+
+      for (int64_t i : face)
+      {
+        // Forward references are legal, so only the low end is known here
+        if (i < 0 || i > UINT32_MAX) {
+          return false;
+        }
+      }
+
+      for (size_t i = 2; i < face.size(); i++)
+      {
+        corners.push_back((uint32_t)face[0]);
+        corners.push_back((uint32_t)face[i - 1]);
+        corners.push_back((uint32_t)face[i]);
+      }
+    }
+
+    p = eol < end ? eol + 1 : end;
+  }
+
+  for (uint32_t i : corners)
+  {
+    if (i >= positions.size()) {
+      return false;
+    }
+  }
+
+  size_t triangles = corners.size() / 3;
+  sink.reserve(triangles);
+
+  glm::vec3 tri[3];
+  for (size_t t = 0; t < triangles; t++)
+  {
+    for (int i = 0; i < 3; i++) {
+      tri[i] = positions[corners[t * 3 + i]];
+    }
+    sink.triangle(t, tri);
+  }
+
+  sink.finish();
+  return true;
+}
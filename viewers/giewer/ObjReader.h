@@ -0,0 +1,20 @@
+#ifndef __OBJ_READER_H
+#define __OBJ_READER_H
+
+#include <cstddef>
+
+#include "TriangleSink.h"
+
+// Wavefront OBJ geometry: "v" positions and "f" faces, with texture and
+// normal references ignored and polygons split into fans. Everything else
+// (materials, groups, smoothing) has no bearing on what is drawn.
+class ObjReader
+{
+public:
+  static bool sniff(const char *data, size_t size);
+
+  // Returns false if the data is malformed
+  static bool read(const char *data, size_t size, TriangleSink &sink);
+};
+
+#endif
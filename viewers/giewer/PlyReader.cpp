@@ -0,0 +1,395 @@
+#include "PlyReader.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <glm/vec3.hpp>
+
+namespace
+{
+  enum Kind { SIGNED, UNSIGNED, FLOAT };
+
+  struct Type
+  {
+    Kind kind;
+    unsigned size;
+  };
+
+  struct Property
+  {
+    std::string name;
+    Type type;
+    bool list = false;
+    Type countType;
+  };
+
+  struct Element
+  {
+    std::string name;
+    uint64_t count = 0;
+    std::vector<Property> props;
+  };
+
+  Type parseType(const std::string &name)
+  {
+    if (name == "char" || name == "int8") return { SIGNED, 1 };
+    if (name == "uchar" || name == "uint8") return { UNSIGNED, 1 };
+    if (name == "short" || name == "int16") return { SIGNED, 2 };
+    if (name == "ushort" || name == "uint16") return { UNSIGNED, 2 };
+    if (name == "int" || name == "int32") return { SIGNED, 4 };
+    if (name == "uint" || name == "uint32") return { UNSIGNED, 4 };
+    if (name == "float" || name == "float32") return { FLOAT, 4 };
+    if (name == "double" || name == "float64") return { FLOAT, 8 };
+    throw std::runtime_error("bad ply: unknown property type " + name);
+  }
+
+  bool hostIsLittle()
+  {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one == 1;
+  }
+
+  // Bounds-checked reads over the binary body
+  class Cursor
+  {
+  public:
+    const char *p;
+    const char *end;
+    bool swap;
+
+    void need(size_t n) const
+    {
+      if ((size_t)(end - p) < n) {
+        throw std::runtime_error("bad ply: truncated");
+      }
+    }
+
+    void skip(size_t n)
+    {
+      need(n);
+      p += n;
+    }
+
+    void skip(uint64_t count, size_t stride)
+    {
+      if (count > (uint64_t)(end - p) / stride) {
+        throw std::runtime_error("bad ply: truncated");
+      }
+      p += count * stride;
+    }
+
+    template <typename T>
+    T raw(const char *at) const
+    {
+      T v;
+      if (!swap) {
+        memcpy(&v, at, sizeof(T));
+      } else {
+        char b[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++) {
+          b[i] = at[sizeof(T) - 1 - i];
+        }
+        memcpy(&v, b, sizeof(T));
+      }
+      return v;
+    }
+
+    double number(const char *at, Type t) const
+    {
+      switch (t.size)
+      {
+        case 1: return t.kind == SIGNED ? (double)raw<int8_t>(at) : (double)raw<uint8_t>(at);
+        case 2: return t.kind == SIGNED ? (double)raw<int16_t>(at) : (double)raw<uint16_t>(at);
+        case 4:
+          if (t.kind == FLOAT) return raw<float>(at);
+          return t.kind == SIGNED ? (double)raw<int32_t>(at) : (double)raw<uint32_t>(at);
+        default:
+          return raw<double>(at);
+      }
+    }
+
+    // Reads a list count or index, which must be a non-negative integer
+    uint64_t index(Type t)
+    {
+      need(t.size);
+      double v = number(p, t);
+      p += t.size;
+      if (t.kind == FLOAT || v < 0) {
+        throw std::runtime_error("bad ply: bad list count or index");
+      }
+      return (uint64_t)v;
+    }
+  };
+
+  // Size of one record of e, if it has no list properties
+  size_t fixedStride(const Element &e)
+  {
+    size_t stride = 0;
+    for (auto &prop : e.props)
+    {
+      if (prop.list) {
+        return 0;
+      }
+      stride += prop.type.size;
+    }
+    return stride;
+  }
+
+  void skipRecord(Cursor &c, const Element &e)
+  {
+    for (auto &prop : e.props)
+    {
+      if (prop.list) {
+        uint64_t n = c.index(prop.countType);
+        c.skip(n, prop.type.size);
+      } else {
+        c.skip(prop.type.size);
+      }
+    }
+  }
+}
+
+bool PlyReader::sniff(const char *data, size_t size)
+{
+  return size >= 4 && memcmp(data, "ply", 3) == 0 && (data[3] == '\n' || data[3] == '\r');
+}
+
+void PlyReader::read(const char *data, size_t size, TriangleSink &sink)
+{
+  // The header is a few hundred bytes of text ending in "end_header"
+  const char *end = data + size;
+  const char *body = nullptr;
+  for (const char *p = data; p < end; )
+  {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    if (!nl) {
+      break;
+    }
+    if (strncmp(p, "end_header", 10) == 0) {
+      body = nl + 1;
+      break;
+    }
+    p = nl + 1;
+  }
+  if (!body) {
+    throw std::runtime_error("bad ply: no end_header");
+  }
+
+  bool little = true;
+  std::vector<Element> elements;
+
+  std::istringstream header(std::string(data, body - data));
+  std::string line;
+  while (std::getline(header, line))
+  {
+    std::istringstream tokens(line);
+    std::string key;
+    tokens >> key;
+
+    if (key == "format")
+    {
+      std::string format;
+      tokens >> format;
+      if (format == "binary_little_endian") {
+        little = true;
+      } else if (format == "binary_big_endian") {
+        little = false;
+      } else {
+        throw std::runtime_error("unsupported ply format " + format + ", only binary is read");
+      }
+    }
+    else if (key == "element")
+    {
+      Element e;
+      tokens >> e.name >> e.count;
+      elements.push_back(e);
+    }
+    else if (key == "property")
+    {
+      if (elements.empty()) {
+        throw std::runtime_error("bad ply: property outside an element");
+      }
+      Property prop;
+      std::string type;
+      tokens >> type;
+      if (type == "list")
+      {
+        std::string countType, itemType;
+        tokens >> countType >> itemType;
+        prop.list = true;
+        prop.countType = parseType(countType);
+        prop.type = parseType(itemType);
+      }
+      else
+      {
+        prop.type = parseType(type);
+      }
+      tokens >> prop.name;
+      elements.back().props.push_back(prop);
+    }
+  }
+
+  Cursor c = { body, end, little != hostIsLittle() };
+
+  // Vertices stay where they are, only their record offsets are noted
+  const char *vertices = nullptr;
+  uint64_t vertexCount = 0;
+  size_t vertexStride = 0;
+  size_t xyz[3] = { 0, 0, 0 };
+  Type xyzType[3];
+  bool packed = false;
+
+  for (auto &e : elements)
+  {
+    if (e.name == "vertex")
+    {
+      vertexStride = fixedStride(e);
+      if (!vertexStride) {
+        throw std::runtime_error("bad ply: list property on vertices");
+      }
+
+      int found = 0;
+      size_t offset = 0;
+      for (auto &prop : e.props)
+      {
+        int axis = prop.name == "x" ? 0 : prop.name == "y" ? 1 : prop.name == "z" ? 2 : -1;
+        if (axis >= 0)
+        {
+          xyz[axis] = offset;
+          xyzType[axis] = prop.type;
+          found |= 1 << axis;
+        }
+        offset += prop.type.size;
+      }
+      if (found != 7) {
+        throw std::runtime_error("bad ply: vertices without x, y and z");
+      }
+
+      // The common layout, floats x y z next to each other in host order,
+      // is copied out with a single memcpy
+      packed = !c.swap &&
+        xyzType[0].kind == FLOAT && xyzType[0].size == 4 &&
+        xyzType[1].kind == FLOAT && xyzType[1].size == 4 &&
+        xyzType[2].kind == FLOAT && xyzType[2].size == 4 &&
+        xyz[1] == xyz[0] + 4 && xyz[2] == xyz[0] + 8;
+
+      vertices = c.p;
+      vertexCount = e.count;
+      c.skip(e.count, vertexStride);
+    }
+    else if (e.name == "face")
+    {
+      if (!vertices) {
+        throw std::runtime_error("bad ply: faces before vertices");
+      }
+
+      int list = -1;
+      for (size_t i = 0; i < e.props.size(); i++)
+      {
+        if (e.props[i].list && (e.props[i].name == "vertex_indices" || e.props[i].name == "vertex_index")) {
+          list = (int)i;
+        }
+      }
+      if (list < 0) {
+        throw std::runtime_error("bad ply: faces without vertex_indices");
+      }
+
+      auto position = [&](uint64_t i) -> glm::vec3 {
+        const char *v = vertices + i * vertexStride;
+        glm::vec3 out;
+        if (packed) {
+          memcpy(&out, v + xyz[0], sizeof(out));
+        } else {
+          out.x = (float)c.number(v + xyz[0], xyzType[0]);
+          out.y = (float)c.number(v + xyz[1], xyzType[1]);
+          out.z = (float)c.number(v + xyz[2], xyzType[2]);
+        }
+        return out;
+      };
+
+      // First pass counts the triangles and checks every index so the
+      // sink gets an exact count, the second fans each face out.
+      const char *faces = c.p;
+      uint64_t triangles = 0;
+      for (uint64_t f = 0; f < e.count; f++)
+      {
+        for (size_t i = 0; i < e.props.size(); i++)
+        {
+          const Property &prop = e.props[i];
+          if (!prop.list) {
+            c.skip(prop.type.size);
+            continue;
+          }
+          uint64_t n = c.index(prop.countType);
+          if (i != (size_t)list) {
+            c.skip(n, prop.type.size);
+            continue;
+          }
+          for (uint64_t k = 0; k < n; k++)
+          {
+            if (c.index(prop.type) >= vertexCount) {
+              throw std::runtime_error("bad ply: vertex index out of range");
+            }
+          }
+          triangles += n >= 3 ? n - 2 : 0;
+        }
+      }
+
+      sink.reserve(triangles);
+
+      c.p = faces;
+      size_t t = 0;
+      glm::vec3 tri[3];
+      for (uint64_t f = 0; f < e.count; f++)
+      {
+        for (size_t i = 0; i < e.props.size(); i++)
+        {
+          const Property &prop = e.props[i];
+          if (!prop.list) {
+            c.p += prop.type.size;
+            continue;
+          }
+          uint64_t n = c.index(prop.countType);
+          if (i != (size_t)list) {
+            c.p += n * prop.type.size;
+            continue;
+          }
+          for (uint64_t k = 0; k < n; k++)
+          {
+            glm::vec3 v = position(c.index(prop.type));
+            if (k == 0) {
+              tri[0] = v;
+            } else if (k == 1) {
+              tri[2] = v;
+            } else {
+              tri[1] = tri[2];
+              tri[2] = v;
+              sink.triangle(t++, tri);
+            }
+          }
+        }
+      }
+
+      sink.finish();
+      return;
+    }
+    else
+    {
+      size_t stride = fixedStride(e);
+      if (stride) {
+        c.skip(e.count, stride);
+      } else {
+        for (uint64_t i = 0; i < e.count; i++) {
+          skipRecord(c, e);
+        }
+      }
+    }
+  }
+
+  // A point cloud, nothing to draw
+  sink.reserve(0);
+  sink.finish();
+}
@@ -0,0 +1,20 @@
+#ifndef __PLY_READER_H
+#define __PLY_READER_H
+
+#include <cstddef>
+
+#include "TriangleSink.h"
+
+// Binary PLY, little or big endian, as written by scanners and mesh tools.
+// Vertex and face records are read in place from the caller's buffer and
+// faces with more than three corners are split into fans.
+class PlyReader
+{
+public:
+  static bool sniff(const char *data, size_t size);
+
+  // Throws on ASCII PLY and on anything malformed or truncated
+  static void read(const char *data, size_t size, TriangleSink &sink);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+#include <cstdint>
+
+// Framed messages on the viewer port. Each message is a MessageHeader and
+// then length bytes of payload, and a connection can carry any number of
+// them. Fields are little endian. A connection that doesn't open with
+// MESSAGE_MAGIC is taken to be a single raw model upload, ended by the
+// sender closing it. The viewer only writes back when asked to, with
+// header-only messages.
+//
+// Object ids are scoped to a session, a namespace of the scene that one
+// or more connections work in; see MESSAGE_SESSION. A connection starts
+// out in the default session, which is kept until the viewer exits.
+static const char MESSAGE_MAGIC[4] = { 'G', 'I', 'E', 'W' };
+
+enum MessageType : uint16_t
+{
+  // Payload is a model file in any format the Loader knows. A non-zero
+  // objectId names the mesh for later messages. Sent again for the same
+  // objectId, the mesh is replaced in place and only the 64 KB pages of
+  // processed geometry that changed are copied to the GPU; it stays
+  // editable or not as first sent.
+  MESSAGE_MESH = 1,
+
+  // Payload is a PatchHeader followed by PatchHeader::count triangles of
+  // three float x, y, z positions, applied to the mesh named by objectId
+  MESSAGE_PATCH = 2,
+
+  // Viewer to sender, answering MESSAGE_FLAG_NOTIFY_VISIBLE with the mesh's
+  // objectId: the first frame drawing it has been queued for presentation
+  MESSAGE_VISIBLE = 3,
+
+  // Viewer to sender, answering MESSAGE_FLAG_NOTIFY_VISIBLE when the mesh
+  // couldn't be loaded
+  MESSAGE_REJECTED = 4,
+
+  // Payload is 16 floats, a column-major 4x4 model matrix that replaces
+  // the transform of the mesh named by objectId
+  MESSAGE_TRANSFORM = 5,
+
+  // Payload is a uint32, 0 hides the mesh named by objectId and anything
+  // else shows it again. objectId 0 hides or shows the connection's whole
+  // session, a hidden session costs nothing to draw.
+  MESSAGE_VISIBILITY = 6,
+
+  // No payload, the mesh named by objectId leaves the scene and its
+  // objectId is free for a new mesh. objectId 0 clears every mesh out of
+  // the connection's session at once.
+  MESSAGE_REMOVE = 7,
+
+  // No payload, the connection's later messages go to another session. A
+  // non-zero objectId names a session shared by every connection naming
+  // it, kept until the viewer exits. 0 starts a session of the
+  // connection's own, removed when the connection closes or moves on.
+  MESSAGE_SESSION = 8,
+
+  // No payload, the meshes of the connection's session and of the shared
+  // session named by objectId trade places in one step, ids and all. Each
+  // session keeps its visibility, so a producer can build the next version
+  // in a hidden session, swap it in and clear out the old one.
+  MESSAGE_SWAP = 9,
+};
+
+enum MessageFlags : uint16_t
+{
+  // On MESSAGE_MESH: keep the triangles unwelded, in the order they were
+  // sent, so the mesh can take patches. Costs about twice the vertex memory.
+  MESSAGE_FLAG_EDITABLE = 1,
+
+  // Only on the Unix-domain socket: length is 0 and the payload is instead
+  // a memfd, sealed against writes and shrinking, passed with SCM_RIGHTS
+  // alongside the header. The viewer maps it rather than copying it.
+  MESSAGE_FLAG_SHARED_MEMORY = 2,
+
+  // On MESSAGE_MESH: answer with MESSAGE_VISIBLE or MESSAGE_REJECTED on the
+  // same connection
+  MESSAGE_FLAG_NOTIFY_VISIBLE = 4,
+};
+
+// Triangles [first, first + replace) are swapped for the count that follow,
+// so equal counts overwrite in place, replace = 0 inserts before first and
+// count = 0 deletes
+struct PatchHeader
+{
+  uint32_t first;
+  uint32_t replace;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(PatchHeader) == 16, "PatchHeader must match the wire layout");
+
+struct MessageHeader
+{
+  char magic[4];
+  uint16_t type;
+  uint16_t flags;
+  uint64_t objectId;
+  uint64_t length;
+};
+
+static_assert(sizeof(MessageHeader) == 24, "MessageHeader must match the wire layout");
+
+// Anything longer is taken as a corrupt stream and the connection dropped
+static const uint64_t MESSAGE_MAX_LENGTH = 4ull << 30;
+
+#endif
@@ -2,23 +2,10 @@
 #include "Device.h"
 #include "Vulkan.h"
 
+#include <utility>
 #include <stdexcept>
 
-static uint32_t findMemoryType(VkPhysicalDevice device, uint32_t typeFilter, VkMemoryPropertyFlags memFlags)
-{
-  VkPhysicalDeviceMemoryProperties memProperties;
-  vkGetPhysicalDeviceMemoryProperties(device, &memProperties);
-
-  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-    if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & memFlags) == memFlags) {
-      return i;
-    }
-  }
-
-  throw std::runtime_error("failed to find suitable memory type!");
-}
-
-ResourceBuffer::ResourceBuffer(size_t size, VkBufferUsageFlagBits usageFlags, VkMemoryPropertyFlags memFlags) 
+ResourceBuffer::ResourceBuffer(size_t size, VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memFlags) 
 : _size(size)
 {
   VkBufferCreateInfo bufferInfo{};
@@ -27,6 +14,15 @@ ResourceBuffer::ResourceBuffer(size_t size, VkBufferUsageFlagBits usageFlags, Vk
   bufferInfo.usage = usageFlags;
   bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+  // Copied on the transfer queue and read by frames on the graphics queue,
+  // without handing ownership back and forth
+  const std::vector<uint32_t> &families = Vulkan::ctx().copyQueueFamilies();
+  if ((usageFlags & (VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)) && families.size() > 1) {
+    bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferInfo.queueFamilyIndexCount = (uint32_t)families.size();
+    bufferInfo.pQueueFamilyIndices = families.data();
+  }
+
   if (vkCreateBuffer(Vulkan::ctx().device(), &bufferInfo, nullptr, &_buffer) != VK_SUCCESS) {
     throw std::runtime_error("failed to create buffer!");
   }
@@ -34,28 +30,45 @@ ResourceBuffer::ResourceBuffer(size_t size, VkBufferUsageFlagBits usageFlags, Vk
   VkMemoryRequirements memRequirements;
   vkGetBufferMemoryRequirements(Vulkan::ctx().device(), _buffer, &memRequirements);
 
-  VkMemoryAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex = findMemoryType(
-    Vulkan::ctx().physicalDevice(), memRequirements.memoryTypeBits, memFlags
-  );
-
-  if (vkAllocateMemory(Vulkan::ctx().device(), &allocInfo, nullptr, &_bufferMemory) != VK_SUCCESS) {
-    throw std::runtime_error("failed to allocate buffer memory!");
+  try {
+    _memory = Vulkan::ctx().memory().allocate(memRequirements, memFlags);
+  } catch (...) {
+    vkDestroyBuffer(Vulkan::ctx().device(), _buffer, nullptr);
+    throw;
   }
 
-  if (vkBindBufferMemory(Vulkan::ctx().device(), _buffer, _bufferMemory, 0) != VK_SUCCESS) {
+  if (vkBindBufferMemory(Vulkan::ctx().device(), _buffer, _memory.memory, _memory.offset) != VK_SUCCESS)
+  {
+    Vulkan::ctx().memory().free(_memory);
+    vkDestroyBuffer(Vulkan::ctx().device(), _buffer, nullptr);
     throw std::runtime_error("failed to bind buffer memory!");
   }
 }
 
-ResourceBuffer::operator VkBuffer()
+ResourceBuffer::ResourceBuffer(ResourceBuffer &&other)
+: _size(other._size), _buffer(other._buffer), _memory(other._memory)
 {
-  return _buffer;
+  other._buffer = VK_NULL_HANDLE;
+  other._memory = MemoryAllocator::Allocation();
+}
+
+ResourceBuffer &ResourceBuffer::operator =(ResourceBuffer &&other)
+{
+  std::swap(_size, other._size);
+  std::swap(_buffer, other._buffer);
+  std::swap(_memory, other._memory);
+  return *this;
+}
+
+ResourceBuffer::~ResourceBuffer()
+{
+  if (_buffer) {
+    vkDestroyBuffer(Vulkan::ctx().device(), _buffer, nullptr);
+  }
+  Vulkan::ctx().memory().free(_memory);
 }
 
-ResourceBuffer::operator VkDeviceMemory()
+ResourceBuffer::operator VkBuffer()
 {
-  return _bufferMemory;
+  return _buffer;
 }
@@ -3,28 +3,74 @@
 
 #include "vulkan/vulkan.h"
 
+#include "MemoryAllocator.h"
+
+// A buffer and the piece of a memory block it is bound to, both given back
+// when it is deleted
 class ResourceBuffer
 {
 private:
   size_t _size;
-  VkBuffer _buffer;
-  VkDeviceMemory _bufferMemory;
+  VkBuffer _buffer = VK_NULL_HANDLE;
+  MemoryAllocator::Allocation _memory;
 
 public:
-  ResourceBuffer(ResourceBuffer &&other) = default;
-  ResourceBuffer &operator =(ResourceBuffer &&other) = default;
-  ResourceBuffer(size_t size, VkBufferUsageFlagBits usageFlags, VkMemoryPropertyFlags memFlags);
+  ResourceBuffer(ResourceBuffer &&other);
+  ResourceBuffer &operator =(ResourceBuffer &&other);
+  ResourceBuffer(size_t size, VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memFlags);
+  virtual ~ResourceBuffer();
 
   size_t size() const { return _size; }
+
+  // Where the contents of a HOST_VISIBLE buffer can be written, null for
+  // any other. The memory stays mapped for as long as the buffer lives.
+  void *mapped() const { return _memory.mapped; }
+
   operator VkBuffer();
-  operator VkDeviceMemory();
 };
 
+// Vertex buffers can be copied to and from so meshes can be patched in place
 class VertexBuffer : public ResourceBuffer
 {
 public:
   VertexBuffer(size_t size, VkMemoryPropertyFlags memFlags)
-  : ResourceBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, memFlags) {}
+  : ResourceBuffer(
+      size,
+      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      memFlags
+    ) {}
+};
+
+// Copied to when a re-sent mesh is updated in place
+class IndexBuffer : public ResourceBuffer
+{
+public:
+  IndexBuffer(size_t size, VkMemoryPropertyFlags memFlags)
+  : ResourceBuffer(size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, memFlags) {}
+};
+
+class StagingBuffer : public ResourceBuffer
+{
+public:
+  StagingBuffer(size_t size)
+  : ResourceBuffer(
+      size,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    ) {}
+};
+
+// Written by the host for each frame, and read by shaders as per-draw data
+// and by indirect draws as their commands
+class DrawBuffer : public ResourceBuffer
+{
+public:
+  DrawBuffer(size_t size)
+  : ResourceBuffer(
+      size,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    ) {}
 };
 
 class UniformBuffer : public ResourceBuffer
@@ -1,41 +1,750 @@
 #include "SocketServer.h"
 
-#include <boost/array.hpp>
-#include <boost/bind.hpp>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <filesystem>
+
 #include <boost/asio.hpp>
 
-SocketServer::SocketServer(short port) : 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#endif
+
+// Reads for the raw fallback, framed payloads are read in one go
+static const size_t RAW_CHUNK_LEN = 64 * 1024;
+
+// One accepted socket. Reads are asynchronous on the io threads, and
+// whatever they complete is queued for the worker pool one item at a time,
+// so a connection's messages are handled in the order they were sent.
+// Subclasses supply the reads for their kind of socket.
+class Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+  Connection(boost::asio::io_context &io, SocketClient &client, WorkerPool &workers, IngestQueue &queue)
+  : _strand(boost::asio::make_strand(io)), _client(client), _workers(workers), _queue(queue), _id(++_connections)
+  {
+  }
+
+  virtual ~Connection() {}
+
+  void start()
+  {
+    auto self = shared_from_this();
+    boost::asio::post(_strand, [this, self]() { readMagic(true); });
+  }
+
+protected:
+  typedef std::function<void(boost::system::error_code, size_t)> IoHandler;
+
+  // With more than one io thread a read and a reply could otherwise run on
+  // the socket at the same time, so everything touching it runs through
+  // here: the reads and writes are started on it and complete on it.
+  boost::asio::strand<boost::asio::io_context::executor_type> _strand;
+
+  // Reads exactly size bytes, fewer only along with an error
+  virtual void read(void *data, size_t size, IoHandler handler) = 0;
+
+  // Reads whatever is available, at least one byte unless there's an error
+  virtual void readSome(void *data, size_t size, IoHandler handler) = 0;
+
+  // Writes all size bytes, fewer only along with an error
+  virtual void write(const void *data, size_t size, IoHandler handler) = 0;
+
+  // Next file descriptor that came with the bytes read so far, or -1
+  virtual int takeFd() { return -1; }
+
+private:
+  SocketClient &_client;
+  WorkerPool &_workers;
+  IngestQueue &_queue;
+
+  static std::atomic<uint64_t> _connections;
+  const uint64_t _id;
+
+  MessageHeader _header;
+  std::string _payload;
+
+  std::shared_ptr<RawUpload> _raw;
+  std::vector<char> _chunk;
+
+  // Chunks of the raw upload it has kept, each still holding its room.
+  // While it keeps them the next chunk is only read once the last has been
+  // fed, so _rawHeld is exact when asking for room.
+  std::atomic<uint64_t> _rawHeld { 0 };
+  std::atomic<bool> _rawBuffering { true };
+
+  std::mutex _lock;
+  std::deque<std::function<void()>> _work;
+  bool _working = false;
+
+  // Replies waiting to be written, the front one is being written. A deque
+  // doesn't move its elements on push_back, so the front stays put.
+  std::mutex _sendLock;
+  std::deque<MessageHeader> _sending;
+
+  void send(const MessageHeader &header)
+  {
+    {
+      std::lock_guard<std::mutex> guard(_sendLock);
+      _sending.push_back(header);
+      if (_sending.size() > 1) {
+        return;
+      }
+    }
+
+    auto self = shared_from_this();
+    boost::asio::post(_strand, [this, self]() { writeNext(); });
+  }
+
+  void writeNext()
+  {
+    const MessageHeader *header;
+    {
+      std::lock_guard<std::mutex> guard(_sendLock);
+      header = &_sending.front();
+    }
+
+    auto self = shared_from_this();
+    write(header, sizeof(*header),
+      [this, self](boost::system::error_code err, size_t) {
+        std::lock_guard<std::mutex> guard(_sendLock);
+        if (err)
+        {
+          _sending.clear();
+          return;
+        }
+        _sending.pop_front();
+        if (!_sending.empty()) {
+          boost::asio::post(_strand, [this, self]() { writeNext(); });
+        }
+      });
+  }
+
+  void schedule(std::function<void()> fn)
+  {
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      _work.push_back(std::move(fn));
+      if (_working) {
+        return;
+      }
+      _working = true;
+    }
+
+    auto self = shared_from_this();
+    _workers.post([self]() { self->drain(); });
+  }
+
+  void drain()
+  {
+    for (;;)
+    {
+      std::function<void()> fn;
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_work.empty())
+        {
+          _working = false;
+          return;
+        }
+        fn = std::move(_work.front());
+        _work.pop_front();
+      }
+
+      try {
+        fn();
+      }
+      catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  // Reading has stopped for good, the client hears of it after whatever
+  // was still queued
+  void end()
+  {
+    auto self = shared_from_this();
+    schedule([this, self]() { _client.onClose(_id); });
+  }
+
+  void readMagic(bool first)
+  {
+    auto self = shared_from_this();
+    read(_header.magic, sizeof(_header.magic),
+      [this, self, first](boost::system::error_code err, size_t n) {
+        bool framed = n == sizeof(_header.magic) &&
+          memcmp(_header.magic, MESSAGE_MAGIC, sizeof(MESSAGE_MAGIC)) == 0;
+
+        if (framed) {
+          readHeader();
+        } else if (first && n > 0) {
+          startRaw(std::string(_header.magic, n), !!err);
+        } else {
+          if (!err) {
+            std::cerr << "dropping connection, lost message framing" << std::endl;
+          }
+          end();
+        }
+      });
+  }
+
+  void readHeader()
+  {
+    auto self = shared_from_this();
+    const size_t rest = sizeof(_header) - sizeof(_header.magic);
+    read((char *)&_header + sizeof(_header.magic), rest,
+      [this, self](boost::system::error_code err, size_t) {
+        if (err)
+        {
+          end();
+          return;
+        }
+        if (_header.flags & MESSAGE_FLAG_SHARED_MEMORY)
+        {
+          readShared();
+          return;
+        }
+        if (_header.length > MESSAGE_MAX_LENGTH)
+        {
+          std::cerr << "dropping connection, message of " << _header.length << " bytes" << std::endl;
+          end();
+          return;
+        }
+
+        // Nothing more is read from this socket until the payload fits in
+        // the ingest budget
+        _queue.reserve(_header.length, [this, self]() {
+          boost::asio::post(_strand, [this, self]() {
+            _payload.resize((size_t)_header.length);
+            readPayload();
+          });
+        });
+      });
+  }
+
+  void readPayload()
+  {
+    auto self = shared_from_this();
+    read(&_payload[0], _payload.size(),
+      [this, self](boost::system::error_code err, size_t) {
+        if (err)
+        {
+          std::cerr << "dropping connection, message cut short" << std::endl;
+          _payload.clear();
+          _queue.release(_header.length);
+          end();
+          return;
+        }
+
+        auto payload = std::make_shared<std::string>(std::move(_payload));
+        deliver(payload->data(), payload->size(), payload);
+        readMagic(false);
+      });
+  }
+
+  // Hands a payload to the client, keep holds it alive until then, and
+  // gives the payload's room in the ingest budget back afterwards
+  void deliver(const char *data, size_t size, std::shared_ptr<void> keep)
+  {
+    auto header = _header;
+
+    // Holds the connection weakly, a reply the viewer sends once a frame
+    // is drawn mustn't keep a closed socket around
+    std::weak_ptr<Connection> weak = shared_from_this();
+    Reply reply = [weak](const MessageHeader &answer) {
+      if (auto connection = weak.lock()) {
+        connection->send(answer);
+      }
+    };
+
+    schedule([this, header, data, size, keep, reply]() {
+      try {
+        _client.onMessage(_id, header, data, size, reply);
+      }
+      catch (...) {
+        _queue.release(size);
+        throw;
+      }
+      _queue.release(size);
+    });
+  }
+
+  void readShared();
+
+  void startRaw(std::string head, bool ended)
+  {
+    auto self = shared_from_this();
+    auto data = std::make_shared<std::string>(std::move(head));
+    _rawBuffering = true;
+    schedule([this, self, data]() {
+      _raw.reset(_client.onRawUpload());
+      if (_raw) {
+        _raw->feed(data->data(), data->size());
+      }
+    });
+
+    if (ended) {
+      finishRaw();
+    } else {
+      _chunk.resize(RAW_CHUNK_LEN);
+      readRaw();
+    }
+  }
+
+  // Each chunk of a raw upload holds its room until it has been fed, or
+  // until the upload finishes if it keeps the bytes rather than parsing
+  // them as they come
+  void readRaw()
+  {
+    auto self = shared_from_this();
+    _queue.reserve(RAW_CHUNK_LEN, [this, self]() {
+      boost::asio::post(_strand, [this, self]() { readChunk(); });
+    }, _rawHeld * RAW_CHUNK_LEN);
+  }
+
+  void readChunk()
+  {
+    auto self = shared_from_this();
+    readSome(_chunk.data(), _chunk.size(),
+      [this, self](boost::system::error_code err, size_t n) {
+        bool buffering = _rawBuffering;
+        if (n > 0)
+        {
+          auto data = std::make_shared<std::string>(_chunk.data(), n);
+          bool next = buffering && !err;
+          schedule([this, self, data, next]() {
+            feedRaw(data->data(), data->size());
+            if (next) {
+              readRaw();
+            }
+          });
+        }
+        else
+        {
+          _queue.release(RAW_CHUNK_LEN);
+        }
+
+        if (err) {
+          finishRaw();
+        } else if (!buffering) {
+          readRaw();
+        }
+      });
+  }
+
+  // Runs on the worker with the chunk's room reserved. An upload that can't
+  // take a chunk is dropped, it would be broken anyway.
+  void feedRaw(const char *data, size_t size)
+  {
+    size_t before = _raw ? _raw->buffered() : 0;
+    try {
+      if (_raw) {
+        _raw->feed(data, size);
+      }
+    }
+    catch (const std::exception &e) {
+      std::cerr << "dropping raw upload: " << e.what() << std::endl;
+      _raw.reset();
+    }
+    size_t after = _raw ? _raw->buffered() : 0;
+
+    if (after > before) {
+      _rawHeld++;
+    } else {
+      _queue.release(RAW_CHUNK_LEN);
+    }
+    if (!after)
+    {
+      releaseRaw();
+      _rawBuffering = false;
+    }
+  }
+
+  void releaseRaw()
+  {
+    for (; _rawHeld > 0; _rawHeld--) {
+      _queue.release(RAW_CHUNK_LEN);
+    }
+  }
+
+  void finishRaw()
+  {
+    auto self = shared_from_this();
+    schedule([this, self]() {
+      std::shared_ptr<RawUpload> raw = std::move(_raw);
+      try {
+        if (raw) {
+          raw->finish();
+        }
+      }
+      catch (...) {
+        releaseRaw();
+        throw;
+      }
+      releaseRaw();
+    });
+    end();
+  }
+};
+
+std::atomic<uint64_t> Connection::_connections { 0 };
+
+template <typename Socket>
+class StreamConnection : public Connection
+{
+public:
+  StreamConnection(Socket socket, boost::asio::io_context &io, SocketClient &client, WorkerPool &workers, IngestQueue &queue)
+  : Connection(io, client, workers, queue), _socket(std::move(socket))
+  {
+  }
+
+protected:
+  Socket _socket;
+
+  void read(void *data, size_t size, IoHandler handler)
+  {
+    boost::asio::async_read(_socket, boost::asio::buffer(data, size),
+      boost::asio::bind_executor(_strand, std::move(handler)));
+  }
+
+  void readSome(void *data, size_t size, IoHandler handler)
+  {
+    _socket.async_read_some(boost::asio::buffer(data, size),
+      boost::asio::bind_executor(_strand, std::move(handler)));
+  }
+
+  void write(const void *data, size_t size, IoHandler handler)
+  {
+    boost::asio::async_write(_socket, boost::asio::buffer(data, size),
+      boost::asio::bind_executor(_strand, std::move(handler)));
+  }
+};
+
+#ifdef __linux__
+
+// A sealed memfd mapped read-only, closed along with the mapping
+class SharedMapping
+{
+public:
+  SharedMapping(int fd) : _fd(fd)
+  {
+    // The sender could otherwise truncate the file while it's being
+    // parsed, and touching the lost pages would raise SIGBUS here
+    int seals = fcntl(_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE))
+    {
+      close(_fd);
+      throw std::runtime_error("shared memory must be a memfd sealed against writes and shrinking");
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+    {
+      close(_fd);
+      throw std::runtime_error("can't stat shared memory");
+    }
+    _size = (size_t)st.st_size;
+
+    if (_size)
+    {
+      _data = mmap(nullptr, _size, PROT_READ, MAP_SHARED | MAP_POPULATE, _fd, 0);
+      if (_data == MAP_FAILED)
+      {
+        close(_fd);
+        throw std::runtime_error("can't map shared memory");
+      }
+    }
+  }
+
+  ~SharedMapping()
+  {
+    if (_data) {
+      munmap(_data, _size);
+    }
+    close(_fd);
+  }
+
+  const char *data() const { return (const char *)_data; }
+  size_t size() const { return _size; }
+
+private:
+  int _fd;
+  void *_data = nullptr;
+  size_t _size = 0;
+};
+
+// Unix-domain connection read with recvmsg, so file descriptors passed with
+// SCM_RIGHTS are picked up along with the bytes they were sent with
+class LocalConnection : public StreamConnection<boost::asio::local::stream_protocol::socket>
+{
+public:
+  using StreamConnection::StreamConnection;
+
+  ~LocalConnection()
+  {
+    for (int fd : _fds) {
+      close(fd);
+    }
+  }
+
+protected:
+  void read(void *data, size_t size, IoHandler handler)
+  {
+    readRest((char *)data, size, 0, std::move(handler));
+  }
+
+  void readSome(void *data, size_t size, IoHandler handler)
+  {
+    auto self = shared_from_this();
+    _socket.async_wait(boost::asio::socket_base::wait_read, boost::asio::bind_executor(_strand,
+      [this, self, data, size, handler](boost::system::error_code err) {
+        if (err)
+        {
+          handler(err, 0);
+          return;
+        }
+
+        ssize_t n = receive(data, size);
+        if (n > 0) {
+          handler(err, (size_t)n);
+        } else if (n == 0) {
+          handler(boost::asio::error::eof, 0);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          readSome(data, size, handler);
+        } else {
+          handler(boost::system::error_code(errno, boost::system::system_category()), 0);
+        }
+      }));
+  }
+
+  int takeFd()
+  {
+    if (_fds.empty()) {
+      return -1;
+    }
+    int fd = _fds.front();
+    _fds.pop_front();
+    return fd;
+  }
+
+private:
+  std::deque<int> _fds;
+
+  void readRest(char *data, size_t size, size_t done, IoHandler handler)
+  {
+    if (done == size)
+    {
+      handler(boost::system::error_code(), done);
+      return;
+    }
+
+    auto self = shared_from_this();
+    readSome(data + done, size - done,
+      [this, self, data, size, done, handler](boost::system::error_code err, size_t n) {
+        if (err) {
+          handler(err, done + n);
+        } else {
+          readRest(data, size, done + n, handler);
+        }
+      });
+  }
+
+  ssize_t receive(void *data, size_t size)
+  {
+    char control[CMSG_SPACE(sizeof(int) * 16)];
+
+    iovec iov = { data, size };
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(_socket.native_handle(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      return n;
+    }
+
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; i++)
+      {
+        int fd;
+        memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+        _fds.push_back(fd);
+      }
+    }
+    return n;
+  }
+};
+
+void Connection::readShared()
+{
+  int fd = takeFd();
+  if (fd < 0 || _header.length != 0)
+  {
+    if (fd >= 0) {
+      close(fd);
+    }
+    std::cerr << "dropping connection, shared memory message without exactly one file" << std::endl;
+    end();
+    return;
+  }
+
+  std::shared_ptr<SharedMapping> mapping;
+  try {
+    mapping = std::make_shared<SharedMapping>(fd);
+  }
+  catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    readMagic(false);
+    return;
+  }
+
+  // Nothing is copied, but the mesh parsed out of it takes about as much
+  // memory again, so the mapping counts against the budget all the same
+  auto self = shared_from_this();
+  _queue.reserve(mapping->size(), [this, self, mapping]() {
+    boost::asio::post(_strand, [this, self, mapping]() {
+      deliver(mapping->data(), mapping->size(), mapping);
+      readMagic(false);
+    });
+  });
+}
+
+#else
+
+void Connection::readShared()
+{
+  std::cerr << "dropping connection, shared memory messages need Linux" << std::endl;
+  end();
+}
+
+#endif
+
+SocketServer::SocketServer(short port, const std::string &localPath, unsigned ioThreads, unsigned workerThreads) :
   _port(port),
+  _localPath(localPath),
+  _ioThreads(ioThreads ? ioThreads : 2),
   _acceptor(
-      _io_context, 
+      _io_context,
       boost::asio::ip::tcp::endpoint(tcp::v4(), port)
-  )
+  ),
+  _queue(IngestQueue::budgetFromEnvironment()),
+  _workers(workerThreads)
 {
 }
 
 SocketServer::~SocketServer()
 {
-  if (_serverThread) {
-    delete _serverThread;
+  stop();
+}
+
+std::string SocketServer::localPathFromEnvironment()
+{
+  if (const char *path = getenv("GIEWER_SOCKET")) {
+    return path;
   }
+  std::error_code ec;
+  return (std::filesystem::temp_directory_path(ec) / "giewer.sock").string();
 }
 
 void SocketServer::start(SocketClient &client)
 {
   _client = &client;
   acceptNext();
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  if (!_localPath.empty())
+  {
+    // A socket file left behind by a viewer that didn't exit cleanly would
+    // make the bind fail
+    std::remove(_localPath.c_str());
+    try {
+      _localAcceptor.reset(new boost::asio::local::stream_protocol::acceptor(
+        _io_context, boost::asio::local::stream_protocol::endpoint(_localPath)
+      ));
+      acceptNextLocal();
+    }
+    catch (const std::exception &e) {
+      std::cerr << "not listening on " << _localPath << ": " << e.what() << std::endl;
+      _localAcceptor.reset();
+    }
+  }
+#endif
+
+  // Network threads only move bytes, so a couple keep up with many
+  // connections; the parsing happens on _workers.
+  for (unsigned i = 0; i < _ioThreads; i++) {
+    _threads.emplace_back([this]() { _io_context.run(); });
+  }
+}
+
+void SocketServer::stop()
+{
+  _io_context.stop();
+  for (auto &t : _threads) {
+    t.join();
+  }
+  _threads.clear();
+
+  _queue.clear();
+  _workers.stop();
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  if (_localAcceptor)
+  {
+    _localAcceptor.reset();
+    std::remove(_localPath.c_str());
+  }
+#endif
 }
 
 void SocketServer::acceptNext()
 {
-  //tcp::socket *socket = new tcp::socket(_io_context);
   _acceptor.async_accept(
     [this](boost::system::error_code err, tcp::socket s) {
       if (!err) {
-        this->_client->onConnect(tcp::iostream(std::move(s)));
-        this->acceptNext();
+        std::make_shared<StreamConnection<tcp::socket>>(std::move(s), _io_context, *_client, _workers, _queue)->start();
       }
+      this->acceptNext();
     }
   );
-  _serverThread = new std::thread(&boost::asio::io_context::run, &_io_context);
-}
\ No newline at end of file
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+void SocketServer::acceptNextLocal()
+{
+  _localAcceptor->async_accept(
+    [this](boost::system::error_code err, boost::asio::local::stream_protocol::socket s) {
+      if (!err) {
+#ifdef __linux__
+        std::make_shared<LocalConnection>(std::move(s), _io_context, *_client, _workers, _queue)->start();
+#else
+        std::make_shared<StreamConnection<boost::asio::local::stream_protocol::socket>>(
+          std::move(s), _io_context, *_client, _workers, _queue
+        )->start();
+#endif
+      }
+      this->acceptNextLocal();
+    }
+  );
+}
+
+#endif
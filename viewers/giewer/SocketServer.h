@@ -1,36 +1,96 @@
 #ifndef __SOCKET_SERVER_H
 #define __SOCKET_SERVER_H
 
+#include <memory>
 #include <thread>
+#include <functional>
+#include <vector>
+#include <string>
 #include <iostream>
 
 #include <boost/asio.hpp>
 using boost::asio::ip::tcp;
 
+#include "Protocol.h"
+#include "WorkerPool.h"
+#include "IngestQueue.h"
+
+// Receives a raw (unframed) upload piece by piece as it is read, finish()
+// follows the last piece once the sender has closed the connection.
+class RawUpload
+{
+public:
+  virtual ~RawUpload() {}
+  virtual void feed(const char *data, size_t size) = 0;
+  virtual void finish() = 0;
+
+  // Bytes fed so far that are kept until finish(). They stay counted
+  // against the ingest budget, so they hold up reads like queued messages.
+  virtual size_t buffered() const { return 0; }
+};
+
+// Sends a header-only message back on the connection a message came in on.
+// Can be called from any thread, also after onMessage has returned; once
+// the connection is gone the message is dropped.
+typedef std::function<void(const MessageHeader &)> Reply;
+
+// Callbacks run on the server's worker pool, concurrently for different
+// connections but one at a time and in order for any one connection.
 class SocketClient
 {
 public:
-  virtual void onConnect(std::iostream &) = 0;
-  virtual void onClose(std::iostream &) = 0;
+  // One framed message. The payload is only valid during the call, and is
+  // either the bytes that followed the header or a shared memory mapping.
+  // connection tells apart the connections open at the same time.
+  virtual void onMessage(uint64_t connection, const MessageHeader &header, const char *payload, size_t length, const Reply &reply) = 0;
+
+  // Nothing more will be read from connection, called after its last
+  // message. Not called for connections still open when the server stops.
+  virtual void onClose(uint64_t connection) {}
+
+  // A connection turned out to be a raw upload, the server owns and feeds
+  // the returned object
+  virtual RawUpload *onRawUpload() = 0;
 };
 
+// Listens on a TCP port and, where the platform has them, a Unix-domain
+// socket. Same-host producers can use the latter to pass a sealed memfd
+// with MESSAGE_FLAG_SHARED_MEMORY (Linux only), which the viewer maps
+// instead of reading the mesh through socket buffers.
 class SocketServer
 {
 public:
-  SocketServer(short port = 4242);
+  // An empty localPath skips the Unix-domain socket, 0 for either thread
+  // count picks a default
+  SocketServer(short port = 4242, const std::string &localPath = "", unsigned ioThreads = 0, unsigned workerThreads = 0);
   ~SocketServer();
 
+  // GIEWER_SOCKET, or giewer.sock in the temp directory
+  static std::string localPathFromEnvironment();
+
   void start(SocketClient &);
 
+  // Stops accepting and reading, and waits for running callbacks
+  void stop();
+
 protected:
   short _port;
+  std::string _localPath;
+  unsigned _ioThreads;
   SocketClient *_client;
-  std::thread *_serverThread = nullptr;
   boost::asio::io_context _io_context;
   tcp::acceptor _acceptor;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  std::unique_ptr<boost::asio::local::stream_protocol::acceptor> _localAcceptor;
+#endif
+  std::vector<std::thread> _threads;
+  IngestQueue _queue;
+  WorkerPool _workers;
 
   void acceptNext();
-  void handleConnect(const boost::system::error_code &, tcp::socket &);
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  void acceptNextLocal();
+#endif
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -9,6 +9,7 @@
 
 State::State() : _camera(800.0f, 600.0f)
 {
+  _sessions.push_back(std::make_shared<Session>());
 }
 
 State::~State()
@@ -31,9 +32,9 @@ Camera &State::camera()
   return _camera;
 }
 
-std::vector<Mesh *> &State::meshes()
+std::vector<std::shared_ptr<Session>> &State::sessions()
 {
-  return _meshes;
+  return _sessions;
 }
 
 void State::toggleAnimation()
@@ -44,8 +45,10 @@ void State::toggleAnimation()
 void State::tick(float dt)
 {
   if (_animating) {
-    for (auto m : _meshes) {
-      m->transform(glm::rotate(m->transform(), dt, glm::vec3(0,1,0)));
+    for (auto &session : _sessions) {
+      for (auto &m : session->meshes) {
+        m->transform(glm::rotate(m->transform(), dt, glm::vec3(0,1,0)));
+      }
     }
   }
 }
@@ -2,11 +2,22 @@
 #define __STATE_H
 
 #include <mutex>
+#include <memory>
 #include <vector>
 
 class Mesh;
 #include "Camera.h"
 
+// One namespace of the scene, see MESSAGE_SESSION. Guarded by the State
+// lock like the rest of the scene. Clearing or replacing a session's
+// contents is a swap of its meshes, and a hidden one isn't walked at all
+// when frames are recorded.
+struct Session
+{
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  bool visible = true;
+};
+
 class State
 {
 private:
@@ -14,14 +25,17 @@ private:
   
   Camera _camera;
   bool _animating = false;
-  std::vector <Mesh *> _meshes;
+
+  // Drawn in order, the default session first
+  std::vector<std::shared_ptr<Session>> _sessions;
 
 public:
   State();
   ~State();
 
   Camera &camera();
-  std::vector<Mesh *> &meshes();
+  std::vector<std::shared_ptr<Session>> &sessions();
+  const std::shared_ptr<Session> &defaultSession() const { return _sessions.front(); }
 
   bool lock();
   void unlock();
@@ -30,4 +44,4 @@ public:
   void tick(float dt);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,102 @@
+#ifndef __STL_ASCII_H
+#define __STL_ASCII_H
+
+#include <cstring>
+#include <cstddef>
+#include <charconv>
+
+// Allocation-free scanning of ASCII STL. Everything works on [p, end) of a
+// contiguous buffer, numbers go through std::from_chars so the current
+// locale never matters.
+namespace stl_ascii
+{
+  enum Result { FACET, END, BAD };
+
+  inline bool is_space(char c)
+  {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+  }
+
+  inline const char *skip_space(const char *p, const char *end)
+  {
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    return p;
+  }
+
+  inline const char *skip_line(const char *p, const char *end)
+  {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+  }
+
+  // Consumes the whole-word keyword kw (length n) if it is the next token
+  inline bool keyword(const char *&p, const char *end, const char *kw, size_t n)
+  {
+    const char *q = skip_space(p, end);
+    if ((size_t)(end - q) < n || memcmp(q, kw, n) != 0) {
+      return false;
+    }
+    if (q + n < end && !is_space(q[n])) {
+      return false;
+    }
+    p = q + n;
+    return true;
+  }
+
+  inline bool number(const char *&p, const char *end, float &f)
+  {
+    const char *q = skip_space(p, end);
+    if (q < end && *q == '+') {
+      q++;
+    }
+    auto r = std::from_chars(q, end, f);
+    if (r.ec != std::errc()) {
+      return false;
+    }
+    p = r.ptr;
+    return true;
+  }
+
+  // Reads one "facet ... endfacet" block into v[0..2], any vertex type
+  // with float x, y and z will do
+  template <typename V>
+  inline Result read_facet(const char *&p, const char *end, V *v)
+  {
+    if (skip_space(p, end) == end || keyword(p, end, "endsolid", 8)) {
+      return END;
+    }
+
+    if (!keyword(p, end, "facet", 5)) {
+      return BAD;
+    }
+    p = skip_line(p, end);
+
+    if (!keyword(p, end, "outer", 5)) {
+      return BAD;
+    }
+    p = skip_line(p, end);
+
+    for (int i = 0; i < 3; ++i)
+    {
+      if (!keyword(p, end, "vertex", 6) ||
+          !number(p, end, v[i].x) ||
+          !number(p, end, v[i].y) ||
+          !number(p, end, v[i].z))
+      {
+        return BAD;
+      }
+    }
+
+    if (!keyword(p, end, "endloop", 7) ||
+        !keyword(p, end, "endfacet", 8))
+    {
+      return BAD;
+    }
+
+    return FACET;
+  }
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __TRIANGLE_SINK_H
+#define __TRIANGLE_SINK_H
+
+#include <cstddef>
+#include <glm/vec3.hpp>
+
+// Destination for the triangles a Loader or StlParser produces, so that
+// parsed vertices can go straight to where they are needed (e.g. mapped
+// GPU memory) instead of through an intermediate array.
+class TriangleSink
+{
+public:
+  virtual ~TriangleSink() {}
+
+  // Called once, before any triangle, with the exact triangle count
+  virtual void reserve(size_t triangles) = 0;
+
+  // v points at the triangle's three vertices. May be called from several
+  // threads at once, always for different indices.
+  virtual void triangle(size_t index, const glm::vec3 *v) = 0;
+
+  // Called last, after every triangle has been delivered
+  virtual void finish() = 0;
+};
+
+#endif
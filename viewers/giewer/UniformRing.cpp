@@ -0,0 +1,49 @@
+#include "UniformRing.h"
+#include "Vulkan.h"
+#include "ResourceBuffer.h"
+
+#include <cstring>
+#include <stdexcept>
+
+UniformRing::UniformRing(uint32_t frames, VkDeviceSize frameSize)
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(Vulkan::ctx().physicalDevice(), &properties);
+  _alignment = properties.limits.minUniformBufferOffsetAlignment;
+
+  // Regions start aligned too
+  _frameSize = (frameSize + _alignment - 1) / _alignment * _alignment;
+
+  _buffer = new UniformBuffer(
+    _frameSize * frames, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+  );
+  _mapped = (char *)_buffer->mapped();
+}
+
+UniformRing::~UniformRing()
+{
+  delete _buffer;
+}
+
+UniformRing::operator VkBuffer()
+{
+  return *_buffer;
+}
+
+void UniformRing::begin(uint32_t frame)
+{
+  _head = frame * _frameSize;
+  _end = _head + _frameSize;
+}
+
+uint32_t UniformRing::push(const void *data, VkDeviceSize size)
+{
+  if (_head + size > _end) {
+    throw std::runtime_error("uniform ring region is full!");
+  }
+
+  VkDeviceSize offset = _head;
+  memcpy(_mapped + offset, data, size);
+  _head = (offset + size + _alignment - 1) / _alignment * _alignment;
+  return (uint32_t)offset;
+}
@@ -0,0 +1,38 @@
+#ifndef __UNIFORM_RING_H
+#define __UNIFORM_RING_H
+
+#include <vulkan/vulkan.h>
+
+class UniformBuffer;
+
+// Uniform data for the frames in flight, in one persistently mapped buffer
+// with a region per swap chain image. A frame's region is filled front to
+// back with a bump pointer while it is recorded, and each piece is bound
+// with a dynamic offset, so nothing is mapped or allocated per frame. A
+// region is only started again once its image's fence has been waited on.
+class UniformRing
+{
+public:
+  UniformRing(uint32_t frames, VkDeviceSize frameSize);
+  ~UniformRing();
+
+  operator VkBuffer();
+
+  // Starts over at the beginning of frame's region
+  void begin(uint32_t frame);
+
+  // Copies size bytes into the current region and returns where they went,
+  // as the dynamic offset to bind them with
+  uint32_t push(const void *data, VkDeviceSize size);
+
+private:
+  UniformBuffer *_buffer;
+  char *_mapped;
+  VkDeviceSize _frameSize;
+  VkDeviceSize _alignment;
+
+  VkDeviceSize _head = 0;
+  VkDeviceSize _end = 0;
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include "Uploader.h"
+#include "Vulkan.h"
+#include "ResourceBuffer.h"
+
+#include <cstring>
+#include <stdexcept>
+
+// Keeps each copy's source nicely aligned, and keeps a wrapped head from
+// ever catching up with the tail
+static const VkDeviceSize ALIGNMENT = 256;
+
+Uploader::Uploader(uint32_t queueFamily, VkQueue queue, std::mutex *queueLock, VkDeviceSize ringSize)
+: _queue(queue), _queueLock(queueLock), _commandPool(queueFamily), _ringSize(ringSize)
+{
+  _ring = new StagingBuffer(ringSize);
+  _mapped = (char *)_ring->mapped();
+}
+
+Uploader::~Uploader()
+{
+  VkDevice device = Vulkan::ctx().device();
+
+  while (!_inFlight.empty()) {
+    reclaim(true);
+  }
+  for (VkFence fence : _fences) {
+    vkDestroyFence(device, fence, nullptr);
+  }
+
+  for (VkSemaphore semaphore : _semaphores) {
+    vkDestroySemaphore(device, semaphore, nullptr);
+  }
+
+  delete _ring;
+}
+
+void Uploader::upload(VkBuffer buffer, VkDeviceSize offset, const void *data, VkDeviceSize size)
+{
+  upload(buffer, offset, size, [data, size](void *to) { memcpy(to, data, size); });
+}
+
+void Uploader::upload(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, const std::function<void(void *)> &fill)
+{
+  if (!size) {
+    return;
+  }
+
+  // Anything that would hog the ring gets staging memory of its own
+  if (size > _ringSize / 2)
+  {
+    StagingBuffer *staging = new StagingBuffer(size);
+    fill(staging->mapped());
+
+    std::lock_guard<std::mutex> guard(_lock);
+    submit(queue(0, staging), *staging, buffer, 0, offset, size);
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(_lock);
+  VkDeviceSize begin = allocate(lock, size);
+  Batch &batch = queue(begin, nullptr);
+  lock.unlock();
+
+  // Other uploads take ring space and submit while this one is filled
+  try
+  {
+    fill(_mapped + begin);
+  }
+  catch (...)
+  {
+    // Submitted without the copy, so its ring space still comes back
+    lock.lock();
+    submit(batch, VK_NULL_HANDLE, buffer, 0, offset, 0);
+    throw;
+  }
+
+  lock.lock();
+  submit(batch, *_ring, buffer, begin, offset, size);
+}
+
+void Uploader::upload(VkBuffer buffer, VkDeviceSize offset, StagingBuffer *from, VkDeviceSize size)
+{
+  if (!size)
+  {
+    delete from;
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(_lock);
+  submit(queue(0, from), *from, buffer, 0, offset, size);
+}
+
+// A semaphore signalled by a submission covers everything submitted to
+// the queue before it, so a submission of nothing stands in for all the
+// copies since the last one
+void Uploader::takeWaits(std::vector<VkSemaphore> &waits)
+{
+  std::lock_guard<std::mutex> guard(_waitLock);
+  if (!_unsignalled) {
+    return;
+  }
+
+  VkSemaphore semaphore = VK_NULL_HANDLE;
+  if (!_semaphores.empty())
+  {
+    semaphore = _semaphores.back();
+    _semaphores.pop_back();
+  }
+  else
+  {
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    if (vkCreateSemaphore(Vulkan::ctx().device(), &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create upload semaphore!");
+    }
+  }
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.pSignalSemaphores = &semaphore;
+
+  if (queueSubmit(submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+  {
+    _semaphores.push_back(semaphore);
+    throw std::runtime_error("failed to submit upload signal!");
+  }
+
+  _unsignalled = false;
+  waits.push_back(semaphore);
+}
+
+void Uploader::recycle(std::vector<VkSemaphore> &semaphores)
+{
+  std::lock_guard<std::mutex> guard(_waitLock);
+  _semaphores.insert(_semaphores.end(), semaphores.begin(), semaphores.end());
+  semaphores.clear();
+}
+
+// Called with lock held on _lock. The ring is used from _head on, and is
+// free up to where the oldest copy still reading from it begins; if neither
+// the space up to the end nor the space before that copy will do, the
+// oldest copies are waited for, once they have been submitted.
+VkDeviceSize Uploader::allocate(std::unique_lock<std::mutex> &lock, VkDeviceSize size)
+{
+  size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+  for (;;)
+  {
+    reclaim(false);
+
+    const Batch *oldest = nullptr;
+    for (auto &batch : _inFlight)
+    {
+      if (!batch.owned)
+      {
+        oldest = &batch;
+        break;
+      }
+    }
+
+    if (!oldest)
+    {
+      _head = size;
+      return 0;
+    }
+
+    VkDeviceSize tail = oldest->begin;
+    if (_head > tail)
+    {
+      if (_head + size <= _ringSize)
+      {
+        VkDeviceSize begin = _head;
+        _head += size;
+        return begin;
+      }
+      if (size < tail)
+      {
+        _head = size;
+        return 0;
+      }
+    }
+    else if (_head + size < tail)
+    {
+      VkDeviceSize begin = _head;
+      _head += size;
+      return begin;
+    }
+
+    _submitted.wait(lock, [this] { return _inFlight.empty() || _inFlight.front().submitted; });
+    reclaim(true);
+  }
+}
+
+// Called with _lock held. Copies complete in the order they were
+// submitted, so only the front of _inFlight needs checking; with wait the
+// oldest is waited for rather than skipped.
+void Uploader::reclaim(bool wait)
+{
+  VkDevice device = Vulkan::ctx().device();
+
+  while (!_inFlight.empty())
+  {
+    Batch &batch = _inFlight.front();
+    if (wait)
+    {
+      vkWaitForFences(device, 1, &batch.fence, true, UINT64_MAX);
+      wait = false;
+    }
+    else if (vkGetFenceStatus(device, batch.fence) != VK_SUCCESS)
+    {
+      return;
+    }
+
+    vkResetFences(device, 1, &batch.fence);
+    _fences.push_back(batch.fence);
+    _commandBuffers.push_back(batch.commands);
+    delete batch.owned;
+    _inFlight.pop_front();
+  }
+}
+
+// Called with _lock held. Takes the fence and command buffer of a copy
+// from begin in the ring, or out of owned, before it is submitted.
+Uploader::Batch &Uploader::queue(VkDeviceSize begin, StagingBuffer *owned)
+{
+  VkFence fence;
+  if (_fences.empty())
+  {
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    if (vkCreateFence(Vulkan::ctx().device(), &fenceInfo, nullptr, &fence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create upload fence!");
+    }
+  }
+  else
+  {
+    fence = _fences.back();
+    _fences.pop_back();
+  }
+
+  if (_commandBuffers.empty()) {
+    _commandBuffers = _commandPool.createCommandBuffers(1);
+  }
+  CommandBuffer commands = _commandBuffers.back();
+  _commandBuffers.pop_back();
+
+  _inFlight.push_back({ fence, commands, begin, owned, false });
+  return _inFlight.back();
+}
+
+// Called with _lock held. Without a size nothing is copied, but the fence
+// still signals in turn.
+void Uploader::submit(Batch &batch, VkBuffer from, VkBuffer to, VkDeviceSize fromOffset, VkDeviceSize toOffset, VkDeviceSize size)
+{
+  if (size)
+  {
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    if (vkBeginCommandBuffer(batch.commands, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error("failed to begin recording upload!");
+    }
+    VkBufferCopy region = { fromOffset, toOffset, size };
+    vkCmdCopyBuffer(batch.commands, from, to, 1, &region);
+    if (vkEndCommandBuffer(batch.commands) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record upload!");
+    }
+  }
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = size ? 1 : 0;
+  submitInfo.pCommandBuffers = (VkCommandBuffer *)&batch.commands;
+
+  VkResult result;
+  {
+    std::lock_guard<std::mutex> guard(_waitLock);
+    result = queueSubmit(submitInfo, batch.fence);
+    _unsignalled = true;
+  }
+
+  batch.submitted = true;
+  _submitted.notify_all();
+
+  if (result != VK_SUCCESS) {
+    throw std::runtime_error("failed to submit upload!");
+  }
+}
+
+// Called with _waitLock held
+VkResult Uploader::queueSubmit(const VkSubmitInfo &submitInfo, VkFence fence)
+{
+  if (_queueLock)
+  {
+    std::lock_guard<std::mutex> queueGuard(*_queueLock);
+    return vkQueueSubmit(_queue, 1, &submitInfo, fence);
+  }
+  return vkQueueSubmit(_queue, 1, &submitInfo, fence);
+}
@@ -0,0 +1,91 @@
+#ifndef __UPLOADER_H
+#define __UPLOADER_H
+
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <vector>
+#include <functional>
+#include <vulkan/vulkan.h>
+
+#include "CommandPool.h"
+#include "CommandBuffer.h"
+
+class StagingBuffer;
+
+// Copies host data into DEVICE_LOCAL buffers on the transfer queue. Data is
+// written into a persistently mapped staging ring, the copy submitted and
+// the call returns without waiting for it. Each submission signals a fence
+// that gives its part of the ring back once the copy is done. The next
+// frame waits on one semaphore signalled after all the copies submitted
+// before it, so uploads overlap rendering.
+class Uploader
+{
+public:
+  // queueLock is taken around submits when the queue is shared with
+  // frames, null when the transfer queue is a queue of its own
+  Uploader(uint32_t queueFamily, VkQueue queue, std::mutex *queueLock, VkDeviceSize ringSize);
+  ~Uploader();
+
+  // Copies size bytes of data to buffer at offset
+  void upload(VkBuffer buffer, VkDeviceSize offset, const void *data, VkDeviceSize size);
+
+  // As above, with fill writing the size bytes straight into staging
+  // memory, which is write-combined and mustn't be read back
+  void upload(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, const std::function<void(void *)> &fill);
+
+  // Copies the first size bytes of a host-visible buffer already filled
+  // by the caller to buffer at offset; from is deleted once the copy is done
+  void upload(VkBuffer buffer, VkDeviceSize offset, StagingBuffer *from, VkDeviceSize size);
+
+  // Adds a semaphore signalled once the copies submitted since the last
+  // call are done, if there were any, for a submission that reads what
+  // they wrote to wait on
+  void takeWaits(std::vector<VkSemaphore> &waits);
+
+  // Semaphores taken with takeWaits() whose waits have completed
+  void recycle(std::vector<VkSemaphore> &semaphores);
+
+private:
+  // A copy and what it holds on to until its fence signals. Ring space is
+  // taken in order, so a copy is queued while its staging memory is still
+  // being filled and submitted after.
+  struct Batch
+  {
+    VkFence fence;
+    CommandBuffer commands;
+    VkDeviceSize begin;
+    StagingBuffer *owned;
+    bool submitted;
+  };
+
+  VkQueue _queue;
+  std::mutex *_queueLock;
+  CommandPool _commandPool;
+
+  StagingBuffer *_ring;
+  VkDeviceSize _ringSize;
+  char *_mapped = nullptr;
+
+  // Guards the ring and everything submitted from it
+  std::mutex _lock;
+  VkDeviceSize _head = 0;
+  std::deque<Batch> _inFlight;
+  std::condition_variable _submitted;
+  std::vector<VkFence> _fences;
+  std::vector<CommandBuffer> _commandBuffers;
+
+  // Guards the queue and the semaphores. Taken by the render thread, so
+  // kept apart from _lock which is held while waiting for ring space.
+  std::mutex _waitLock;
+  bool _unsignalled = false;
+  std::vector<VkSemaphore> _semaphores;
+
+  VkDeviceSize allocate(std::unique_lock<std::mutex> &lock, VkDeviceSize size);
+  void reclaim(bool wait);
+  Batch &queue(VkDeviceSize begin, StagingBuffer *owned);
+  void submit(Batch &batch, VkBuffer from, VkBuffer to, VkDeviceSize fromOffset, VkDeviceSize toOffset, VkDeviceSize size);
+  VkResult queueSubmit(const VkSubmitInfo &submitInfo, VkFence fence);
+};
+
+#endif
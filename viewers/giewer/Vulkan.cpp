@@ -14,6 +14,10 @@
 #include "Camera.h"
 #include "Device.h"
 #include "SwapChain.h"
+#include "Uploader.h"
+#include "UniformRing.h"
+#include "GeometryPool.h"
+#include "MemoryAllocator.h"
 #include "CommandPool.h"
 #include "CommandBuffer.h"
 #include "ResourceBuffer.h"
@@ -27,6 +31,28 @@
 
 Vulkan *Vulkan::_currentContext = nullptr;
 
+// Uploads that fit in half of it are staged here, larger ones get staging
+// memory of their own
+static const VkDeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024;
+
+// Buffers of up to a quarter of this share blocks, larger ones get memory
+// of their own
+static const VkDeviceSize MEMORY_BLOCK_SIZE = 64 * 1024 * 1024;
+
+// Uniform bytes a frame can write
+static const VkDeviceSize UNIFORM_FRAME_SIZE = 64 * 1024;
+
+// Shared geometry buffers, a mesh larger than one gets one of its own
+static const VkDeviceSize VERTEX_ARENA_SIZE = 128 * 1024 * 1024;
+static const VkDeviceSize INDEX_ARENA_SIZE = 64 * 1024 * 1024;
+
+// Meshes a frame has room to draw before its draw buffer grows
+static const uint32_t INITIAL_DRAW_CAPACITY = 1024;
+
+// Each draw has its model matrix, and at most one command for each pipeline
+static const VkDeviceSize DRAW_BYTES =
+  sizeof(glm::mat4) + sizeof(VkDrawIndexedIndirectCommand) + sizeof(VkDrawIndirectCommand);
+
 Vulkan::Vulkan(
   const std::vector<const char *> &extensions, 
   const std::vector<const char *> &validationLayers
@@ -43,6 +69,35 @@ Vulkan::~Vulkan()
     _threadPool[i].join();
   }
 
+  // Meshes retire their buffers as they go, which needs the swap chain
+  for (auto &session : _state.sessions()) {
+    session->meshes.clear();
+  }
+  _pendingMeshes.clear();
+
+  vkDeviceWaitIdle(*_device);
+  for (auto &retired : _retired) {
+    delete retired.buffer;
+    delete retired.range;
+  }
+  _retired.clear();
+
+  if (_uploader)
+  {
+    for (auto &waits : _uploadWaits) {
+      _uploader->recycle(waits);
+    }
+    delete _uploader;
+  }
+
+  // Everything holding on to buffer memory has to be gone by now
+  delete _uniforms;
+  for (auto &frame : _frameDraws) {
+    delete frame.buffer;
+  }
+  delete _geometry;
+  delete _memory;
+
   while (_semaphores.size()) {
     auto &s = _semaphores.front();
     vkDestroySemaphore(*_device, s.first, nullptr);
@@ -57,6 +112,11 @@ Vulkan::~Vulkan()
   if (_swapChain) {
     delete _swapChain;
   }
+
+  if (_transferCommands) {
+    delete _transferCommands;
+    vkDestroyFence(*_device, _transferFence, nullptr);
+  }
   
   vkDestroySurfaceKHR(_instance, _surface, nullptr);
   vkDestroyInstance(_instance, nullptr);
@@ -73,6 +133,9 @@ void Vulkan::setSurface(const VkSurfaceKHR &surface)
 {
   _surface = surface;
   _device = new Device();
+  _memory = new MemoryAllocator(MEMORY_BLOCK_SIZE);
+  _geometry = new GeometryPool(sizeof(LitVertex), VERTEX_ARENA_SIZE, INDEX_ARENA_SIZE);
+  createTransfer();
 
   createSwapChain();
   createGraphicsPipeline();
@@ -92,7 +155,7 @@ void Vulkan::createGraphicsPipeline()
   std::vector<VkDescriptorSetLayoutBinding> layoutBinding(1);
   for (int i = 0; i < layoutBinding.size(); i++) {
     layoutBinding[i].binding = i;
-    layoutBinding[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    layoutBinding[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     layoutBinding[i].descriptorCount = 1;
     layoutBinding[i].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     layoutBinding[i].pImmutableSamplers = nullptr;
@@ -108,46 +171,64 @@ void Vulkan::createGraphicsPipeline()
     throw std::runtime_error("failed to create descriptor set layout!");
   }
 
-  std::vector<VkDescriptorSetLayout> layouts(_swapChain->size(), _descriptorSetLayouts[0]);
-  _descriptorPool = new DescriptorPool(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, (uint32_t)layouts.size());
-  _descriptorSets = _descriptorPool->createDescriptorSets(layouts);
-
-  _cameraUniforms.reserve(_swapChain->size());
-  for (int i = 0; i < _descriptorSets.size(); i++) {
-
-    VkDescriptorBufferInfo bufferInfo{};
-  
-    _cameraUniforms.emplace_back(
-      sizeof(ViewTransform), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-    );
-
-    bufferInfo.buffer = _cameraUniforms[i];
-    bufferInfo.offset = 0;
-    bufferInfo.range = sizeof(glm::mat4);
+  // One set serves every frame, each binds it at the offset its uniforms
+  // were written to
+  _descriptorPool = new DescriptorPool(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1);
+  _descriptorSets = _descriptorPool->createDescriptorSets(_descriptorSetLayouts);
+
+  _uniforms = new UniformRing((uint32_t)_swapChain->size(), UNIFORM_FRAME_SIZE);
+
+  VkDescriptorBufferInfo bufferInfo{};
+  bufferInfo.buffer = *_uniforms;
+  bufferInfo.offset = 0;
+  bufferInfo.range = sizeof(ViewTransform);
+
+  VkWriteDescriptorSet descriptorWrite{};
+  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrite.dstSet = _descriptorSets[0];
+  descriptorWrite.dstBinding = 0;
+  descriptorWrite.dstArrayElement = 0;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  descriptorWrite.descriptorCount = 1;
+  descriptorWrite.pBufferInfo = &bufferInfo;
+  descriptorWrite.pImageInfo = nullptr; // Optional
+  descriptorWrite.pTexelBufferView = nullptr; // Optional
+
+  vkUpdateDescriptorSets(*_device, 1, &descriptorWrite, 0, nullptr);
+
+  // The second set is the per-draw data, one per image as each has a
+  // buffer of its own
+  VkDescriptorSetLayoutBinding drawBinding{};
+  drawBinding.binding = 0;
+  drawBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  drawBinding.descriptorCount = 1;
+  drawBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  drawBinding.pImmutableSamplers = nullptr;
+
+  layoutInfo.bindingCount = 1;
+  layoutInfo.pBindings = &drawBinding;
+
+  _descriptorSetLayouts.resize(2);
+  if (vkCreateDescriptorSetLayout(*_device, &layoutInfo, nullptr, &_descriptorSetLayouts[1]) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create descriptor set layout!");
+  }
 
-    VkWriteDescriptorSet descriptorWrite{};
-    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    descriptorWrite.dstSet = _descriptorSets[i];
-    descriptorWrite.dstBinding = 0;
-    descriptorWrite.dstArrayElement = 0;
-    descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptorWrite.descriptorCount = 1;
-    descriptorWrite.pBufferInfo = &bufferInfo;
-    descriptorWrite.pImageInfo = nullptr; // Optional
-    descriptorWrite.pTexelBufferView = nullptr; // Optional
+  std::vector<VkDescriptorSetLayout> drawLayouts(_swapChain->size(), _descriptorSetLayouts[1]);
+  _drawDescriptorPool = new DescriptorPool(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, (uint32_t)drawLayouts.size());
+  _drawDescriptorSets = _drawDescriptorPool->createDescriptorSets(drawLayouts);
 
-    vkUpdateDescriptorSets(*_device, 1, &descriptorWrite, 0, nullptr);
+  _frameDraws.resize(_swapChain->size());
+  for (uint32_t i = 0; i < _swapChain->size(); i++) {
+    growDraws(i, INITIAL_DRAW_CAPACITY);
   }
 
   _graphicsPipeline = new GraphicsPipeline(*_swapChain, _descriptorSetLayouts);
-  _graphicsPipeline->addPushConstantRange();
   _graphicsPipeline->addShaderStage("shaders/shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
   _graphicsPipeline->addShaderStage("shaders/shader.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT);
   _graphicsPipeline->createLayout();
   _graphicsPipeline->createPipeline(_swapChain->renderPass());
 
   _debugPipeline = new GraphicsPipeline(*_swapChain, _descriptorSetLayouts);
-  _debugPipeline->addPushConstantRange();
   _debugPipeline->setPrimitiveTopology(VK_PRIMITIVE_TOPOLOGY_POINT_LIST);
   _debugPipeline->addShaderStage("shaders/shader.debug.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
   _debugPipeline->addShaderStage("shaders/shader.debug.geom.spv", VK_SHADER_STAGE_GEOMETRY_BIT);
@@ -224,6 +305,8 @@ VkInstance Vulkan::createInstance(
 
 void Vulkan::createFences()
 {
+  _uploadWaits.resize(_swapChain->size());
+  _imageSerials.resize(_swapChain->size(), 0);
   _fences.resize(_swapChain->size());
   for (int i = 0; i < _fences.size(); i++) {
       VkFenceCreateInfo fenceInfo{};
@@ -236,6 +319,27 @@ void Vulkan::createFences()
   }
 }
 
+void Vulkan::createTransfer()
+{
+  _transferCommands = new CommandBufferPool(_device->graphicsFamily());
+
+  if (_device->transferFamily() != _device->graphicsFamily()) {
+    _copyQueueFamilies = { _device->graphicsFamily(), _device->transferFamily() };
+  }
+
+  // Without a transfer family of its own the copies go to the graphics
+  // queue, which frames are submitted to from another thread
+  bool shared = _device->transferQueue() == _device->graphicsQueue();
+  _uploader = new Uploader(_device->transferFamily(), _device->transferQueue(), shared ? &_queueLock : nullptr, STAGING_RING_SIZE);
+
+  VkFenceCreateInfo fenceInfo{};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  if (vkCreateFence(*_device, &fenceInfo, nullptr, &_transferFence) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create transfer fence!");
+  }
+}
+
 void Vulkan::createSemaphores()
 {
   VkSemaphoreCreateInfo semaphoreInfo{};
@@ -274,16 +378,41 @@ void Vulkan::draw()
 
   vkWaitForFences(*_device, 1, &_fences[imageIndex], true, UINT64_MAX);
   _commandBufferPools[imageIndex].reset();
+  _uploader->recycle(_uploadWaits[imageIndex]);
+
+  // A queue's fences signal in submission order, so every frame up to the
+  // one last submitted with this image is done too
+  {
+    std::lock_guard<std::mutex> guard(_retiredLock);
+    _completedSerial = std::max(_completedSerial, _imageSerials[imageIndex]);
+  }
+  releaseRetired();
 
   recordCommandBuffer(imageIndex);
 
+  // Whatever was uploaded for meshes this frame may draw has been
+  // submitted by now; vertex input waits for the copies to land
+  std::vector<VkSemaphore> waits = { imageAvailable };
+  std::vector<VkPipelineStageFlags> waitStages = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+
+  // Numbered before the waits are taken, so anything retired from now on
+  // waits for a frame that takes the uploads still pending then
+  {
+    std::lock_guard<std::mutex> guard(_retiredLock);
+    _imageSerials[imageIndex] = ++_frameSerial;
+  }
+  _uploader->takeWaits(_uploadWaits[imageIndex]);
+  for (VkSemaphore upload : _uploadWaits[imageIndex]) {
+    waits.push_back(upload);
+    waitStages.push_back(VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+  }
+
   VkSubmitInfo submitInfo{};
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-  VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = &imageAvailable;
-  submitInfo.pWaitDstStageMask = waitStages;
+  submitInfo.waitSemaphoreCount = (uint32_t)waits.size();
+  submitInfo.pWaitSemaphores = waits.data();
+  submitInfo.pWaitDstStageMask = waitStages.data();
 
   submitInfo.commandBufferCount = (uint32_t)_commandBufferPools[imageIndex].inUse().size();
   submitInfo.pCommandBuffers = (VkCommandBuffer *)_commandBufferPools[imageIndex].inUse().data();
@@ -291,6 +420,8 @@ void Vulkan::draw()
   submitInfo.signalSemaphoreCount = 1;
   submitInfo.pSignalSemaphores = &bufferComplete;
 
+  std::lock_guard<std::mutex> guard(_queueLock);
+
   vkResetFences(*_device, 1, &_fences[imageIndex]);
   if (vkQueueSubmit(_device->graphicsQueue(), 1, &submitInfo, _fences[imageIndex]) != VK_SUCCESS) {
     throw std::runtime_error("failed to submit draw command buffer!");
@@ -310,6 +441,11 @@ void Vulkan::draw()
 
   vkQueuePresentKHR(_device->presentationQueue(), &presentInfo);
 
+  for (auto &onVisible : _presenting) {
+    onVisible();
+  }
+  _presenting.clear();
+
   metrics()["frames"]++;
   if (metrics()["frames"] % 10000 == 0) {
     dumpMetrics();
@@ -332,6 +468,22 @@ void Vulkan::recordCommandBuffer(uint32_t imageIndex)
 
   buffer.beginRecording();
   buffer.beginRenderPass(imageIndex, *_swapChain);
+
+  // Uniforms go into this image's region of the ring, which the frame
+  // that last used it is done with since draw() waited on its fence
+  _uniforms->begin(imageIndex);
+
+  // What the frame draws is gathered under the state lock, and recorded
+  // once it has been let go
+  bool debugDraw = _debugDraw;
+
+  _state.lock();
+  adoptPendingMeshes();
+  uint32_t viewOffset = _uniforms->push(&_state.camera().transform(), sizeof(ViewTransform));
+  collectDraws(imageIndex, debugDraw);
+  _state.unlock();
+
+  VkDescriptorSet descriptorSets[] = { _descriptorSets[0], _drawDescriptorSets[imageIndex] };
  
   if (_graphicsPipeline) {
 
@@ -341,38 +493,14 @@ void Vulkan::recordCommandBuffer(uint32_t imageIndex)
       buffer, 
       VK_PIPELINE_BIND_POINT_GRAPHICS, 
       _graphicsPipeline->pipelineLayout(), 
-      0, 1, (VkDescriptorSet *)&_descriptorSets[imageIndex], 
-      0, nullptr
+      0, 2, descriptorSets, 
+      1, &viewOffset
     );
 
-    _state.lock();
- 
-    void* data;
-    vkMapMemory(*_device, _cameraUniforms[imageIndex], 0, sizeof(ViewTransform), 0, &data);
-    memcpy(data, &_state.camera().transform(), sizeof(ViewTransform));
-    vkUnmapMemory(*_device, _cameraUniforms[imageIndex]);
- 
-    for (auto mesh : _state.meshes()) {
-
-      vkCmdPushConstants(
-        buffer,
-        _graphicsPipeline->pipelineLayout(),
-        VK_SHADER_STAGE_VERTEX_BIT,
-        0,
-        sizeof(mesh->transform()),
-        &mesh->transform()
-      );
-
-      VkDeviceSize offsets[] = {0};
-      VkBuffer vkBuffer = mesh->vkBuffer();
-      vkCmdBindVertexBuffers(buffer, 0, 1, &vkBuffer, offsets);
-      vkCmdDraw(buffer, mesh->count(), 1, 0, 0);
-    }
-
-    _state.unlock();
+    recordDraws(buffer, imageIndex, false);
   }
 
-  if (_debugPipeline && _debugDraw) {
+  if (_debugPipeline && debugDraw) {
 
     vkCmdBindPipeline(buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, *_debugPipeline);
 
@@ -380,39 +508,197 @@ void Vulkan::recordCommandBuffer(uint32_t imageIndex)
       buffer, 
       VK_PIPELINE_BIND_POINT_GRAPHICS, 
       _debugPipeline->pipelineLayout(), 
-      0, 1, (VkDescriptorSet *)&_descriptorSets[imageIndex], 
-      0, nullptr
+      0, 2, descriptorSets, 
+      1, &viewOffset
     );
 
-    _state.lock();
+    recordDraws(buffer, imageIndex, true);
+  }
 
-    void* data;
-    vkMapMemory(*_device, _cameraUniforms[imageIndex], 0, sizeof(ViewTransform), 0, &data);
-    memcpy(data, &_state.camera().transform(), sizeof(ViewTransform));
-    vkUnmapMemory(*_device, _cameraUniforms[imageIndex]);
- 
-    for (auto mesh : _state.meshes()) {
-
-      vkCmdPushConstants(
-        buffer,
-        _graphicsPipeline->pipelineLayout(),
-        VK_SHADER_STAGE_VERTEX_BIT,
-        0,
-        sizeof(mesh->transform()),
-        &mesh->transform()
-      );
-
-      VkDeviceSize offsets[] = {0};
-      VkBuffer vkBuffer = mesh->vkBuffer();
-      vkCmdBindVertexBuffers(buffer, 0, 1, &vkBuffer, offsets);
-      vkCmdDraw(buffer, mesh->count(), 1, 0, 0);
+  buffer.endRenderPass();
+  buffer.endRecording(); 
+}
+
+// Called with the state lock held. Each visible mesh gets the next slot
+// of per-draw data, and a command in the batch for its buffers and index
+// type that points at that slot with its first instance.
+void Vulkan::collectDraws(uint32_t imageIndex, bool debug)
+{
+  for (auto &batch : _drawBatches)
+  {
+    batch.second.indexedCommands.clear();
+    batch.second.commands.clear();
+  }
+
+  size_t meshes = 0;
+  for (auto &session : _state.sessions()) {
+    meshes += session->meshes.size();
+  }
+  if (meshes > _frameDraws[imageIndex].capacity) {
+    growDraws(imageIndex, meshes);
+  }
+
+  FrameDraws &frame = _frameDraws[imageIndex];
+  glm::mat4 *models = (glm::mat4 *)frame.buffer->mapped();
+
+  // Batches are keyed by kind, then the vertex and index arenas
+  auto batchFor = [this](uint64_t kind, const GeometryRange &vertices, const GeometryRange *indices) -> DrawBatch & {
+    uint64_t key = kind << 48 | (uint64_t)vertices.arena() << 24 | (indices ? indices->arena() : 0);
+    DrawBatch &batch = _drawBatches[key];
+    batch.vertexBuffer = vertices;
+    batch.indexBuffer = indices ? (VkBuffer)*indices : VK_NULL_HANDLE;
+    batch.indexType = kind == 0 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    batch.indexed = kind < 2;
+    batch.debug = kind == 3;
+    return batch;
+  };
+
+  uint32_t draw = 0;
+  for (auto &session : _state.sessions()) {
+
+    if (!session->visible) {
+      continue;
     }
 
-    _state.unlock();
+    for (auto &mesh : session->meshes) {
+
+      if (!mesh->visible()) {
+        continue;
+      }
+
+      models[draw] = mesh->transform();
+
+      const GeometryRange &vertices = mesh->vertexRange();
+      uint32_t firstVertex = (uint32_t)(vertices.offset() / sizeof(LitVertex));
+
+      if (mesh->indexCount())
+      {
+        const GeometryRange &indices = mesh->indexRange();
+        bool shorts = mesh->indexType() == VK_INDEX_TYPE_UINT16;
+        uint32_t firstIndex = (uint32_t)(indices.offset() / (shorts ? sizeof(uint16_t) : sizeof(uint32_t)));
+        batchFor(shorts ? 0 : 1, vertices, &indices).indexedCommands.push_back(
+          { mesh->indexCount(), 1, firstIndex, (int32_t)firstVertex, draw }
+        );
+      }
+      else
+      {
+        batchFor(2, vertices, nullptr).commands.push_back({ mesh->count(), 1, firstVertex, draw });
+      }
+
+      // Normals are drawn from every vertex, indexed or not
+      if (debug) {
+        batchFor(3, vertices, nullptr).commands.push_back({ mesh->count(), 1, firstVertex, draw });
+      }
+
+      draw++;
+    }
   }
 
-  buffer.endRenderPass();
-  buffer.endRecording(); 
+  // The commands follow the per-draw data
+  char *mapped = (char *)frame.buffer->mapped();
+  VkDeviceSize offset = frame.capacity * sizeof(glm::mat4);
+  for (auto &entry : _drawBatches)
+  {
+    DrawBatch &batch = entry.second;
+    batch.offset = offset;
+    if (batch.indexed)
+    {
+      size_t bytes = batch.indexedCommands.size() * sizeof(VkDrawIndexedIndirectCommand);
+      memcpy(mapped + offset, batch.indexedCommands.data(), bytes);
+      offset += bytes;
+    }
+    else
+    {
+      size_t bytes = batch.commands.size() * sizeof(VkDrawIndirectCommand);
+      memcpy(mapped + offset, batch.commands.data(), bytes);
+      offset += bytes;
+    }
+  }
+}
+
+// Binds each batch's buffers and draws it with as few indirect draws as the
+// device allows, or one direct draw per mesh on a device that can't
+// multi-draw; either way the first instance picks the per-draw data.
+void Vulkan::recordDraws(VkCommandBuffer buffer, uint32_t imageIndex, bool debug)
+{
+  VkBuffer draws = *_frameDraws[imageIndex].buffer;
+  uint32_t limit = _device->maxDrawIndirectCount();
+
+  for (auto &entry : _drawBatches) {
+
+    DrawBatch &batch = entry.second;
+    uint32_t count = (uint32_t)(batch.indexed ? batch.indexedCommands.size() : batch.commands.size());
+    if (batch.debug != debug || !count) {
+      continue;
+    }
+
+    VkDeviceSize offsets[] = {0};
+    vkCmdBindVertexBuffers(buffer, 0, 1, &batch.vertexBuffer, offsets);
+
+    if (batch.indexed)
+    {
+      vkCmdBindIndexBuffer(buffer, batch.indexBuffer, 0, batch.indexType);
+
+      if (limit)
+      {
+        const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+        for (uint32_t first = 0; first < count; first += limit) {
+          vkCmdDrawIndexedIndirect(buffer, draws, batch.offset + first * stride, std::min(limit, count - first), stride);
+        }
+      }
+      else
+      {
+        for (auto &c : batch.indexedCommands) {
+          vkCmdDrawIndexed(buffer, c.indexCount, 1, c.firstIndex, c.vertexOffset, c.firstInstance);
+        }
+      }
+    }
+    else
+    {
+      if (limit)
+      {
+        const uint32_t stride = sizeof(VkDrawIndirectCommand);
+        for (uint32_t first = 0; first < count; first += limit) {
+          vkCmdDrawIndirect(buffer, draws, batch.offset + first * stride, std::min(limit, count - first), stride);
+        }
+      }
+      else
+      {
+        for (auto &c : batch.commands) {
+          vkCmdDraw(buffer, c.vertexCount, 1, c.firstVertex, c.firstInstance);
+        }
+      }
+    }
+  }
+}
+
+// Only frames of this image use its draw buffer and descriptor set, and
+// the last of them is done, so both can be replaced outright
+void Vulkan::growDraws(uint32_t imageIndex, size_t draws)
+{
+  FrameDraws &frame = _frameDraws[imageIndex];
+  uint32_t capacity = (uint32_t)std::max<size_t>(draws, (size_t)frame.capacity * 2);
+
+  delete frame.buffer;
+  frame.buffer = nullptr;
+  frame.buffer = new DrawBuffer(capacity * DRAW_BYTES);
+  frame.capacity = capacity;
+
+  VkDescriptorBufferInfo bufferInfo{};
+  bufferInfo.buffer = *frame.buffer;
+  bufferInfo.offset = 0;
+  bufferInfo.range = capacity * sizeof(glm::mat4);
+
+  VkWriteDescriptorSet descriptorWrite{};
+  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrite.dstSet = _drawDescriptorSets[imageIndex];
+  descriptorWrite.dstBinding = 0;
+  descriptorWrite.dstArrayElement = 0;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  descriptorWrite.descriptorCount = 1;
+  descriptorWrite.pBufferInfo = &bufferInfo;
+
+  vkUpdateDescriptorSets(*_device, 1, &descriptorWrite, 0, nullptr);
 }
 
 State &Vulkan::state() 
@@ -420,8 +706,243 @@ State &Vulkan::state()
   return _state;
 }
 
-void Vulkan::addMesh(Mesh *m)
+std::shared_ptr<Mesh> Vulkan::addMesh(Mesh *m, std::function<void()> onVisible, std::shared_ptr<Session> session)
 {
+  // Before taking ownership, so if it throws the caller still deletes m
   m->createVertexBuffer();
-  _state.meshes().push_back(m);
-}
\ No newline at end of file
+
+  // Whoever lets go of the mesh last, its buffers still wait for the
+  // frames in flight
+  std::shared_ptr<Mesh> mesh(m, [](Mesh *m) {
+    m->retireBuffers();
+    delete m;
+  });
+
+  if (!session) {
+    session = _state.defaultSession();
+  }
+
+  // Uploads arrive on the socket server's worker threads, which only take
+  // this short lock rather than queueing behind a frame on _state
+  std::lock_guard<std::mutex> guard(_pendingLock);
+  _pendingMeshes.push_back({ std::move(session), mesh });
+  if (onVisible) {
+    _pendingVisible.push_back(std::move(onVisible));
+  }
+  return mesh;
+}
+
+void Vulkan::removeMesh(const std::shared_ptr<Session> &session, Mesh *m)
+{
+  // Dropped once unlocked
+  std::shared_ptr<Mesh> removed;
+
+  _state.lock();
+  auto &meshes = session->meshes;
+  auto it = std::find_if(meshes.begin(), meshes.end(), [m](const std::shared_ptr<Mesh> &mesh) { return mesh.get() == m; });
+  if (it != meshes.end())
+  {
+    removed = std::move(*it);
+    meshes.erase(it);
+  }
+  {
+    // It may not have been drawn yet
+    std::lock_guard<std::mutex> guard(_pendingLock);
+    for (auto it = _pendingMeshes.begin(); it != _pendingMeshes.end(); ++it)
+    {
+      if (it->mesh.get() == m)
+      {
+        removed = std::move(it->mesh);
+        _pendingMeshes.erase(it);
+        break;
+      }
+    }
+  }
+  _state.unlock();
+}
+
+std::shared_ptr<Session> Vulkan::addSession()
+{
+  auto session = std::make_shared<Session>();
+  _state.lock();
+  _state.sessions().push_back(session);
+  _state.unlock();
+  return session;
+}
+
+void Vulkan::removeSession(const std::shared_ptr<Session> &session)
+{
+  // Dropped once unlocked, the last reference to a mesh retires its
+  // buffers
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  std::vector<Pending> pending;
+
+  _state.lock();
+  auto &sessions = _state.sessions();
+  sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+  meshes.swap(session->meshes);
+  takePending(session, pending);
+  _state.unlock();
+}
+
+// Only the swap happens under the lock, however many meshes there are
+void Vulkan::clearSession(const std::shared_ptr<Session> &session)
+{
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  std::vector<Pending> pending;
+
+  _state.lock();
+  meshes.swap(session->meshes);
+  takePending(session, pending);
+  _state.unlock();
+}
+
+void Vulkan::swapSessions(const std::shared_ptr<Session> &a, const std::shared_ptr<Session> &b)
+{
+  _state.lock();
+  a->meshes.swap(b->meshes);
+  {
+    // Meshes not drawn yet go with the rest
+    std::lock_guard<std::mutex> guard(_pendingLock);
+    for (auto &p : _pendingMeshes)
+    {
+      if (p.session == a) {
+        p.session = b;
+      } else if (p.session == b) {
+        p.session = a;
+      }
+    }
+  }
+  _state.unlock();
+}
+
+// Called with _state locked
+void Vulkan::takePending(const std::shared_ptr<Session> &session, std::vector<Pending> &taken)
+{
+  std::lock_guard<std::mutex> guard(_pendingLock);
+  auto it = std::stable_partition(_pendingMeshes.begin(), _pendingMeshes.end(), [&session](const Pending &p) { return p.session != session; });
+  std::move(it, _pendingMeshes.end(), std::back_inserter(taken));
+  _pendingMeshes.erase(it, _pendingMeshes.end());
+}
+
+void Vulkan::afterNextFrame(std::function<void()> fn)
+{
+  std::lock_guard<std::mutex> guard(_pendingLock);
+  _pendingVisible.push_back(std::move(fn));
+}
+
+// Called with _state locked
+void Vulkan::adoptPendingMeshes()
+{
+  std::lock_guard<std::mutex> guard(_pendingLock);
+  for (auto &p : _pendingMeshes) {
+    p.session->meshes.push_back(std::move(p.mesh));
+  }
+  _pendingMeshes.clear();
+
+  for (auto &onVisible : _pendingVisible) {
+    _presenting.push_back(std::move(onVisible));
+  }
+  _pendingVisible.clear();
+}
+void Vulkan::transfer(const std::function<void(VkCommandBuffer)> &record)
+{
+  std::lock_guard<std::mutex> guard(_transferLock);
+
+  _transferCommands->reset();
+  CommandBuffer &buffer = _transferCommands->acquire();
+
+  VkCommandBufferBeginInfo beginInfo{};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  if (vkBeginCommandBuffer(buffer, &beginInfo) != VK_SUCCESS) {
+    throw std::runtime_error("failed to begin recording transfer!");
+  }
+
+  // Frames already submitted may be drawing from what is overwritten
+  vkCmdPipelineBarrier(
+    buffer,
+    VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+    0, 0, nullptr, 0, nullptr, 0, nullptr
+  );
+
+  record(buffer);
+
+  VkMemoryBarrier written{};
+  written.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  written.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  written.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+
+  vkCmdPipelineBarrier(
+    buffer,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+    0, 1, &written, 0, nullptr, 0, nullptr
+  );
+
+  if (vkEndCommandBuffer(buffer) != VK_SUCCESS) {
+    throw std::runtime_error("failed to record transfer!");
+  }
+
+  // Uploads not yet waited on by a frame may be to the buffers copied here
+  std::vector<VkSemaphore> uploads;
+  _uploader->takeWaits(uploads);
+  std::vector<VkPipelineStageFlags> uploadStages(uploads.size(), VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.waitSemaphoreCount = (uint32_t)uploads.size();
+  submitInfo.pWaitSemaphores = uploads.data();
+  submitInfo.pWaitDstStageMask = uploadStages.data();
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = (VkCommandBuffer *)&buffer;
+
+  vkResetFences(*_device, 1, &_transferFence);
+  {
+    std::lock_guard<std::mutex> queueGuard(_queueLock);
+    if (vkQueueSubmit(_device->graphicsQueue(), 1, &submitInfo, _transferFence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit transfer!");
+    }
+  }
+  vkWaitForFences(*_device, 1, &_transferFence, true, UINT64_MAX);
+  _uploader->recycle(uploads);
+}
+
+// The frame being recorded may still draw it, and uploads to it not yet
+// taken by a frame are taken by the next one, which is that frame unless it
+// has been numbered already.
+void Vulkan::retire(ResourceBuffer *buffer)
+{
+  std::lock_guard<std::mutex> guard(_retiredLock);
+  _retired.push_back({ buffer, nullptr, _frameSerial + 1 });
+}
+
+void Vulkan::retire(GeometryRange *range)
+{
+  std::lock_guard<std::mutex> guard(_retiredLock);
+  _retired.push_back({ nullptr, range, _frameSerial + 1 });
+}
+
+// Serials only grow, so everything due is at the front. It is deleted once
+// unlocked, so retiring from other threads never waits on the deletes.
+void Vulkan::releaseRetired()
+{
+  std::vector<Retired> due;
+  size_t waiting;
+  {
+    std::lock_guard<std::mutex> guard(_retiredLock);
+    while (!_retired.empty() && _retired.front().serial <= _completedSerial)
+    {
+      due.push_back(_retired.front());
+      _retired.pop_front();
+    }
+    waiting = _retired.size();
+  }
+
+  for (auto &retired : due)
+  {
+    delete retired.buffer;
+    delete retired.range;
+  }
+  metrics()["retired_waiting"] = (int)waiting;
+}
@@ -5,10 +5,13 @@
 
 #include <map>
 #include <mutex>
+#include <memory>
 #include <queue>
+#include <deque>
 #include <thread>
 #include <vector>
 #include <string>
+#include <functional>
 
 #include "State.h"
 #include "CommandBufferPool.h"
@@ -21,8 +24,13 @@ class SwapChain;
 
 class GraphicsPipeline;
 
+class Uploader;
+class GeometryPool;
+class GeometryRange;
+class MemoryAllocator;
+class ResourceBuffer;
 class VertexBuffer;
-class UniformBuffer;
+class UniformRing;
 
 class DescriptorSet;
 class DescriptorPool;
@@ -41,6 +49,9 @@ private:
 
   Device *_device = nullptr;
 
+  // Every buffer's memory comes out of its blocks
+  MemoryAllocator *_memory = nullptr;
+
   void createFences();  
   void createSemaphores();
 
@@ -75,13 +86,103 @@ private:
 
   static bool checkValidationLayers(const std::vector<const char *> &validationLayers);
 
-  std::vector<UniformBuffer> _cameraUniforms;
+  // Uniforms of the frames in flight, the camera for now
+  UniformRing *_uniforms = nullptr;
+
+  // Per swap chain image, the model matrix of each mesh drawn, which the
+  // vertex shader reads at gl_InstanceIndex, followed by the indirect
+  // commands drawing them. A frame that needs more room replaces its own,
+  // which is safe once its fence has been waited on.
+  struct FrameDraws
+  {
+    ResourceBuffer *buffer = nullptr;
+    uint32_t capacity = 0;
+  };
+  std::vector<FrameDraws> _frameDraws;
+  DescriptorPool *_drawDescriptorPool = nullptr;
+  std::vector<DescriptorSet> _drawDescriptorSets;
+  void growDraws(uint32_t imageIndex, size_t draws);
+
+  // Draws from the same vertex and index buffers with the same index type,
+  // collected under the state lock and recorded after it as one indirect
+  // draw. The debug pipeline gets batches of its own.
+  struct DrawBatch
+  {
+    VkBuffer vertexBuffer;
+    VkBuffer indexBuffer;
+    VkIndexType indexType;
+    bool indexed;
+    bool debug;
+    std::vector<VkDrawIndexedIndirectCommand> indexedCommands;
+    std::vector<VkDrawIndirectCommand> commands;
+    // Where the commands are in the frame's buffer
+    VkDeviceSize offset;
+  };
+  std::map<uint64_t, DrawBatch> _drawBatches;
+  void collectDraws(uint32_t imageIndex, bool debug);
+  void recordDraws(VkCommandBuffer buffer, uint32_t imageIndex, bool debug);
+
+  // Every mesh's vertices and indices are ranges of its shared buffers
+  GeometryPool *_geometry = nullptr;
 
   VertexBuffer *createVertexBuffer(const std::vector<glm::vec3> &vertices);
 
   bool _debugDraw = false;
   std::vector<CommandBufferPool> _commandBufferPools;
 
+  // Meshes added since the last frame, moved into their sessions by the
+  // render thread so uploads never wait on it
+  struct Pending
+  {
+    std::shared_ptr<Session> session;
+    std::shared_ptr<Mesh> mesh;
+  };
+  std::mutex _pendingLock;
+  std::vector<Pending> _pendingMeshes;
+  std::vector<std::function<void()>> _pendingVisible;
+  void adoptPendingMeshes();
+  void takePending(const std::shared_ptr<Session> &session, std::vector<Pending> &taken);
+
+  // Callbacks of the meshes adopted into the frame being recorded, run by
+  // the render thread once that frame has been presented
+  std::vector<std::function<void()>> _presenting;
+
+  // Frames and transfers are submitted from different threads
+  std::mutex _queueLock;
+
+  std::mutex _transferLock;
+  CommandBufferPool *_transferCommands = nullptr;
+  VkFence _transferFence = VK_NULL_HANDLE;
+  void createTransfer();
+
+  // New geometry goes up on the transfer queue. Each frame waits on the
+  // uploads submitted before it, per swap chain image until its fence
+  // says the waits are done and the semaphores can be used again.
+  Uploader *_uploader = nullptr;
+  std::vector<std::vector<VkSemaphore>> _uploadWaits;
+  std::vector<uint32_t> _copyQueueFamilies;
+
+  // Frames are numbered as they are submitted. Each swap chain image keeps
+  // the number of the frame last submitted with it, so waiting on its
+  // fence tells how far the GPU has got.
+  uint64_t _frameSerial = 0;
+  uint64_t _completedSerial = 0;
+  std::vector<uint64_t> _imageSerials;
+
+  // Buffers and ranges swapped out of meshes, in the order retired, each
+  // with the first frame that will not be recording them. Once that frame
+  // has completed so have the frames that drew them and the uploads to
+  // them it waited for.
+  struct Retired
+  {
+    ResourceBuffer *buffer;
+    GeometryRange *range;
+    uint64_t serial;
+  };
+  std::mutex _retiredLock;
+  std::deque<Retired> _retired;
+  void releaseRetired();
+
 public:
 
   Vulkan(
@@ -106,7 +207,57 @@ public:
   void toggleDebugDraw();
 
   State &state();
-  void addMesh(Mesh *);
+
+  // Adds a mesh to session, the default one if null, and returns the
+  // reference that owns it from now on. If its buffers can't be created
+  // this throws and the mesh is still the caller's. The mesh is deleted
+  // once the scene and any other holders have let go, its buffers once no
+  // frame in flight can still be reading them. onVisible, if given, runs
+  // on the render thread once the first frame drawing the mesh has been
+  // queued for presentation.
+  std::shared_ptr<Mesh> addMesh(Mesh *, std::function<void()> onVisible = nullptr, std::shared_ptr<Session> session = nullptr);
+
+  // Takes a mesh out of session, drawn yet or not
+  void removeMesh(const std::shared_ptr<Session> &session, Mesh *);
+
+  // A new, empty session drawn after the existing ones
+  std::shared_ptr<Session> addSession();
+
+  // Takes session out of the scene along with its meshes
+  void removeSession(const std::shared_ptr<Session> &session);
+
+  // Takes every mesh out of session
+  void clearSession(const std::shared_ptr<Session> &session);
+
+  // Trades the meshes of two sessions in one step, between two frames
+  void swapSessions(const std::shared_ptr<Session> &a, const std::shared_ptr<Session> &b);
+
+  // Runs fn on the render thread once a frame recorded after this call has
+  // been queued for presentation, e.g. to report a mesh changed in place
+  void afterNextFrame(std::function<void()> fn);
+
+  MemoryAllocator &memory() { return *_memory; }
+  GeometryPool &geometry() { return *_geometry; }
+
+  // Fills DEVICE_LOCAL buffers without waiting for the copies, which frames
+  // and transfer() submitted afterwards wait for on the GPU
+  Uploader &uploader() { return *_uploader; }
+
+  // Queue families buffers are copied on and read from, empty when that's
+  // all one family
+  const std::vector<uint32_t> &copyQueueFamilies() const { return _copyQueueFamilies; }
+
+  // Records a one-off command buffer, submits it and waits for it to
+  // complete. Frames submitted earlier are done reading vertices and
+  // indices before it starts, and frames submitted later see its writes.
+  void transfer(const std::function<void(VkCommandBuffer)> &record);
+
+  // Deletes a buffer or geometry range once no frame in flight can still be
+  // reading it and no upload to it can still be running, without the render
+  // thread ever waiting for that. It must already have been swapped out of
+  // its mesh under the state lock.
+  void retire(ResourceBuffer *buffer);
+  void retire(GeometryRange *range);
 
   void addVertexShader(const std::string &path);
   void addFragmentShader(const std::string &path);
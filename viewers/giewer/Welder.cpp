@@ -0,0 +1,139 @@
+#include "Welder.h"
+
+#include <cmath>
+#include <cstring>
+
+static const uint32_t EMPTY = UINT32_MAX;
+
+static inline uint32_t bits(float f)
+{
+  // -0.0 and 0.0 are the same position
+  if (f == 0.0f) {
+    return 0;
+  }
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+static inline size_t hash(const glm::vec3 &p)
+{
+  uint64_t h = bits(p.x) * 0x9E3779B97F4A7C15ull;
+  h ^= bits(p.y) * 0xC2B2AE3D27D4EB4Full;
+  h ^= bits(p.z) * 0x165667B19E3779F9ull;
+  return (size_t)(h ^ (h >> 29));
+}
+
+Welder::Welder(float creaseDegrees)
+: _creaseCos(std::cos(glm::radians(creaseDegrees)))
+{
+}
+
+void Welder::weld(const glm::vec3 *positions, size_t triangles)
+{
+  // Shared CAD vertices usually touch about six triangles, so half the
+  // triangle count is a generous first guess for the unique vertices.
+  _vertices.clear();
+  _vertices.reserve(triangles / 2 + 3);
+  _next.clear();
+  _next.reserve(triangles / 2 + 3);
+  _faceNormals.clear();
+  _faceNormals.reserve(triangles / 2 + 3);
+  _indices.resize(triangles * 3);
+
+  size_t capacity = 16;
+  while (capacity < triangles) {
+    capacity <<= 1;
+  }
+  _table.assign(capacity, EMPTY);
+  _positions = 0;
+
+  for (size_t t = 0; t < triangles; ++t)
+  {
+    const glm::vec3 *v = positions + t * 3;
+
+    // The unnormalised cross product weights each face by its area
+    glm::vec3 c = glm::cross(v[1] - v[0], v[2] - v[0]);
+    float len = glm::length(c);
+    glm::vec3 n = len > 0.0f ? c / len : glm::vec3(0.0f);
+
+    for (int i = 0; i < 3; ++i)
+    {
+      uint32_t idx = find(v[i], n);
+      _vertices[idx]._normal += c;
+      _indices[t * 3 + i] = idx;
+    }
+  }
+
+  for (auto &v : _vertices)
+  {
+    float len = glm::length(v._normal);
+    if (len > 0.0f) {
+      v._normal /= len;
+    }
+  }
+
+  std::vector<uint32_t>().swap(_table);
+  std::vector<uint32_t>().swap(_next);
+  std::vector<glm::vec3>().swap(_faceNormals);
+}
+
+void Welder::grow()
+{
+  std::vector<uint32_t> old(_table.size() * 2, EMPTY);
+  old.swap(_table);
+
+  size_t mask = _table.size() - 1;
+  for (uint32_t head : old)
+  {
+    if (head == EMPTY) {
+      continue;
+    }
+    size_t slot = hash(_vertices[head]._vertex) & mask;
+    while (_table[slot] != EMPTY) {
+      slot = (slot + 1) & mask;
+    }
+    _table[slot] = head;
+  }
+}
+
+uint32_t Welder::find(const glm::vec3 &p, const glm::vec3 &faceNormal)
+{
+  // Keep the table at most half full so probe runs stay short
+  if (_positions * 2 >= _table.size()) {
+    grow();
+  }
+
+  size_t mask = _table.size() - 1;
+  size_t slot = hash(p) & mask;
+
+  // Find the chain for this position, if there is one
+  while (_table[slot] != EMPTY && _vertices[_table[slot]]._vertex != p) {
+    slot = (slot + 1) & mask;
+  }
+
+  uint32_t last = EMPTY;
+  for (uint32_t i = _table[slot]; i != EMPTY; i = _next[i])
+  {
+    // Degenerate faces have no say in which side of a crease they're on
+    const glm::vec3 &n = _faceNormals[i];
+    if (glm::dot(n, faceNormal) >= _creaseCos || faceNormal == glm::vec3(0.0f) || n == glm::vec3(0.0f)) {
+      return i;
+    }
+    last = i;
+  }
+
+  uint32_t idx = (uint32_t)_vertices.size();
+  _vertices.push_back({ p, glm::vec3(0.0f) });
+  _next.push_back(EMPTY);
+  _faceNormals.push_back(faceNormal);
+
+  if (last == EMPTY) {
+    _table[slot] = idx;
+    _positions++;
+  } else {
+    _next[last] = idx;
+  }
+
+  return idx;
+}
@@ -0,0 +1,48 @@
+#ifndef __WELDER_H
+#define __WELDER_H
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Turns a triangle soup into unique vertices plus an index list. Corners
+// are merged when their positions match exactly and the faces meeting
+// there are within the crease angle of each other, so curved surfaces get
+// smooth shared normals while hard CAD edges keep their own.
+class Welder
+{
+public:
+  // Same layout as LitVertex, so results can be copied straight into a
+  // vertex buffer.
+  struct Vertex
+  {
+    glm::vec3 _vertex;
+    glm::vec3 _normal;
+  };
+
+  Welder(float creaseDegrees = 30.0f);
+
+  void weld(const glm::vec3 *positions, size_t triangles);
+
+  std::vector<Vertex> &vertices() { return _vertices; }
+  std::vector<uint32_t> &indices() { return _indices; }
+  const std::vector<Vertex> &vertices() const { return _vertices; }
+  const std::vector<uint32_t> &indices() const { return _indices; }
+
+private:
+  float _creaseCos;
+  std::vector<Vertex> _vertices;
+  std::vector<uint32_t> _indices;
+
+  // Open-addressed position -> first vertex table, other vertices at the
+  // same position are chained through _next.
+  std::vector<uint32_t> _table;
+  size_t _positions = 0;
+  std::vector<uint32_t> _next;
+  std::vector<glm::vec3> _faceNormals;
+
+  void grow();
+  uint32_t find(const glm::vec3 &p, const glm::vec3 &faceNormal);
+};
+
+#endif
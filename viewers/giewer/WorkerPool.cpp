@@ -0,0 +1,71 @@
+#include "WorkerPool.h"
+
+#include <iostream>
+#include <algorithm>
+
+WorkerPool::WorkerPool(unsigned threads)
+{
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (unsigned i = 0; i < threads; i++) {
+    _threads.emplace_back(&WorkerPool::run, this);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  stop();
+}
+
+void WorkerPool::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _stopping = true;
+    _tasks.clear();
+  }
+  _wake.notify_all();
+
+  for (auto &t : _threads) {
+    t.join();
+  }
+  _threads.clear();
+}
+
+void WorkerPool::post(std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_stopping) {
+      return;
+    }
+    _tasks.push_back(std::move(task));
+  }
+  _wake.notify_one();
+}
+
+void WorkerPool::run()
+{
+  for (;;)
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> guard(_lock);
+      _wake.wait(guard, [this]() { return _stopping || !_tasks.empty(); });
+      if (_stopping) {
+        return;
+      }
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+
+    try {
+      task();
+    }
+    catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef __WORKER_POOL_H
+#define __WORKER_POOL_H
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// Fixed set of threads for CPU-heavy work (parsing, welding, buffer
+// creation) so it stays off the network threads. Tasks start in the order
+// they were posted.
+class WorkerPool
+{
+public:
+  // 0 threads uses every hardware thread
+  WorkerPool(unsigned threads = 0);
+
+  ~WorkerPool();
+
+  // Waits for running tasks, queued ones are dropped and later posts ignored
+  void stop();
+
+  void post(std::function<void()> task);
+  unsigned size() const { return (unsigned)_threads.size(); }
+
+private:
+  std::mutex _lock;
+  std::condition_variable _wake;
+  std::deque<std::function<void()>> _tasks;
+  std::vector<std::thread> _threads;
+  bool _stopping = false;
+
+  void run();
+};
+
+#endif
@@ -3,12 +3,18 @@
 #include "glm/gtc/matrix_transform.hpp"
 
 #include <map>
+#include <mutex>
+#include <memory>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 
 #include "Mesh.h"
 #include "Vulkan.h"
+#include "Hash.h"
 #include "Loader.h"
+#include "MeshCache.h"
+#include "CompactMesh.h"
 #include "SocketServer.h"
 
 const uint32_t WIDTH = 800;
@@ -19,7 +25,26 @@ class VulkanApp : public SocketClient
 private:
   Vulkan *_vulkan;
   GLFWwindow *_window;
-  SocketServer _socketServer;
+  SocketServer _socketServer { 4242, SocketServer::localPathFromEnvironment() };
+  std::unique_ptr<MeshCache> _cache = MeshCache::fromEnvironment();
+
+  // A session as connections see it, with the meshes sent to it with an
+  // objectId for messages that refer back to them. A removed mesh is only
+  // deleted once the last message working on it from another connection
+  // lets go.
+  struct Scene
+  {
+    std::shared_ptr<Session> session;
+    std::map<uint64_t, std::shared_ptr<LitMesh>> objects;
+    bool owned = false;
+  };
+
+  // Guards the tables below and every Scene's objects. Connections that
+  // haven't sent MESSAGE_SESSION work in _defaultScene.
+  std::mutex _objectsLock;
+  std::shared_ptr<Scene> _defaultScene;
+  std::map<uint64_t, std::shared_ptr<Scene>> _sharedScenes;
+  std::map<uint64_t, std::shared_ptr<Scene>> _connectionScenes;
   static std::map<GLFWwindow *, VulkanApp *> _windowToApp;
 
   void initWindow() 
@@ -41,6 +66,9 @@ private:
     }
     _vulkan->setSurface(surface);
 
+    _defaultScene = std::make_shared<Scene>();
+    _defaultScene->session = _vulkan->state().defaultSession();
+
     glfwSetKeyCallback(_window, handleKeyboardInput);
     //createGeometry();   
   }
@@ -176,6 +204,12 @@ public:
 
   ~VulkanApp() 
   {
+    // No uploads may still be landing in _vulkan
+    _socketServer.stop();
+    _defaultScene.reset();
+    _sharedScenes.clear();
+    _connectionScenes.clear();
+
     if (_vulkan) {
       delete _vulkan;
       _vulkan = nullptr;
@@ -192,19 +226,442 @@ public:
       mainLoop();
   }
 
-  void onConnect(std::iostream &s)
+  // Called with _objectsLock held
+  std::shared_ptr<Scene> &sceneOf(uint64_t connection)
   {
-    Loader loader;
-    std::string str(std::istreambuf_iterator<char>(s), {});
-    std::istringstream inp(str);
-    if (_vulkan) {
-      _vulkan->addMesh(new LitMesh(loader.load_stl(inp)));
+    auto it = _connectionScenes.find(connection);
+    return it != _connectionScenes.end() ? it->second : _defaultScene;
+  }
+
+  std::shared_ptr<Scene> sceneFor(uint64_t connection)
+  {
+    std::lock_guard<std::mutex> guard(_objectsLock);
+    return sceneOf(connection);
+  }
+
+  // Called with _objectsLock held
+  std::shared_ptr<Scene> &sharedScene(uint64_t sessionId)
+  {
+    std::shared_ptr<Scene> &scene = _sharedScenes[sessionId];
+    if (!scene)
+    {
+      scene = std::make_shared<Scene>();
+      scene->session = _vulkan->addSession();
+    }
+    return scene;
+  }
+
+  // Takes a connection's own scene out once nothing can reach it anymore
+  void dropScene(std::shared_ptr<Scene> scene)
+  {
+    if (scene && scene->owned) {
+      _vulkan->removeSession(scene->session);
+    }
+  }
+
+  std::shared_ptr<LitMesh> findObject(uint64_t connection, uint64_t objectId)
+  {
+    std::lock_guard<std::mutex> guard(_objectsLock);
+    auto &objects = sceneOf(connection)->objects;
+    auto it = objects.find(objectId);
+    return it != objects.end() ? it->second : nullptr;
+  }
+
+  // The mesh a message refers to, what names the message for the error
+  std::shared_ptr<LitMesh> objectFor(uint64_t connection, const MessageHeader &header, const char *what)
+  {
+    std::shared_ptr<LitMesh> mesh = findObject(connection, header.objectId);
+    if (!mesh) {
+      throw std::runtime_error(std::string(what) + " for unknown object " + std::to_string(header.objectId));
     }
+    return mesh;
   }
 
-  void onClose(std::iostream &)
+  // A header-only answer about the object a message named
+  static MessageHeader answer(MessageType type, const MessageHeader &about)
   {
+    MessageHeader header{};
+    memcpy(header.magic, MESSAGE_MAGIC, sizeof(header.magic));
+    header.type = type;
+    header.objectId = about.objectId;
+    return header;
+  }
+
+  void onMessage(uint64_t connection, const MessageHeader &header, const char *payload, size_t length, const Reply &reply)
+  {
+    if (!_vulkan) {
+      return;
+    }
+
+    switch (header.type)
+    {
+      case MESSAGE_MESH : {
+        bool notify = (header.flags & MESSAGE_FLAG_NOTIFY_VISIBLE) != 0;
+
+        std::function<void()> onVisible;
+        if (notify) {
+          onVisible = [reply, header]() { reply(answer(MESSAGE_VISIBLE, header)); };
+        }
+
+        std::shared_ptr<Scene> scene = sceneFor(connection);
+        std::shared_ptr<LitMesh> existing = header.objectId ? findObject(connection, header.objectId) : nullptr;
+        if (existing)
+        {
+          if (updateModel(existing.get(), payload, length)) {
+            if (onVisible) {
+              _vulkan->afterNextFrame(onVisible);
+            }
+          } else if (notify) {
+            reply(answer(MESSAGE_REJECTED, header));
+          }
+          break;
+        }
+
+        std::shared_ptr<LitMesh> mesh = addModel(payload, length, !(header.flags & MESSAGE_FLAG_EDITABLE), onVisible, header.objectId != 0, scene->session);
+        if (!mesh && notify) {
+          reply(answer(MESSAGE_REJECTED, header));
+        }
+        if (mesh && header.objectId)
+        {
+          std::lock_guard<std::mutex> guard(_objectsLock);
+          scene->objects[header.objectId] = mesh;
+        }
+      }
+      break;
+
+      case MESSAGE_PATCH : {
+        patchModel(connection, header.objectId, payload, length);
+      }
+      break;
+
+      case MESSAGE_TRANSFORM : {
+        glm::mat4 transform;
+        if (length != sizeof(transform)) {
+          throw std::runtime_error("transform message must carry 16 floats");
+        }
+        memcpy(&transform, payload, sizeof(transform));
+
+        std::shared_ptr<LitMesh> mesh = objectFor(connection, header, "transform");
+        _vulkan->state().lock();
+        mesh->transform(transform);
+        _vulkan->state().unlock();
+      }
+      break;
+
+      case MESSAGE_VISIBILITY : {
+        uint32_t visible;
+        if (length != sizeof(visible)) {
+          throw std::runtime_error("visibility message must carry a uint32");
+        }
+        memcpy(&visible, payload, sizeof(visible));
+
+        if (!header.objectId)
+        {
+          std::shared_ptr<Scene> scene = sceneFor(connection);
+          _vulkan->state().lock();
+          scene->session->visible = visible != 0;
+          _vulkan->state().unlock();
+          break;
+        }
+
+        std::shared_ptr<LitMesh> mesh = objectFor(connection, header, "visibility");
+        _vulkan->state().lock();
+        mesh->visible(visible != 0);
+        _vulkan->state().unlock();
+      }
+      break;
+
+      case MESSAGE_REMOVE : {
+        // Let go of outside the lock
+        std::map<uint64_t, std::shared_ptr<LitMesh>> removed;
+        std::shared_ptr<Scene> scene;
+        {
+          std::lock_guard<std::mutex> guard(_objectsLock);
+          scene = sceneOf(connection);
+          if (!header.objectId) {
+            removed.swap(scene->objects);
+          } else {
+            auto it = scene->objects.find(header.objectId);
+            if (it == scene->objects.end()) {
+              throw std::runtime_error("remove for unknown object " + std::to_string(header.objectId));
+            }
+            removed.insert(removed.end(), std::move(*it));
+            scene->objects.erase(it);
+          }
+        }
+
+        if (!header.objectId) {
+          _vulkan->clearSession(scene->session);
+        } else {
+          _vulkan->removeMesh(scene->session, removed.begin()->second.get());
+        }
+      }
+      break;
+
+      case MESSAGE_SESSION : {
+        std::shared_ptr<Scene> left;
+        {
+          std::lock_guard<std::mutex> guard(_objectsLock);
+          std::shared_ptr<Scene> &current = _connectionScenes[connection];
+          left = std::move(current);
+          if (header.objectId) {
+            current = sharedScene(header.objectId);
+          } else {
+            current = std::make_shared<Scene>();
+            current->session = _vulkan->addSession();
+            current->owned = true;
+          }
+        }
+        dropScene(left);
+      }
+      break;
+
+      case MESSAGE_SWAP : {
+        if (!header.objectId) {
+          throw std::runtime_error("swap needs a shared session");
+        }
+
+        std::lock_guard<std::mutex> guard(_objectsLock);
+        std::shared_ptr<Scene> &scene = sceneOf(connection);
+        std::shared_ptr<Scene> &other = sharedScene(header.objectId);
+        if (scene != other)
+        {
+          scene->objects.swap(other->objects);
+          _vulkan->swapSessions(scene->session, other->session);
+        }
+      }
+      break;
+
+      default : {
+        std::cerr << "ignoring message of unknown type " << header.type << std::endl;
+      }
+      break;
+    }
   }
+
+  // A raw upload of a whole model file, fed as the bytes arrive
+  class ModelUpload : public RawUpload
+  {
+  public:
+    ModelUpload(VulkanApp &app) : _app(app)
+    {
+    }
+
+    ~ModelUpload()
+    {
+      delete _mesh;
+    }
+
+    void feed(const char *data, size_t size)
+    {
+      if (_parser)
+      {
+        if (!_failed && !_parser->feed(data, size)) {
+          _failed = true;
+        }
+        if (_app._cache->enabled()) {
+          _hash.update(data, size);
+        }
+        _size += size;
+        return;
+      }
+
+      _data.append(data, size);
+      if (!_decided && _data.size() >= 64 * 1024) {
+        decide();
+      }
+    }
+
+    size_t buffered() const
+    {
+      return _data.size();
+    }
+
+    void finish()
+    {
+      if (!_decided) {
+        decide();
+      }
+
+      if (!_parser)
+      {
+        _app.addModel(_data.data(), _data.size());
+        return;
+      }
+
+      // Stored once welded, for the next time the same bytes are loaded
+      if (_app._cache->enabled()) {
+        _mesh->cacheAs(_app._cache.get(), _hash.digest(), _size);
+      }
+      _parser->finish();
+      _app._vulkan->addMesh(_mesh);
+      _mesh = nullptr;
+    }
+
+  private:
+    VulkanApp &_app;
+    std::string _data;
+    bool _decided = false;
+    bool _failed = false;
+    LitMesh *_mesh = nullptr;
+    std::unique_ptr<StlParser> _parser;
+    // Of what the parser has been fed, the cache key once it's all there
+    Hash64 _hash;
+    uint64_t _size = 0;
+
+    // The first 64 KB are enough to tell the format apart. Only STL is
+    // parsed as it arrives, straight into the mesh; other formats need
+    // every byte first. A streamed upload can't be a cache hit, its key
+    // is only known at the end, but it is still stored.
+    void decide()
+    {
+      _decided = true;
+      if (strcmp(Loader::sniff(_data.data(), _data.size()), "stl") != 0) {
+        return;
+      }
+
+      _mesh = new LitMesh();
+      _parser.reset(new StlParser(*_mesh));
+      std::string head = std::move(_data);
+      _data.clear();
+      feed(head.data(), head.size());
+    }
+  };
+
+  void onClose(uint64_t connection)
+  {
+    std::shared_ptr<Scene> left;
+    {
+      std::lock_guard<std::mutex> guard(_objectsLock);
+      auto it = _connectionScenes.find(connection);
+      if (it == _connectionScenes.end()) {
+        return;
+      }
+      left = std::move(it->second);
+      _connectionScenes.erase(it);
+    }
+    dropScene(left);
+  }
+
+  RawUpload *onRawUpload()
+  {
+    if (!_vulkan) {
+      return nullptr;
+    }
+    return new ModelUpload(*this);
+  }
+
+  // Adds a whole model file. With the cache on, a hit is just a copy out
+  // of the mapped cache file into the GPU buffers, a miss is parsed and
+  // welded from memory and stored for next time. Unwelded meshes are never
+  // cached. Returns the mesh, or nullptr if it couldn't be loaded.
+  // onVisible and session are passed on to Vulkan::addMesh. A mesh that may
+  // be sent again keeps page hashes for updateModel().
+  std::shared_ptr<LitMesh> addModel(const char *data, size_t size, bool weld = true, std::function<void()> onVisible = nullptr, bool resendable = false, std::shared_ptr<Session> session = nullptr)
+  {
+    // Compact meshes come welded and decode faster than a cache lookup
+    if (weld && CompactMesh::sniff(data, size))
+    {
+      LitMesh *mesh = nullptr;
+      try {
+        mesh = new LitMesh(CompactMesh(data, size), resendable);
+        return std::static_pointer_cast<LitMesh>(_vulkan->addMesh(mesh, onVisible, session));
+      }
+      catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        delete mesh;
+        return nullptr;
+      }
+    }
+
+    bool cached = weld && _cache->enabled();
+
+    uint64_t key = 0;
+    if (cached) {
+      key = hash64(data, size);
+    }
+
+    LitMesh *mesh = nullptr;
+    try {
+      std::unique_ptr<MeshCache::Entry> entry;
+      if (cached) {
+        entry = _cache->load(key, size);
+      }
+
+      if (entry) {
+        mesh = new LitMesh(entry->vertices, entry->vertexCount, entry->indices, entry->indexCount, resendable);
+      }
+      else {
+        mesh = new LitMesh(weld);
+        if (resendable) {
+          mesh->trackPages();
+        }
+        if (cached) {
+          mesh->cacheAs(_cache.get(), key, size);
+        }
+        if (!Loader().load(data, size, *mesh)) {
+          throw std::runtime_error(std::string("malformed ") + Loader::sniff(data, size));
+        }
+      }
+      return std::static_pointer_cast<LitMesh>(_vulkan->addMesh(mesh, onVisible, session));
+    }
+    catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      delete mesh;
+      return nullptr;
+    }
+  }
+
+  // A full mesh sent again for an object that already has one. It's
+  // processed as the existing mesh was, welded or not, and only the pages
+  // that differ are copied to the GPU. Returns false if it couldn't be
+  // loaded, the old version stays.
+  bool updateModel(LitMesh *mesh, const char *data, size_t size)
+  {
+    try {
+      if (mesh->welded() && CompactMesh::sniff(data, size)) {
+        mesh->update(CompactMesh(data, size));
+      }
+      else {
+        LitMeshUpdate update(*mesh);
+        if (!Loader().load(data, size, update)) {
+          throw std::runtime_error(std::string("malformed ") + Loader::sniff(data, size));
+        }
+      }
+      return true;
+    }
+    catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+  }
+
+  void patchModel(uint64_t connection, uint64_t objectId, const char *payload, size_t length)
+  {
+    PatchHeader patch;
+    if (length < sizeof(patch)) {
+      throw std::runtime_error("patch message too short");
+    }
+    memcpy(&patch, payload, sizeof(patch));
+
+    const size_t triangleSize = 9 * sizeof(float);
+    if ((length - sizeof(patch)) / triangleSize != patch.count ||
+        (length - sizeof(patch)) % triangleSize != 0) {
+      throw std::runtime_error("patch length doesn't match its triangle count");
+    }
+
+    std::shared_ptr<LitMesh> mesh = findObject(connection, objectId);
+    if (!mesh) {
+      throw std::runtime_error("patch for unknown object " + std::to_string(objectId));
+    }
+
+    // The payload's floats aren't necessarily aligned for glm::vec3
+    std::vector<glm::vec3> positions(patch.count * (size_t)3);
+    memcpy(positions.data(), payload + sizeof(patch), positions.size() * sizeof(glm::vec3));
+
+    mesh->patch(patch.first, patch.replace, positions.data(), patch.count);
+  }
+
 };
 
 std::map<GLFWwindow *, VulkanApp *> VulkanApp::_windowToApp;
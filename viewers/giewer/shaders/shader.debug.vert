@@ -6,10 +6,11 @@ layout(binding = 0) uniform View {
     mat4 proj;
 } v;
 
-layout(push_constant) uniform Model
+// One model matrix per draw, picked by the draw's first instance
+layout(set = 1, binding = 0) readonly buffer Draws
 {
-    mat4 model;
-} m;
+    mat4 model[];
+} d;
 
 layout(location = 0) in vec3 vertex;
 layout(location = 1) in vec3 normal;
@@ -17,6 +18,7 @@ layout(location = 1) in vec3 normal;
 layout(location = 0) out vec4 cameraNormal;
 
 void main() {
-  gl_Position = v.proj * v.view * m.model * vec4(vertex, 1.0);
-  cameraNormal = v.proj * v.view * m.model * vec4(normal, 0.0);
-}
\ No newline at end of file
+  mat4 model = d.model[gl_InstanceIndex];
+  gl_Position = v.proj * v.view * model * vec4(vertex, 1.0);
+  cameraNormal = v.proj * v.view * model * vec4(normal, 0.0);
+}
\ No newline at end of file
@@ -0,0 +1,554 @@
+// Load generator for the viewer's socket server. Opens many connections at
+// once and streams meshes over them at a set rate and mix of sizes, asking
+// the viewer to say when each one has been drawn. Results are printed as
+// JSON, like loaderbench, so runs can be diffed against each other.
+//
+//   loadgen [--host 127.0.0.1] [--port 4242] [--connections 16]
+//           [--rate 50] [--duration 10] [--meshes 0] [--window 4]
+//           [--sizes 2000:8,200000:1] [--format compact|stl]
+//           [--file part.stl]... [--drain 30] [--no-wait]
+//
+// --rate is meshes per second over all connections, 0 sends as fast as
+// the window allows. --sizes is a weighted mix of synthetic meshes by
+// triangle count; files given with --file join the mix with weight 1 and
+// replace the synthetic default. --window caps the meshes per connection
+// not yet visible. --no-wait skips the visibility notices and with them
+// the window and time-to-visible.
+
+#include "../giewer/Loader.h"
+#include "../giewer/Protocol.h"
+#include "../giewer/CompactMesh.h"
+
+#include <map>
+#include <mutex>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <boost/asio.hpp>
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock Clock;
+
+static double millis(Clock::duration d)
+{
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+struct Options
+{
+  std::string host = "127.0.0.1";
+  std::string port = "4242";
+  unsigned connections = 16;
+  double rate = 50.0;
+  double duration = 10.0;
+  uint64_t meshes = 0;
+  unsigned window = 4;
+  double drain = 30.0;
+  bool wait = true;
+  std::string format = "compact";
+  std::string sizes = "2000:8,200000:1";
+  std::vector<std::string> files;
+};
+
+// One kind of mesh in the mix, encoded once and sent many times
+struct Payload
+{
+  std::string name;
+  std::string data;
+  size_t triangles;
+  unsigned weight;
+};
+
+// Latencies in milliseconds, reported as percentiles
+class Samples
+{
+public:
+  void add(double ms)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _ms.push_back(ms);
+  }
+
+  std::string json()
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_ms.empty()) {
+      return "null";
+    }
+    std::sort(_ms.begin(), _ms.end());
+
+    char line[256];
+    snprintf(line, sizeof(line),
+      "{\"count\": %zu, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+      _ms.size(), at(0.50), at(0.90), at(0.99), _ms.back());
+    return line;
+  }
+
+private:
+  std::mutex _lock;
+  std::vector<double> _ms;
+
+  // Nearest rank
+  double at(double p) const
+  {
+    size_t rank = (size_t)std::ceil(p * _ms.size());
+    return _ms[std::min(_ms.size(), std::max<size_t>(rank, 1)) - 1];
+  }
+};
+
+struct Totals
+{
+  std::atomic<uint64_t> claimed { 0 };
+  std::atomic<uint64_t> sent { 0 };
+  std::atomic<uint64_t> bytes { 0 };
+  std::atomic<uint64_t> triangles { 0 };
+  std::atomic<uint64_t> visible { 0 };
+  std::atomic<uint64_t> rejected { 0 };
+  std::atomic<uint64_t> unanswered { 0 };
+  std::atomic<uint64_t> lagging { 0 };
+  std::atomic<unsigned> failedConnections { 0 };
+
+  Samples connectMs;
+  Samples sendMs;
+  Samples visibleMs;
+};
+
+// Counts what a file holds without keeping it. Large ASCII files deliver
+// their triangles from several threads at once, so the count is the one
+// reserve() is given rather than a tally.
+class CountingSink : public TriangleSink
+{
+public:
+  size_t _triangles = 0;
+
+  virtual void reserve(size_t triangles) { _triangles = triangles; }
+  virtual void triangle(size_t, const glm::vec3 *) {}
+  virtual void finish() {}
+};
+
+// A height field of about the given number of triangles, so the viewer has
+// to weld and draw something that isn't degenerate
+static void makeGrid(size_t triangles, std::vector<CompactMesh::Vertex> &vertices, std::vector<uint32_t> &indices)
+{
+  uint32_t cols = (uint32_t)std::max(1.0, std::ceil(std::sqrt(triangles / 2.0)));
+  uint32_t rows = (uint32_t)std::max<size_t>(1, (triangles / 2 + cols - 1) / cols);
+
+  vertices.clear();
+  for (uint32_t r = 0; r <= rows; r++)
+  {
+    for (uint32_t c = 0; c <= cols; c++)
+    {
+      float x = (float)c, y = (float)r;
+      float z = std::sin(x * 0.3f) * std::cos(y * 0.3f);
+      glm::vec3 normal(-0.3f * std::cos(x * 0.3f) * std::cos(y * 0.3f), 0.3f * std::sin(x * 0.3f) * std::sin(y * 0.3f), 1.0f);
+      vertices.push_back({ glm::vec3(x, y, z), glm::normalize(normal) });
+    }
+  }
+
+  indices.clear();
+  for (uint32_t r = 0; r < rows && indices.size() < triangles * 3; r++)
+  {
+    for (uint32_t c = 0; c < cols && indices.size() < triangles * 3; c++)
+    {
+      uint32_t a = r * (cols + 1) + c, b = a + 1, d = a + cols + 1, e = d + 1;
+      indices.insert(indices.end(), { a, b, d });
+      if (indices.size() < triangles * 3) {
+        indices.insert(indices.end(), { b, e, d });
+      }
+    }
+  }
+}
+
+static std::string encodeStl(const std::vector<CompactMesh::Vertex> &vertices, const std::vector<uint32_t> &indices)
+{
+  uint32_t count = (uint32_t)(indices.size() / 3);
+  std::string out(80, '\0');
+  out.append((const char *)&count, sizeof(count));
+
+  for (size_t t = 0; t < count; t++)
+  {
+    float facet[12] = {};
+    for (int k = 0; k < 3; k++) {
+      memcpy(&facet[3 + k * 3], &vertices[indices[t * 3 + k]]._vertex, 3 * sizeof(float));
+    }
+    out.append((const char *)facet, sizeof(facet));
+    out.append(2, '\0');
+  }
+  return out;
+}
+
+static std::vector<Payload> makePayloads(const Options &options)
+{
+  std::vector<Payload> payloads;
+
+  for (auto &file : options.files)
+  {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+      throw std::runtime_error("can't read " + file);
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    CountingSink counter;
+    if (!Loader().load(data.data(), data.size(), counter)) {
+      throw std::runtime_error("malformed " + file);
+    }
+    payloads.push_back({ file, std::move(data), counter._triangles, 1 });
+  }
+
+  if (!payloads.empty() && options.sizes.empty()) {
+    return payloads;
+  }
+
+  std::istringstream in(options.sizes);
+  std::string item;
+  while (std::getline(in, item, ','))
+  {
+    size_t colon = item.find(':');
+    size_t triangles = (size_t)std::max(1ll, std::stoll(item.substr(0, colon)));
+    unsigned weight = colon == std::string::npos ? 1 : (unsigned)std::max(0, std::stoi(item.substr(colon + 1)));
+
+    std::vector<CompactMesh::Vertex> vertices;
+    std::vector<uint32_t> indices;
+    makeGrid(triangles, vertices, indices);
+
+    std::string data;
+    if (options.format == "compact") {
+      data = CompactMesh::encode(vertices.data(), (uint32_t)vertices.size(), indices.data(), (uint32_t)indices.size());
+    } else if (options.format == "stl") {
+      data = encodeStl(vertices, indices);
+    } else {
+      throw std::runtime_error("unknown format " + options.format);
+    }
+
+    payloads.push_back({ options.format + ":" + std::to_string(indices.size() / 3), std::move(data), indices.size() / 3, weight });
+  }
+  return payloads;
+}
+
+// One connection to the viewer. The sender thread writes meshes on a
+// schedule and the receiver thread matches the viewer's notices to them.
+class Client
+{
+public:
+  Client(unsigned index, const Options &options, const std::vector<Payload> &payloads, Totals &totals) :
+    _index(index), _options(options), _payloads(payloads), _totals(totals), _socket(_io), _rng(index + 1)
+  {
+    for (auto &p : payloads) {
+      _weights.push_back(p.weight);
+    }
+  }
+
+  void start(const tcp::resolver::results_type &endpoints, Clock::time_point until)
+  {
+    _thread = std::thread([this, endpoints, until]() { run(endpoints, until); });
+  }
+
+  void join()
+  {
+    _thread.join();
+  }
+
+private:
+  unsigned _index;
+  const Options &_options;
+  const std::vector<Payload> &_payloads;
+  Totals &_totals;
+
+  boost::asio::io_context _io;
+  tcp::socket _socket;
+  std::thread _thread;
+
+  std::mt19937 _rng;
+  std::vector<unsigned> _weights;
+
+  // Meshes sent and not yet answered, by objectId
+  std::mutex _lock;
+  std::condition_variable _answered;
+  std::map<uint64_t, Clock::time_point> _inFlight;
+  bool _closed = false;
+
+  void run(const tcp::resolver::results_type &endpoints, Clock::time_point until)
+  {
+    try
+    {
+      // The kernel completes the handshake before the viewer calls accept,
+      // so this is the time to get into its listen backlog
+      auto begin = Clock::now();
+      boost::asio::connect(_socket, endpoints);
+      _totals.connectMs.add(millis(Clock::now() - begin));
+      _socket.set_option(tcp::no_delay(true));
+    }
+    catch (const std::exception &e)
+    {
+      std::cerr << "connection " << _index << ": " << e.what() << std::endl;
+      _totals.failedConnections++;
+      return;
+    }
+
+    std::thread receiver;
+    if (_options.wait) {
+      receiver = std::thread([this]() { receive(); });
+    }
+
+    try {
+      send(until);
+      drain();
+    }
+    catch (const std::exception &e) {
+      std::cerr << "connection " << _index << ": " << e.what() << std::endl;
+    }
+
+    // Closing our side lets the viewer drop the connection, which ends the
+    // receiver's read
+    boost::system::error_code ignored;
+    _socket.shutdown(tcp::socket::shutdown_send, ignored);
+    if (receiver.joinable()) {
+      receiver.join();
+    }
+    _socket.close(ignored);
+
+    std::lock_guard<std::mutex> guard(_lock);
+    _totals.unanswered += _inFlight.size();
+  }
+
+  void send(Clock::time_point until)
+  {
+    std::discrete_distribution<size_t> pick(_weights.begin(), _weights.end());
+
+    // Open loop: each send is due at a fixed interval from the start, so a
+    // slow viewer shows up as lag rather than as a lower offered rate
+    auto interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(_options.rate > 0.0 ? _options.connections / _options.rate : 0.0)
+    );
+    auto due = Clock::now();
+
+    for (uint64_t sequence = 1; Clock::now() < until; sequence++)
+    {
+      if (_options.meshes && _totals.claimed++ >= _options.meshes) {
+        break;
+      }
+
+      if (_options.rate > 0.0)
+      {
+        if (Clock::now() > due + interval) {
+          _totals.lagging++;
+        }
+        std::this_thread::sleep_until(due);
+        due += interval;
+      }
+
+      if (_options.wait)
+      {
+        std::unique_lock<std::mutex> guard(_lock);
+        _answered.wait_until(guard, until, [this]() { return _closed || _inFlight.size() < _options.window; });
+        if (_closed) {
+          throw std::runtime_error("viewer closed the connection");
+        }
+        if (_inFlight.size() >= _options.window) {
+          break;
+        }
+      }
+
+      const Payload &payload = _payloads[pick(_rng)];
+
+      MessageHeader header{};
+      memcpy(header.magic, MESSAGE_MAGIC, sizeof(header.magic));
+      header.type = MESSAGE_MESH;
+      header.flags = _options.wait ? MESSAGE_FLAG_NOTIFY_VISIBLE : 0;
+      header.objectId = ((uint64_t)(_index + 1) << 40) | sequence;
+      header.length = payload.data.size();
+
+      auto begin = Clock::now();
+      if (_options.wait)
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _inFlight[header.objectId] = begin;
+      }
+
+      std::vector<boost::asio::const_buffer> buffers = {
+        boost::asio::buffer(&header, sizeof(header)),
+        boost::asio::buffer(payload.data)
+      };
+      boost::asio::write(_socket, buffers);
+
+      _totals.sendMs.add(millis(Clock::now() - begin));
+      _totals.sent++;
+      _totals.bytes += sizeof(header) + payload.data.size();
+      _totals.triangles += payload.triangles;
+    }
+  }
+
+  void drain()
+  {
+    if (!_options.wait) {
+      return;
+    }
+    auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(_options.drain));
+
+    std::unique_lock<std::mutex> guard(_lock);
+    _answered.wait_until(guard, deadline, [this]() { return _closed || _inFlight.empty(); });
+  }
+
+  void receive()
+  {
+    for (;;)
+    {
+      MessageHeader header;
+      boost::system::error_code err;
+      boost::asio::read(_socket, boost::asio::buffer(&header, sizeof(header)), err);
+      if (err || memcmp(header.magic, MESSAGE_MAGIC, sizeof(MESSAGE_MAGIC)) != 0) {
+        break;
+      }
+
+      std::lock_guard<std::mutex> guard(_lock);
+      auto it = _inFlight.find(header.objectId);
+      if (it == _inFlight.end()) {
+        continue;
+      }
+
+      if (header.type == MESSAGE_VISIBLE)
+      {
+        _totals.visibleMs.add(millis(Clock::now() - it->second));
+        _totals.visible++;
+      }
+      else
+      {
+        _totals.rejected++;
+      }
+      _inFlight.erase(it);
+      _answered.notify_all();
+    }
+
+    std::lock_guard<std::mutex> guard(_lock);
+    _closed = true;
+    _answered.notify_all();
+  }
+};
+
+static void parseArgs(int argc, char **argv, Options &options)
+{
+  bool sizesGiven = false;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--no-wait")
+    {
+      options.wait = false;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      throw std::runtime_error("missing value for " + arg);
+    }
+
+    std::string value = argv[++i];
+    if (arg == "--host") {
+      options.host = value;
+    } else if (arg == "--port") {
+      options.port = value;
+    } else if (arg == "--connections") {
+      options.connections = (unsigned)std::max(1, std::stoi(value));
+    } else if (arg == "--rate") {
+      options.rate = std::max(0.0, std::stod(value));
+    } else if (arg == "--duration") {
+      options.duration = std::max(0.0, std::stod(value));
+    } else if (arg == "--meshes") {
+      options.meshes = std::stoull(value);
+    } else if (arg == "--window") {
+      options.window = (unsigned)std::max(1, std::stoi(value));
+    } else if (arg == "--drain") {
+      options.drain = std::max(0.0, std::stod(value));
+    } else if (arg == "--format") {
+      options.format = value;
+    } else if (arg == "--sizes") {
+      options.sizes = value;
+      sizesGiven = true;
+    } else if (arg == "--file") {
+      options.files.push_back(value);
+    } else {
+      throw std::runtime_error("unknown option " + arg);
+    }
+  }
+
+  if (!options.files.empty() && !sizesGiven) {
+    options.sizes.clear();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  Totals totals;
+
+  try
+  {
+    parseArgs(argc, argv, options);
+    std::vector<Payload> payloads = makePayloads(options);
+
+    boost::asio::io_context io;
+    auto endpoints = tcp::resolver(io).resolve(options.host, options.port);
+
+    auto begin = Clock::now();
+    auto until = begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    std::vector<std::unique_ptr<Client>> clients;
+    for (unsigned i = 0; i < options.connections; i++)
+    {
+      clients.emplace_back(new Client(i, options, payloads, totals));
+      clients.back()->start(endpoints, until);
+    }
+    for (auto &client : clients) {
+      client->join();
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::ostringstream mix;
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+      mix << (i ? ",\n" : "") << "    {\"name\": \"" << payloads[i].name << "\", \"bytes\": " << payloads[i].data.size()
+          << ", \"triangles\": " << payloads[i].triangles << ", \"weight\": " << payloads[i].weight << "}";
+    }
+
+    char rates[256];
+    snprintf(rates, sizeof(rates),
+      "\"seconds\": %.3f, \"mb_per_s\": %.1f, \"meshes_per_s\": %.1f, \"tris_per_s\": %.0f",
+      secs, totals.bytes / (1024.0 * 1024.0) / secs, totals.sent / secs, totals.triangles / secs);
+
+    std::cout << "{\n  \"host\": \"" << options.host << "\",\n"
+              << "  \"port\": " << options.port << ",\n"
+              << "  \"connections\": " << options.connections << ",\n"
+              << "  \"failed_connections\": " << totals.failedConnections << ",\n"
+              << "  \"rate\": " << options.rate << ",\n"
+              << "  \"window\": " << options.window << ",\n"
+              << "  \"mix\": [\n" << mix.str() << "\n  ],\n"
+              << "  \"meshes_sent\": " << totals.sent << ",\n"
+              << "  \"meshes_visible\": " << totals.visible << ",\n"
+              << "  \"meshes_rejected\": " << totals.rejected << ",\n"
+              << "  \"meshes_unanswered\": " << totals.unanswered << ",\n"
+              << "  \"sends_behind_schedule\": " << totals.lagging << ",\n"
+              << "  \"bytes_sent\": " << totals.bytes << ",\n"
+              << "  " << rates << ",\n"
+              << "  \"connect_ms\": " << totals.connectMs.json() << ",\n"
+              << "  \"send_ms\": " << totals.sendMs.json() << ",\n"
+              << "  \"visible_ms\": " << totals.visibleMs.json() << "\n}" << std::endl;
+
+    return totals.failedConnections || totals.rejected ? 1 : 0;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
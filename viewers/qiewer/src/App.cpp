@@ -44,11 +44,12 @@ bool App::event(QEvent* e)
 
 void App::onConnect(std::iostream &s)
 {
+  // Loader parses the socket stream as it arrives, no slurp or seek
   Loader loader;
-  std::string str(std::istreambuf_iterator<char>(s), {});
-  std::istringstream inp(str);
-  Mesh *m = loader.load_stl(inp);
-  _window->setMesh(m);
+  Mesh *m = loader.load_stl(s);
+  if (m) {
+    _window->setMesh(m);
+  }
 }
 
 void App::onClose(std::iostream &s)
@@ -0,0 +1,218 @@
+#include "Dedupe.h"
+
+#include <thread>
+#include <future>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+// Vertices are sorted by position with an LSD radix sort so that equal
+// positions end up next to each other. Each of x, y and z contributes three
+// 11 bit digits (the last one 10 bits), z first so that x ends up most
+// significant.
+static const unsigned RADIX_BITS = 11;
+static const unsigned RADIX_BUCKETS = 1 << RADIX_BITS;
+static const unsigned RADIX_PASSES = 9;
+
+// Below this many vertices threads cost more than they save
+static const size_t DEDUPE_PARALLEL_MIN = 64 * 1024;
+
+// Maps a float's bit pattern to an unsigned key with the same ordering.
+// -0.0 and 0.0 are the same position so both map to the same key.
+static inline uint32_t sort_key(float f)
+{
+    if (f == 0.0f)
+    {
+        f = 0.0f;
+    }
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+static inline unsigned radix_digit(const Vertex &v, unsigned pass)
+{
+    const float c = pass < 3 ? v.z : (pass < 6 ? v.y : v.x);
+    return (sort_key(c) >> ((pass % 3) * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+}
+
+static inline bool same_position(const Vertex &a, const Vertex &b)
+{
+    return sort_key(a.x) == sort_key(b.x) &&
+           sort_key(a.y) == sort_key(b.y) &&
+           sort_key(a.z) == sort_key(b.z);
+}
+
+// Runs fn(t, begin, end) for each of threads equal slices of [0, n)
+template <typename F>
+static void for_slices(size_t n, unsigned threads, F fn)
+{
+    std::vector<std::future<void>> jobs;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        jobs.push_back(std::async(std::launch::async, fn, t, n * t / threads, n * (t + 1) / threads));
+    }
+    fn(0, 0, n / threads);
+    for (auto &job : jobs)
+    {
+        job.get();
+    }
+}
+
+// Stable parallel LSD radix sort of verts by position, using tmp as the
+// scatter buffer. Returns whichever of the two holds the sorted result.
+static Vertex* radix_sort(Vertex *verts, Vertex *tmp, size_t n, unsigned threads)
+{
+    typedef std::vector<size_t> Histogram;
+
+    // A digit that is the same for every vertex (e.g. the high exponent
+    // bits of a part near the origin) doesn't reorder anything, one counting
+    // pass up front finds those so their scatter passes can be skipped.
+    std::vector<Histogram> counts(threads, Histogram(RADIX_PASSES * RADIX_BUCKETS));
+    for_slices(n, threads, [&](unsigned t, size_t begin, size_t end) {
+        size_t *c = counts[t].data();
+        for (size_t i = begin; i < end; ++i)
+        {
+            for (unsigned pass = 0; pass < RADIX_PASSES; ++pass)
+            {
+                c[pass * RADIX_BUCKETS + radix_digit(verts[i], pass)]++;
+            }
+        }
+    });
+
+    Vertex *src = verts, *dst = tmp;
+    for (unsigned pass = 0; pass < RADIX_PASSES; ++pass)
+    {
+        bool trivial = false;
+        for (unsigned d = 0; d < RADIX_BUCKETS && !trivial; ++d)
+        {
+            size_t bucket = 0;
+            for (unsigned t = 0; t < threads; ++t)
+            {
+                bucket += counts[t][pass * RADIX_BUCKETS + d];
+            }
+            trivial = bucket == n;
+        }
+        if (trivial)
+        {
+            continue;
+        }
+
+        // Per-slice counts for this pass, the slices hold different vertices
+        // every pass so these can only come from the up front counts when
+        // there is a single slice.
+        std::vector<Histogram> offsets(threads, Histogram(RADIX_BUCKETS));
+        if (threads == 1)
+        {
+            std::copy(counts[0].begin() + pass * RADIX_BUCKETS,
+                      counts[0].begin() + (pass + 1) * RADIX_BUCKETS,
+                      offsets[0].begin());
+        }
+        else
+        {
+            for_slices(n, threads, [&](unsigned t, size_t begin, size_t end) {
+                size_t *c = offsets[t].data();
+                for (size_t i = begin; i < end; ++i)
+                {
+                    c[radix_digit(src[i], pass)]++;
+                }
+            });
+        }
+
+        // Bucket d of slice t starts after every smaller digit, and after
+        // digit d of every earlier slice, which keeps the sort stable.
+        size_t sum = 0;
+        for (unsigned d = 0; d < RADIX_BUCKETS; ++d)
+        {
+            for (unsigned t = 0; t < threads; ++t)
+            {
+                size_t c = offsets[t][d];
+                offsets[t][d] = sum;
+                sum += c;
+            }
+        }
+
+        for_slices(n, threads, [&](unsigned t, size_t begin, size_t end) {
+            size_t *o = offsets[t].data();
+            for (size_t i = begin; i < end; ++i)
+            {
+                dst[o[radix_digit(src[i], pass)]++] = src[i];
+            }
+        });
+        std::swap(src, dst);
+    }
+
+    return src;
+}
+
+Mesh* mesh_from_verts(unsigned int tri_count, std::vector<Vertex>& verts, unsigned threads)
+{
+    const size_t n = (size_t)tri_count * 3;
+
+    // Save indicies as the second element in the array
+    // (so that we can reconstruct triangle order after sorting)
+    for (size_t i=0; i < n; ++i)
+    {
+        verts[i].i = (unsigned int)i;
+    }
+
+    // Check how many threads the hardware can safely support. This may return
+    // 0 if the property can't be read so we shoud check for that too.
+    if (threads == 0)
+    {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0)
+    {
+        threads = 8;
+    }
+    if (n < DEDUPE_PARALLEL_MIN)
+    {
+        threads = 1;
+    }
+
+    // Sort the set of vertices (to deduplicate)
+    std::vector<Vertex> tmp(n);
+    const Vertex *sorted = radix_sort(verts.data(), tmp.data(), n, threads);
+
+    // Each slice counts the positions that start in it, a prefix sum over
+    // the slices then says where each slice's unique vertices go.
+    std::vector<size_t> starts(threads + 1, 0);
+    for_slices(n, threads, [&](unsigned t, size_t begin, size_t end) {
+        size_t count = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            count += (i == 0 || !same_position(sorted[i], sorted[i - 1]));
+        }
+        starts[t + 1] = count;
+    });
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        starts[t + 1] += starts[t];
+    }
+    const size_t vertex_count = starts[threads];
+
+    // This vector will store triangles as sets of 3 indices
+    std::vector<unsigned int> indices(n);
+    std::vector<float> flat_verts(vertex_count * 3);
+
+    // Go through the sorted vertex list, writing each unique position once
+    // and pointing every original corner at it.
+    for_slices(n, threads, [&](unsigned t, size_t begin, size_t end) {
+        size_t next = starts[t];
+        for (size_t i = begin; i < end; ++i)
+        {
+            const Vertex &v = sorted[i];
+            if (i == 0 || !same_position(v, sorted[i - 1]))
+            {
+                flat_verts[next * 3 + 0] = v.x;
+                flat_verts[next * 3 + 1] = v.y;
+                flat_verts[next * 3 + 2] = v.z;
+                next++;
+            }
+            indices[v.i] = (unsigned int)(next - 1);
+        }
+    });
+
+    return new Mesh(std::move(flat_verts), std::move(indices));
+}
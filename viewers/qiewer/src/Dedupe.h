@@ -0,0 +1,14 @@
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include <vector>
+
+#include "Mesh.h"
+#include "Vertex.h"
+
+// Builds an indexed mesh from tri_count triangles of unindexed vertices,
+// merging corners at the same position. verts is used as scratch space.
+// threads caps the workers, 0 uses every hardware thread.
+Mesh* mesh_from_verts(unsigned int tri_count, std::vector<Vertex>& verts, unsigned threads = 0);
+
+#endif // DEDUPE_H
@@ -1,8 +1,13 @@
 #include "loader.h"
 #include "Vertex.h"
+#include "Dedupe.h"
+#include "../../giewer/StlAscii.h"
 
+#include <cstring>
 #include <fstream>
-#include <sstream>
+#include <charconv>
+#include <algorithm>
+#include <string_view>
 
 #include <QDebug>
 
@@ -12,87 +17,20 @@ Loader::Loader()
 
 ////////////////////////////////////////////////////////////////////////////////
 
-/*void parallel_sort(Vertex* begin, Vertex* end, int threads)
-{
-    if (threads < 2 || end - begin < 2)
-    {
-        std::sort(begin, end);
-    }
-    else
-    {
-        const auto mid = begin + (end - begin) / 2;
-        if (threads == 2)
-        {
-            auto future = std::async(parallel_sort, begin, mid, threads / 2);
-            std::sort(mid, end);
-            future.wait();
-        }
-        else
-        {
-            auto a = std::async(std::launch::async, parallel_sort, begin, mid, threads / 2);
-            auto b = std::async(std::launch::async, parallel_sort, mid, end, threads / 2);
-            a.wait();
-            b.wait();
-        }
-        std::inplace_merge(begin, mid, end);
-    }
-}*/
-
-static Mesh* mesh_from_verts(unsigned int tri_count, std::vector<Vertex>& verts)
-{
-    // Save indicies as the second element in the array
-    // (so that we can reconstruct triangle order after sorting)
-    for (unsigned int i=0; i < tri_count*3; ++i)
-    {
-        verts[i].i = i;
-    }
-
-    // Check how many threads the hardware can safely support. This may return
-    // 0 if the property can't be read so we shoud check for that too.
-    /*auto threads = std::thread::hardware_concurrency();
-    if (threads == 0)
-    {
-        threads = 8;
-    }*/
-
-    // Sort the set of vertices (to deduplicate)
-    // parallel_sort(verts.begin(), verts.end(), threads);
-
-    // This vector will store triangles as sets of 3 indices
-    std::vector<unsigned int> indices(tri_count*3);
-
-    // Go through the sorted vertex list, deduplicating and creating
-    // an indexed geometry representation for the triangles.
-    // Unique vertices are moved so that they occupy the first vertex_count
-    // positions in the verts array.
-    unsigned int vertex_count = 0;
-    for (auto v : verts)
-    {
-        if (!vertex_count || v != verts[vertex_count-1])
-        {
-            verts[vertex_count++] = v;
-        }
-        indices[v.i] = vertex_count - 1;
-    }
-    verts.resize(vertex_count);
-
-    std::vector<float> flat_verts;
-    flat_verts.reserve(vertex_count*3);
-    for (auto v : verts)
-    {
-        flat_verts.push_back(v.x);
-        flat_verts.push_back(v.y);
-        flat_verts.push_back(v.z);
-    }
-
-    return new Mesh(std::move(flat_verts), std::move(indices));
-}
+// Binary STL layout: 80 byte header, uint32 triangle count, then one
+// 50 byte record per facet (normal, three vertices, uint16 attribute).
+static const size_t STL_HEADER_LEN = 80;
+static const size_t STL_PREAMBLE_LEN = STL_HEADER_LEN + sizeof(uint32_t);
+static const size_t STL_FACET_LEN = 12 * sizeof(float) + sizeof(uint16_t);
 
-////////////////////////////////////////////////////////////////////////////////
+// How much of an ASCII-looking header we wait for before deciding that a
+// "solid..." prefix is really the start of a binary header.
+static const size_t STL_SNIFF_MAX = 1024;
+static const size_t STL_STREAM_RESERVE_MAX = 16 * 1024 * 1024;
 
 Mesh* Loader::load_stl(const std::string &filename)
 {
-  std::ifstream file(filename, std::ifstream::in);
+  std::ifstream file(filename, std::ifstream::in | std::ifstream::binary);
   if (file.fail())
   {
     qDebug() << "Missing/bad file: ";
@@ -104,168 +42,182 @@ Mesh* Loader::load_stl(const std::string &filename)
 
 Mesh *Loader::load_stl(std::istream &input)
 {
-  const int HEADER_LEN(5);
-  char header[HEADER_LEN + 1];
+  StlParser parser;
+  char buf[64 * 1024];
+  while (input.read(buf, sizeof(buf)) || input.gcount() > 0)
+  {
+    if (!parser.feed(buf, (size_t)input.gcount())) {
+      break;
+    }
+  }
+  return parser.finish();
+}
 
-  input.seekg(0);
-  input.read(header, HEADER_LEN + 1);
+////////////////////////////////////////////////////////////////////////////////
 
-  if (std::string(header, HEADER_LEN) == "solid")
+StlParser::StlParser()
+{
+}
+
+bool StlParser::feed(const char *data, size_t size)
+{
+  if (_bad) {
+    return false;
+  }
+
+  // Parse straight out of the caller's buffer when nothing is carried
+  // over, only the unconsumed tail gets copied.
+  if (_pending.empty())
   {
-    std::string line;
-    
-    // Skip over rest of header line
-    input >> std::skipws >> line;
-    input >> std::skipws >> line;
-    
-    if (line.find("facet") == 0 ||
-        line.find ("endsolid") == 0)
-    {
-        input.seekg(0);
-        return read_stl_ascii(input);
-    }
-      // confusing_stl = true;
+    size_t used = consume(data, size, false);
+    _pending.assign(data + used, size - used);
   }
   else
   {
-      // confusing_stl = false;
+    _pending.append(data, size);
+    size_t used = consume(_pending.data(), _pending.size(), false);
+    _pending.erase(0, used);
   }
 
-  input.seekg(0);
-  return read_stl_binary(input);
+  return !_bad;
 }
 
-Mesh* Loader::read_stl_binary(std::istream &input)
+Mesh* StlParser::finish()
 {
-    /*QDataStream data(&file);
-    data.setByteOrder(QDataStream::LittleEndian);
-    data.setFloatingPointPrecision(QDataStream::SinglePrecision);
+  if (!_bad)
+  {
+    size_t used = consume(_pending.data(), _pending.size(), true);
+    _pending.erase(0, used);
+  }
 
-    // Load the triangle count from the .stl file
-    file.seek(80);
-    uint32_t tri_count;
-    data >> tri_count;
+  if (_bad || !_pending.empty() ||
+      (_format == BINARY && _verts.size() != _tri_count * (size_t)3))
+  {
+    //emit error_bad_stl();
+    return NULL;
+  }
 
-    // Verify that the file is the right size
-    if (file.size() != 84 + tri_count*50)
-    {
-        //emit error_bad_stl();
-        return NULL;
-    }
+  return mesh_from_verts((unsigned int)(_verts.size() / 3), _verts);
+}
 
-    // Extract vertices into an array of xyz, unsigned pairs
-    QVector<Vertex> verts(tri_count*3);
+bool StlParser::detect(const char *data, size_t size, bool final)
+{
+  const char *end = data + size;
 
-    // Dummy array, because readRawData is faster than skipRawData
-    std::unique_ptr<uint8_t> buffer(new uint8_t[tri_count * 50]);
-    data.readRawData((char*)buffer.get(), tri_count * 50);
+  if (size < 5 && !final) {
+    return false;
+  }
 
-    // Store vertices in the array, processing one triangle at a time.
-    auto b = buffer.get() + 3 * sizeof(float);
-    for (auto v=verts.begin(); v != verts.end(); v += 3)
-    {
-        // Load vertex data from .stl file into vertices
-        for (unsigned i=0; i < 3; ++i)
-        {
-            memcpy(&v[i], b, 3*sizeof(float));
-            b += 3 * sizeof(float);
-        }
-
-        // Skip face attribute and next face's normal vector
-        b += 3 * sizeof(float) + sizeof(uint16_t);
-    }
+  if (size < 5 || strncmp(data, "solid", 5) != 0)
+  {
+    _format = BINARY;
+    return true;
+  }
 
-    if (confusing_stl)
-    {
-        emit warning_confusing_stl();
+  // The token after the header line must start a facet
+  const char *nl = (const char *)memchr(data, '\n', size);
+  if (!nl)
+  {
+    if (size < STL_SNIFF_MAX && !final) {
+      return false;
     }
+    _format = BINARY;
+    return true;
+  }
 
-    return mesh_from_verts(tri_count, verts);*/
-    return NULL;
-}
-
-Mesh* Loader::read_stl_ascii(std::istream &input)
-{
-  auto nextLine = [&input]() -> std::string {
-    std::string line;
-
-    while (input.peek() == ' ')
-      input.get();
+  const char *p = stl_ascii::skip_space(nl, end);
+  if (end - p < 8 && !final) {
+    return false;
+  }
 
-    do {
-      std::getline(input, line);
-    }
-    while (line.size() == 0 && !input.eof());
-    return line;
+  auto startsWith = [p, end](const char *f) -> bool {
+    size_t n = strlen(f);
+    return (size_t)(end - p) >= n && strncmp(p, f, n) == 0;
   };
 
-  auto startsWith = [](std::string &s, std::string f) -> bool {
-    return s.find(f) == 0;
-  };
+  _format = (startsWith("facet") || startsWith("endsolid")) ? ASCII : BINARY;
+  return true;
+}
 
-  uint32_t tri_count = 0;
-  std::vector<Vertex> verts(tri_count*3);
+size_t StlParser::consume(const char *data, size_t size, bool final)
+{
+  const char *p = data, *end = data + size;
 
-  nextLine();
-  bool okay = true;
-  while (!input.eof() && okay)
+  if (_format == UNKNOWN)
   {
-    std::string line = nextLine();
-    if (startsWith(line, "endsolid")) {
-      break;
+    if (!detect(data, size, final)) {
+      return 0;
     }
-    
-    if (!startsWith(line, "facet normal") ||
-        !startsWith(nextLine(), "outer loop"))
-    {
-      okay = false;
-      break;
+    if (_format == ASCII) {
+      p = stl_ascii::skip_line(p, end);
     }
+  }
 
-    for (int i=0; i < 3; ++i)
+  if (_format == BINARY)
+  {
+    if (!_preamble)
     {
-      std::string tok;
-      std::istringstream l(nextLine());
-      
-      l >> tok;
-      if (tok != "vertex")
+      if (size < STL_PREAMBLE_LEN)
       {
-        okay = false;
-        break;
+        _bad = final;
+        return 0;
       }
+      memcpy(&_tri_count, data + STL_HEADER_LEN, sizeof(_tri_count));
+      _verts.reserve(std::min<size_t>(_tri_count, STL_STREAM_RESERVE_MAX) * 3);
+      _preamble = true;
+      p += STL_PREAMBLE_LEN;
+    }
 
-      try {
-        l >> tok; 
-        const float x = std::stof(tok);
-        l >> tok;
-        const float y = std::stof(tok);
-        l >> tok;
-        const float z = std::stof(tok);
-        verts.push_back(Vertex(x, y, z));
-      }
-      catch (std::invalid_argument) {
-        okay = false;
+    size_t facets = std::min<size_t>((end - p) / STL_FACET_LEN, _tri_count - _verts.size() / 3);
+    for (size_t i = 0; i < facets; ++i)
+    {
+      // Skip the facet normal, then three xyz triples
+      const char *b = p + 3 * sizeof(float);
+      for (unsigned j = 0; j < 3; ++j)
+      {
+        Vertex v;
+        memcpy(&v.x, b, 3 * sizeof(float));
+        _verts.push_back(v);
+        b += 3 * sizeof(float);
       }
+      p += STL_FACET_LEN;
     }
 
-    if (!startsWith(nextLine(), "endloop") ||
-        !startsWith(nextLine(), "endfacet"))
-    {
-      okay = false;
-      break;
+    // Anything after the last facet is padding, drop it
+    if (_verts.size() == _tri_count * (size_t)3) {
+      p = end;
     }
 
-    tri_count++;
+    return p - data;
   }
 
-  if (okay)
+  // Facets are only parsed up to the last complete "endfacet", otherwise a
+  // number split across two reads would be taken for a shorter one.
+  const char *safe = end;
+  if (!final)
   {
-      return mesh_from_verts(tri_count, verts);
+    size_t last = std::string_view(p, end - p).rfind("endfacet");
+    if (last == std::string_view::npos) {
+      return p - data;
+    }
+    safe = p + last + 8;
   }
-  else
+
+  Vertex facet[3];
+  for (;;)
   {
-      //emit error_bad_stl();
-      return NULL;
+    stl_ascii::Result r = stl_ascii::read_facet(p, safe, facet);
+    if (r == stl_ascii::END) {
+      break;
+    }
+    if (r == stl_ascii::BAD)
+    {
+      _bad = true;
+      break;
+    }
+    _verts.insert(_verts.end(), facet, facet + 3);
   }
-}
 
+  // Once endsolid is seen the rest of the input is ignored
+  return final ? size : p - data;
+}
@@ -5,6 +5,7 @@
 #include <string>
 
 #include "mesh.h"
+#include "Vertex.h"
 
 class Loader
 {
@@ -14,13 +15,37 @@ public:
     Mesh* load_stl(std::istream &);
     Mesh* load_stl(const std::string &);
 
-protected:
+private:
+    const std::string _filename;
+};
+
+// Push-style STL parser for data that arrives in pieces, e.g. off a socket.
+// The format is detected from the first bytes without seeking and facets
+// are parsed as soon as they are complete.
+class StlParser
+{
+public:
+    StlParser();
+
+    // Returns false once the input is known to be malformed
+    bool feed(const char *data, size_t size);
 
-    Mesh* read_stl_ascii(std::istream &);
-    Mesh* read_stl_binary(std::istream &);
+    // Flushes whatever is left and builds the mesh, NULL if the data was
+    // malformed or ended part way through a facet.
+    Mesh* finish();
 
 private:
-    const std::string _filename;
+    enum Format { UNKNOWN, ASCII, BINARY };
+
+    Format _format = UNKNOWN;
+    bool _bad = false;
+    bool _preamble = false;
+    uint32_t _tri_count = 0;
+    std::string _pending;
+    std::vector<Vertex> _verts;
+
+    bool detect(const char *data, size_t size, bool final);
+    size_t consume(const char *data, size_t size, bool final);
 };
 
 #endif // LOADER_H
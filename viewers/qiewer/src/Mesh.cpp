@@ -1,14 +1,8 @@
-#include <QFile>
-#include <QDataStream>
-#include <QVector3D>
-
-#include <cmath>
-
 #include "Mesh.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 
-Mesh::Mesh(std::vector<float> &v, std::vector<unsigned int> &i)
+Mesh::Mesh(std::vector<float> &&v, std::vector<unsigned int> &&i)
     : vertices(std::move(v)), indices(std::move(i))
 {
 }
\ No newline at end of file
@@ -6,7 +6,7 @@
 class Mesh
 {
 public:
-    Mesh(std::vector<float> &vertices, std::vector<unsigned int> &indices);
+    Mesh(std::vector<float> &&vertices, std::vector<unsigned int> &&indices);
 
     std::vector<float> vertices;
     std::vector<unsigned int> indices;